@@ -0,0 +1,85 @@
+#!/bin/sh
+# Loopback benchmark: client -> proxy -> server with no impairment.
+#
+#   ./bench.sh DIR [MESSAGES]                 run once against DIR/{client,server,proxy}
+#   ./bench.sh --report MESSAGES DIR [DIR...]  run each DIR and print a throughput table
+#
+# BENCH_IP, BENCH_SERVER_PORT and BENCH_PROXY_PORT override the loopback endpoints.
+# BENCH_PROXY_ARGS, BENCH_SERVER_ARGS and BENCH_CLIENT_ARGS are appended to each command line.
+# BENCH_STOP_TIMEOUT is how long the server and proxy get to exit after SIGINT (default 5 s).
+
+BENCH_IP=${BENCH_IP:-127.0.0.1}
+BENCH_SERVER_PORT=${BENCH_SERVER_PORT:-9100}
+BENCH_PROXY_PORT=${BENCH_PROXY_PORT:-9101}
+
+# SIGINT, then up to BENCH_STOP_TIMEOUT seconds to exit on their own, so
+# profiled builds get to write their .gcda files; SIGTERM only for stragglers
+BENCH_STOP_TIMEOUT=${BENCH_STOP_TIMEOUT:-5}
+
+stop() {
+    kill -INT "$@" 2> /dev/null
+    tries=$(( BENCH_STOP_TIMEOUT * 10 ))
+    while [ "$tries" -gt 0 ]; do
+        alive=""
+        for pid in "$@"; do
+            kill -0 "$pid" 2> /dev/null && alive="$alive $pid"
+        done
+        [ -n "$alive" ] || break
+        sleep 0.1
+        tries=$(( tries - 1 ))
+    done
+    for pid in "$@"; do
+        if kill -0 "$pid" 2> /dev/null; then
+            echo "$pid did not exit after SIGINT, sending SIGTERM" >&2
+            kill "$pid" 2> /dev/null
+        fi
+    done
+    wait "$@" 2> /dev/null
+}
+
+run_once() {
+    dir=$1
+    messages=$2
+
+    "$dir/server" --listen-ip "$BENCH_IP" --listen-port "$BENCH_SERVER_PORT" $BENCH_SERVER_ARGS > /dev/null 2>&1 &
+    server_pid=$!
+    "$dir/proxy" --listen-ip "$BENCH_IP" --listen-port "$BENCH_PROXY_PORT" \
+        --target-ip "$BENCH_IP" --target-port "$BENCH_SERVER_PORT" \
+        --client-drop 0 --server-drop 0 --client-delay 0 --server-delay 0 \
+        --client-delay-time-min 0 --client-delay-time-max 0 \
+        --server-delay-time-min 0 --server-delay-time-max 0 $BENCH_PROXY_ARGS > /dev/null 2>&1 &
+    proxy_pid=$!
+    sleep 0.3
+
+    start=$(date +%s%N)
+    seq 1 "$messages" | sed 's/^/benchmark message /' | \
+        "$dir/client" --target-ip "$BENCH_IP" --target-port "$BENCH_PROXY_PORT" \
+        --timeout 1 --max-retries 3 $BENCH_CLIENT_ARGS > /dev/null 2>&1
+    end=$(date +%s%N)
+
+    stop "$proxy_pid" "$server_pid"
+
+    elapsed_us=$(( (end - start) / 1000 ))
+    [ "$elapsed_us" -gt 0 ] || elapsed_us=1
+    echo "$elapsed_us"
+}
+
+if [ "$1" = "--report" ]; then
+    messages=$2
+    shift 2
+    baseline=""
+    printf "%-12s %12s %14s %10s\n" "variant" "elapsed_ms" "messages/s" "speedup"
+    for dir in "$@"; do
+        us=$(run_once "$dir" "$messages")
+        rate=$(( messages * 1000000 / us ))
+        [ -n "$baseline" ] || baseline=$rate
+        speedup=$(awk "BEGIN { printf \"%.2fx\", $rate / $baseline }")
+        printf "%-12s %12d %14d %10s\n" "$(basename "$dir")" $(( us / 1000 )) "$rate" "$speedup"
+    done
+else
+    if [ -z "$1" ]; then
+        echo "Usage: $0 DIR [MESSAGES] | --report MESSAGES DIR [DIR...]" >&2
+        exit 1
+    fi
+    run_once "$1" "${2:-10000}"
+fi
@@ -0,0 +1,182 @@
+#include "common.h"
+#include "cc.h"
+
+/*
+ * Congestion control for the windowed client. "reno" is slow start plus AIMD
+ * with the window halved on a duplicate-ACK loss and collapsed to one packet on
+ * a timeout. "delay" is Vegas-like: it estimates how many packets sit in
+ * queues from the gap between srtt and the lowest RTT seen and holds that
+ * between CC_DELAY_ALPHA and CC_DELAY_BETA, backing off like reno on loss.
+ */
+
+#define CC_INITIAL_WINDOW 2.0
+#define CC_MIN_SSTHRESH   2.0
+#define CC_DELAY_ALPHA    2.0
+#define CC_DELAY_BETA     4.0
+#define CC_DELAY_GAMMA    1.0
+
+static void reno_on_ack(cc_t *cc, int acked);
+static void reno_on_loss(cc_t *cc);
+static void reno_on_timeout(cc_t *cc);
+static void delay_on_ack(cc_t *cc, int acked);
+
+static const cc_ops_t cc_algorithms[] = {
+    {"reno", reno_on_ack, reno_on_loss, reno_on_timeout},
+    {"delay", delay_on_ack, reno_on_loss, reno_on_timeout},
+};
+
+const cc_ops_t *cc_find(const char *name) {
+
+    for(size_t i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]); i++) {
+        if(strcmp(cc_algorithms[i].name, name) == 0) {
+            return &cc_algorithms[i];
+        }
+    }
+
+    return NULL;
+}
+
+void cc_init(cc_t *cc, const cc_ops_t *ops, int max_window, long min_rto_us, long max_rto_us, const char *stats_file) {
+
+    memset(cc, 0, sizeof(*cc));
+    cc->ops = ops;
+    cc->cwnd = CC_INITIAL_WINDOW;
+    cc->ssthresh = max_window;
+    cc->max_window = max_window;
+    cc->min_rto_us = min_rto_us;
+    cc->max_rto_us = max_rto_us;
+    cc->rto_us = max_rto_us;
+    cc->started_ns = clock_now();
+
+    if(stats_file) {
+        cc->stats = fopen(stats_file, "w");
+        if(!cc->stats) {
+            perror("Failed to open congestion control stats file");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(cc->stats, "time_us,event,sequence,cwnd,ssthresh,srtt_us,rttvar_us,min_rtt_us,rto_us,in_flight\n");
+    }
+}
+
+void cc_close(cc_t *cc) {
+
+    if(cc->stats && fclose(cc->stats) != 0) {
+        perror("Error closing congestion control stats file");
+    }
+    cc->stats = NULL;
+}
+
+// RFC 6298 smoothing, clamped to [min_rto_us, max_rto_us]
+void cc_rtt_sample(cc_t *cc, double rtt_us) {
+
+    if(cc->srtt_us == 0) {
+        cc->srtt_us = rtt_us;
+        cc->rttvar_us = rtt_us / 2;
+        cc->min_rtt_us = rtt_us;
+    } else {
+        double error = cc->srtt_us - rtt_us;
+
+        cc->rttvar_us = 0.75 * cc->rttvar_us + 0.25 * (error < 0 ? -error : error);
+        cc->srtt_us = 0.875 * cc->srtt_us + 0.125 * rtt_us;
+        if(rtt_us < cc->min_rtt_us) {
+            cc->min_rtt_us = rtt_us;
+        }
+    }
+
+    cc->rto_us = (long)(cc->srtt_us + 4 * cc->rttvar_us);
+    if(cc->rto_us < cc->min_rto_us) {
+        cc->rto_us = cc->min_rto_us;
+    }
+    if(cc->rto_us > cc->max_rto_us) {
+        cc->rto_us = cc->max_rto_us;
+    }
+}
+
+void cc_on_ack(cc_t *cc, int acked) {
+    cc->ops->on_ack(cc, acked);
+    if(cc->cwnd > cc->max_window) {
+        cc->cwnd = cc->max_window;
+    }
+}
+
+void cc_on_loss(cc_t *cc) {
+    cc->ops->on_loss(cc);
+}
+
+// Also backs the RTO off; the next valid RTT sample recomputes it
+void cc_on_timeout(cc_t *cc) {
+    cc->ops->on_timeout(cc);
+    cc->rto_us *= 2;
+    if(cc->rto_us > cc->max_rto_us) {
+        cc->rto_us = cc->max_rto_us;
+    }
+}
+
+int cc_window(const cc_t *cc) {
+    int window = (int)cc->cwnd;
+
+    return window < 1 ? 1 : window;
+}
+
+void cc_record(cc_t *cc, const char *event, int sequence, int in_flight) {
+
+    if(!cc->stats) {
+        return;
+    }
+
+    fprintf(cc->stats, "%" PRId64 ",%s,%d,%.2f,%.2f,%.0f,%.0f,%.0f,%ld,%d\n", (clock_now() - cc->started_ns) / NS_PER_US, event,
+            sequence, cc->cwnd, cc->ssthresh, cc->srtt_us, cc->rttvar_us, cc->min_rtt_us, cc->rto_us, in_flight);
+}
+
+static void reno_on_ack(cc_t *cc, int acked) {
+
+    if(cc->cwnd < cc->ssthresh) {
+        cc->cwnd += acked;
+    } else {
+        cc->cwnd += (double)acked / cc->cwnd;
+    }
+}
+
+static void reno_on_loss(cc_t *cc) {
+
+    cc->ssthresh = cc->cwnd / 2;
+    if(cc->ssthresh < CC_MIN_SSTHRESH) {
+        cc->ssthresh = CC_MIN_SSTHRESH;
+    }
+    cc->cwnd = cc->ssthresh;
+}
+
+static void reno_on_timeout(cc_t *cc) {
+
+    reno_on_loss(cc);
+    cc->cwnd = 1;
+}
+
+static void delay_on_ack(cc_t *cc, int acked) {
+    double queued;
+
+    if(cc->srtt_us == 0) {
+        reno_on_ack(cc, acked);
+        return;
+    }
+
+    // Packets we estimate are sitting in queues rather than on the wire
+    queued = cc->cwnd * (cc->srtt_us - cc->min_rtt_us) / cc->srtt_us;
+
+    if(cc->cwnd < cc->ssthresh) {
+        if(queued < CC_DELAY_GAMMA) {
+            cc->cwnd += acked;
+            return;
+        }
+        cc->ssthresh = cc->cwnd;
+    }
+
+    if(queued < CC_DELAY_ALPHA) {
+        cc->cwnd += (double)acked / cc->cwnd;
+    } else if(queued > CC_DELAY_BETA) {
+        cc->cwnd -= (double)acked / cc->cwnd;
+        if(cc->cwnd < CC_MIN_SSTHRESH) {
+            cc->cwnd = CC_MIN_SSTHRESH;
+        }
+    }
+}
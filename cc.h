@@ -0,0 +1,47 @@
+#ifndef CC_H
+#define CC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct cc;
+
+/*
+ * A congestion controller reacts to three signals from the windowed client:
+ * newly acknowledged packets, a loss inferred from duplicate ACKs, and a
+ * retransmission timeout. It only moves cwnd/ssthresh; RTT estimation is
+ * shared and done in cc_rtt_sample().
+ */
+typedef struct cc_ops {
+    const char *name;
+    void (*on_ack)(struct cc *cc, int acked);
+    void (*on_loss)(struct cc *cc);
+    void (*on_timeout)(struct cc *cc);
+} cc_ops_t;
+
+typedef struct cc {
+    const cc_ops_t *ops;
+    double         cwnd;
+    double         ssthresh;
+    double         srtt_us;
+    double         rttvar_us;
+    double         min_rtt_us;
+    long           rto_us;
+    long           min_rto_us;
+    long           max_rto_us;
+    int            max_window;
+    FILE           *stats;
+    int64_t        started_ns;
+} cc_t;
+
+const cc_ops_t *cc_find(const char *name);
+void cc_init(cc_t *cc, const cc_ops_t *ops, int max_window, long min_rto_us, long max_rto_us, const char *stats_file);
+void cc_close(cc_t *cc);
+void cc_rtt_sample(cc_t *cc, double rtt_us);
+void cc_on_ack(cc_t *cc, int acked);
+void cc_on_loss(cc_t *cc);
+void cc_on_timeout(cc_t *cc);
+int cc_window(const cc_t *cc);
+void cc_record(cc_t *cc, const char *event, int sequence, int in_flight);
+
+#endif
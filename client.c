@@ -1,14 +1,89 @@
 #include "common.h"
 #include "log.h"
+#include "cc.h"
+#include "pace.h"
+#include "segment.h"
+#include "compress.h"
+#include "fec.h"
+#include "gf256.h"
+#include "hoptrace.h"
+#include <poll.h>
+#include <sys/random.h>
 #include <sys/time.h>
 
+typedef struct in_flight {
+    packet_t        packet;
+    int64_t         sent_ns;
+    int             attempts;
+} in_flight_t;
 
-static void parse_args(int argc,char *argv[], char **ip_address, char **port_str, char **timeout_str, char **max_retries_str);
+// Splits stdin into messages without stdio buffering, so it can sit in poll() next to the socket
+typedef struct line_reader {
+    char   buffer[LINE_LEN * 4];
+    size_t len;
+    int    eof;
+    int64_t read_ns;    // when the last read() returned; a line's queueing starts here
+} line_reader_t;
+
+typedef struct window_sender {
+    in_flight_t     slots[CLIENT_MAX_WINDOW];
+    int             base;           // oldest sequence not yet acknowledged or given up on
+    int             next;           // next new sequence to send
+    int             max_window;
+    int             dup_acks;
+    int             dup_threshold;  // duplicate ACKs that mean a packet was lost
+    int             in_recovery;
+    int             recover;        // highest sequence sent when recovery began
+    int64_t         timer_ns;       // retransmission timer for base
+    cc_t            cc;
+    pacer_t         pacer;
+    int             paced;
+    line_reader_t   reader;
+    segment_batch_t batch;
+    fec_encoder_t   fec;
+    int             coded;          // parity follows every fec.k data packets
+    packet_t        parity;
+    int             streams;
+    int             stream_next[MAX_STREAMS];   // next stream_sequence on each stream
+    packet_t        acks[SEGMENT_RECEIVE_PACKETS];   // one receive may carry several ACKs with GRO
+} window_sender_t;
+
+
+static void parse_args(int argc,char *argv[], char **ip_address, char **port_str, char **timeout_str, char **max_retries_str,
+                       char **cc_str, char **window_str, char **cc_stats_str, char **pace_str, int *use_tsc,
+                       char **rcvbuf_str, char **sndbuf_str, int *use_connect, int *use_gso,
+                       int *use_compress, char **dict_str, char **fec_str, char **streams_str, char **session_str, char **hop_trace_str);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
 static void parse_timeout_and_retries(char *timeout_str, char *max_retries_str, int *timeout, int *max_retries);
+static void parse_fec(const char *fec_str, int *k, int *m);
+static uint32_t choose_session(const char *session_str);
+static int open_session(int sock_fd, struct sockaddr *addr, socklen_t addr_len, int timeout, int max_retries);
+static uint32_t random_nonzero(void);
 static int fill_packet(packet_t *packet, int seq);
-static int receive_acknowledgement(int sock_fd, packet_t *ack_packet, struct sockaddr *addr, socklen_t *addr_len, double timeout_time, int *current_sequence);
-static void drain_socket(int sock_fd, int log);
+static void set_payload(packet_t *packet, const char *message);
+static int receive_acknowledgement(int sock_fd, packet_t *ack_packet, double timeout_time, int *current_sequence);
+static void drain_socket(int sock_fd);
+static void send_windowed(int sock_fd, struct sockaddr *addr, socklen_t addr_len, int max_retries, window_sender_t *sender);
+static int split_stream(char *message, int streams);
+static void send_message(window_sender_t *sender, int stream, const char *message, struct sockaddr *addr, socklen_t addr_len);
+static void transmit(window_sender_t *sender, int sequence, struct sockaddr *addr, socklen_t addr_len);
+static void send_parity(window_sender_t *sender, struct sockaddr *addr, socklen_t addr_len);
+static void handle_ack(window_sender_t *sender, int ack_sequence, struct sockaddr *addr, socklen_t addr_len);
+static void check_timeout(window_sender_t *sender, int max_retries, struct sockaddr *addr, socklen_t addr_len);
+static int read_stdin(line_reader_t *reader);
+static int next_line(line_reader_t *reader, char *message);
+
+// Latest SO_RXQ_OVFL count seen on the socket
+static uint32_t kernel_drops;
+
+// Set with --compress; NULL sends payloads as full-size text
+static compressor_t *compressor;
+
+// Stamped on every packet; ACKs for any other session are not ours
+static uint32_t session_id;
+
+// Per-packet timing records for merge_traces.py, NULL unless --hop-trace is given
+static hop_trace_t *hop_trace;
 
 int main(int argc, char *argv[]) {
 
@@ -18,8 +93,24 @@ int main(int argc, char *argv[]) {
     char                   *port_str;
     char                   *timeout_str;
     char                   *max_retries_str;
+    char                   *cc_str;
+    char                   *window_str;
+    char                   *cc_stats_str;
+    char                   *pace_str;
     struct sockaddr_storage addr;
     socklen_t               addr_len;
+    struct sockaddr        *peer;
+    socklen_t               peer_len;
+    int                     use_connect;
+    int                     use_gso;
+    int                     use_compress;
+    char                   *dict_str;
+    char                   *fec_str;
+    char                   *streams_str;
+    char                   *session_str;
+    char                   *hop_trace_str;
+    static compressor_t     compression;
+    static hop_trace_t      tracing;
     in_port_t               port;
     int                     timeout;
     int                     max_retries;
@@ -27,17 +118,40 @@ int main(int argc, char *argv[]) {
     int                     sequence_counter;
     struct timeval          socket_timevalue;
     int                     succesfully_received;
+    const cc_ops_t          *cc_ops;
+    int                     use_tsc;
+    char                   *rcvbuf_str;
+    char                   *sndbuf_str;
+    int                     rcvbuf;
+    int                     sndbuf;
+    static window_sender_t  sender;
 
 
     ip_address = NULL;
     port_str = NULL;
     timeout_str = NULL;
     max_retries_str = NULL;
+    cc_str = NULL;
+    window_str = NULL;
+    cc_stats_str = NULL;
+    pace_str = NULL;
+    use_tsc = 0;
+    rcvbuf_str = NULL;
+    sndbuf_str = NULL;
+    use_connect = 0;
+    use_gso = 0;
+    use_compress = 0;
+    dict_str = NULL;
+    fec_str = NULL;
+    streams_str = NULL;
+    session_str = NULL;
+    hop_trace_str = NULL;
     sequence_counter = 0;
     succesfully_received = 0;
 
     setup_signal_handler();
-    parse_args(argc, argv, &ip_address, &port_str, &timeout_str, &max_retries_str);
+    parse_args(argc, argv, &ip_address, &port_str, &timeout_str, &max_retries_str, &cc_str, &window_str, &cc_stats_str, &pace_str, &use_tsc, &rcvbuf_str, &sndbuf_str, &use_connect, &use_gso, &use_compress, &dict_str, &fec_str, &streams_str, &session_str, &hop_trace_str);
+    clock_init(use_tsc);
 
     convert_address(ip_address, &addr, &addr_len);
 
@@ -45,6 +159,34 @@ int main(int argc, char *argv[]) {
 
     parse_timeout_and_retries(timeout_str, max_retries_str, &timeout, &max_retries);
 
+    cc_ops = NULL;
+    if(cc_str) {
+        cc_ops = cc_find(cc_str);
+        if(!cc_ops) {
+            fprintf(stderr, "Unknown congestion control: %s\n", cc_str);
+            exit(EXIT_FAILURE);
+        }
+    } else if(window_str || cc_stats_str || pace_str || use_gso || fec_str || streams_str) {
+        fprintf(stderr, "--window, --cc-stats, --pace, --gso, --fec and --streams need --cc\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(use_compress) {
+        compressor_init(&compression, dict_str);
+        compressor = &compression;
+        if(dict_str) {
+            log_event(LOG_CLIENT, "Loaded %zu byte compression dictionary %08" PRIx32, compression.dict_len, compression.dict_id);
+        }
+    } else if(dict_str) {
+        fprintf(stderr, "--dict needs --compress\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(hop_trace_str) {
+        hop_trace_open(&tracing, hop_trace_str, HOP_CLIENT);
+        hop_trace = &tracing;
+    }
+
     sock_fd = create_socket(addr.ss_family, SOCK_DGRAM, 0);
     get_address_to_server(&addr, port);
 
@@ -56,7 +198,98 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    drain_socket(sock_fd, 0);
+    set_socket_buffers(sock_fd, rcvbuf_str ? (int) parse_unsigned(rcvbuf_str, "rcvbuf", MAX_SOCKET_BUFFER) : 0,
+                       sndbuf_str ? (int) parse_unsigned(sndbuf_str, "sndbuf", MAX_SOCKET_BUFFER) : 0);
+    socket_buffer_sizes(sock_fd, &rcvbuf, &sndbuf);
+    enable_drop_counter(sock_fd);
+    log_event(LOG_CLIENT, "Socket buffers: receive %d bytes, send %d bytes", rcvbuf, sndbuf);
+
+    // A connected socket sends without an address and only hears from the target
+    peer = (struct sockaddr *)&addr;
+    peer_len = addr_len;
+    if(use_connect) {
+        connect_socket(sock_fd, &addr, addr_len);
+        peer = NULL;
+        peer_len = 0;
+        log_event(LOG_CLIENT, "Socket connected to the target");
+    }
+
+    session_id = choose_session(session_str);
+    sequence_counter = open_session(sock_fd, peer, peer_len, timeout, max_retries);
+
+    if(cc_ops) {
+        long max_rto_us = timeout * 1000000L < CLIENT_MIN_RTO_US ? CLIENT_MIN_RTO_US : timeout * 1000000L;
+
+        sender.max_window = window_str ? (int) parse_unsigned(window_str, "window", CLIENT_MAX_WINDOW) : CLIENT_DEFAULT_WINDOW;
+        if(sender.max_window < 1) {
+            fprintf(stderr, "window must be at least 1\n");
+            exit(EXIT_FAILURE);
+        }
+
+        cc_init(&sender.cc, cc_ops, sender.max_window, CLIENT_MIN_RTO_US, max_rto_us, cc_stats_str);
+        sender.dup_threshold = 3;
+        sender.base = sequence_counter;
+        sender.next = sequence_counter;
+
+        sender.streams = streams_str ? (int) parse_unsigned(streams_str, "streams", MAX_STREAMS) : 1;
+        if(sender.streams < 1) {
+            fprintf(stderr, "streams must be at least 1\n");
+            exit(EXIT_FAILURE);
+        }
+        if(sender.streams > 1) {
+            log_event(LOG_CLIENT, "Sending on %d streams", sender.streams);
+        }
+        log_event(LOG_CLIENT, "Windowed sending with %s congestion control, window up to %d", cc_ops->name, sender.max_window);
+
+        if(pace_str) {
+            long rate = strcmp(pace_str, "auto") == 0 ? 0 : (long) parse_unsigned(pace_str, "pace", CLIENT_MAX_PACE_PPS);
+
+            if(rate == 0 && strcmp(pace_str, "auto") != 0) {
+                fprintf(stderr, "pace must be a rate above 0 or auto\n");
+                exit(EXIT_FAILURE);
+            }
+
+            pacer_init(&sender.pacer, rate);
+            sender.paced = 1;
+            log_event(LOG_CLIENT, rate ? "Pacing at %ld packets/s" : "Pacing from cwnd/srtt", rate);
+        }
+
+        segment_batch_init(&sender.batch, sock_fd, use_gso);
+        if(use_gso) {
+            segment_enable_gso(sock_fd);
+            segment_enable_gro(sock_fd);
+            log_event(LOG_CLIENT, "UDP segmentation offload on, up to %d packets per send", SEGMENT_MAX_COUNT);
+        }
+
+        if(fec_str) {
+            int k;
+            int m;
+
+            parse_fec(fec_str, &k, &m);
+            fec_encoder_init(&sender.fec, k, m);
+            sender.coded = 1;
+
+            // The rest of a group overtakes a lost packet before its parity can rebuild it
+            sender.dup_threshold = k + 2;
+            log_event(LOG_CLIENT, "Forward error correction: %d parity packets per %d data packets, %s kernel", m, k, gf256_kernel_name());
+        }
+
+        send_windowed(sock_fd, peer, peer_len, max_retries, &sender);
+        cc_close(&sender.cc);
+
+        if(use_gso) {
+            log_event(LOG_CLIENT, "Sent %" PRIu64 " packets in %" PRIu64 " sends", sender.batch.sent, sender.batch.sends);
+        }
+
+        if(sender.coded) {
+            log_event(LOG_CLIENT, "Sent %" PRIu64 " parity packets", sender.fec.parity_sent);
+        }
+
+        if(sender.paced) {
+            pacer_close(&sender.pacer);
+        }
+        exit_flag = 1;
+    }
 
     while (!exit_flag) {
         succesfully_received = 0;
@@ -66,16 +299,23 @@ int main(int argc, char *argv[]) {
             continue;
         };
 
+        // Late ACKs for this packet are wanted, so retransmits never drain
+        drain_socket(sock_fd);
+
         for (int attempt = 0; attempt <= max_retries; attempt++) {
 
-            drain_socket(sock_fd, 1);
+            clock_refresh();
 
             log_event(LOG_CLIENT, "Sending Packet %d, Attempt %d", packet.sequence, attempt + 1);
 
-            send_packet(sock_fd, &packet, (struct sockaddr *)&addr, addr_len);
+            if(hop_trace) {
+                packet.timestamp_ns = clock_now();
+                hop_trace_record(hop_trace, HOP_SENT, 0, &packet, packet.timestamp_ns);
+            }
+            send_packet(sock_fd, &packet, peer, peer_len);
             log_packet(LOG_CLIENT, "Sent", packet.sequence, packet.payload, 0);
 
-            succesfully_received = receive_acknowledgement(sock_fd, &ack_packet, (struct sockaddr *)&addr, &addr_len, socket_timevalue.tv_sec, &sequence_counter);
+            succesfully_received = receive_acknowledgement(sock_fd, &ack_packet, socket_timevalue.tv_sec, &sequence_counter);
                 
             if (succesfully_received){
                 break;
@@ -88,12 +328,24 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    log_event(LOG_CLIENT, "Kernel receive queue overflows: %" PRIu32, kernel_drops);
+    if(compressor) {
+        log_event(LOG_CLIENT, "Compressed %" PRIu64 " payload bytes to %" PRIu64, compressor->raw_bytes, compressor->compressed_bytes);
+        compressor_close(compressor);
+    }
+    if(hop_trace) {
+        log_event(LOG_CLIENT, "Wrote %" PRIu64 " hop trace records", hop_trace->records);
+        hop_trace_close(hop_trace);
+    }
     close_socket(sock_fd);
     log_close();
     return EXIT_SUCCESS;
 }
 
-static void parse_args(int argc,char *argv[], char **ip_address, char **port_str, char **timeout_str, char **max_retries_str) {
+static void parse_args(int argc,char *argv[], char **ip_address, char **port_str, char **timeout_str, char **max_retries_str,
+                       char **cc_str, char **window_str, char **cc_stats_str, char **pace_str, int *use_tsc,
+                       char **rcvbuf_str, char **sndbuf_str, int *use_connect, int *use_gso,
+                       int *use_compress, char **dict_str, char **fec_str, char **streams_str, char **session_str, char **hop_trace_str) {
     int opt;
     int option_index = 0;
     int ip_set = 0;
@@ -101,12 +353,42 @@ static void parse_args(int argc,char *argv[], char **ip_address, char **port_str
     int timeout_set = 0;
     int retries_set = 0;
     int log_set = 0;
+    int cc_set = 0;
+    int window_set = 0;
+    int cc_stats_set = 0;
+    int pace_set = 0;
+    int tsc_set = 0;
+    int rcvbuf_set = 0;
+    int sndbuf_set = 0;
+    int connect_set = 0;
+    int gso_set = 0;
+    int compress_set = 0;
+    int dict_set = 0;
+    int fec_set = 0;
+    int streams_set = 0;
+    int session_set = 0;
+    int hop_trace_set = 0;
 
     static struct option long_options[] = {
         {"target-ip", required_argument, 0, 1},
         {"target-port", required_argument, 0, 2},
         {"timeout", required_argument, 0, 3},
         {"max-retries", required_argument, 0, 4},
+        {"cc", required_argument, 0, 5},
+        {"window", required_argument, 0, 6},
+        {"cc-stats", required_argument, 0, 7},
+        {"pace", required_argument, 0, 8},
+        {"tsc", no_argument, 0, 9},
+        {"rcvbuf", required_argument, 0, 10},
+        {"sndbuf", required_argument, 0, 11},
+        {"connect", no_argument, 0, 12},
+        {"gso", no_argument, 0, 13},
+        {"compress", no_argument, 0, 14},
+        {"dict", required_argument, 0, 15},
+        {"fec", required_argument, 0, 16},
+        {"streams", required_argument, 0, 17},
+        {"session", required_argument, 0, 18},
+        {"hop-trace", required_argument, 0, 19},
         {"log", no_argument, 0, 'l'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -144,6 +426,111 @@ static void parse_args(int argc,char *argv[], char **ip_address, char **port_str
                 *max_retries_str = optarg;
                 retries_set = 1;
                 break;
+            case 5:
+                if(cc_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --cc");
+                }
+                *cc_str = optarg;
+                cc_set = 1;
+                break;
+            case 6:
+                if(window_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --window");
+                }
+                *window_str = optarg;
+                window_set = 1;
+                break;
+            case 7:
+                if(cc_stats_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --cc-stats");
+                }
+                *cc_stats_str = optarg;
+                cc_stats_set = 1;
+                break;
+            case 8:
+                if(pace_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --pace");
+                }
+                *pace_str = optarg;
+                pace_set = 1;
+                break;
+            case 9:
+                if(tsc_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --tsc");
+                }
+                *use_tsc = 1;
+                tsc_set = 1;
+                break;
+            case 10:
+                if(rcvbuf_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --rcvbuf");
+                }
+                *rcvbuf_str = optarg;
+                rcvbuf_set = 1;
+                break;
+            case 11:
+                if(sndbuf_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --sndbuf");
+                }
+                *sndbuf_str = optarg;
+                sndbuf_set = 1;
+                break;
+            case 12:
+                if(connect_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --connect");
+                }
+                *use_connect = 1;
+                connect_set = 1;
+                break;
+            case 13:
+                if(gso_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --gso");
+                }
+                *use_gso = 1;
+                gso_set = 1;
+                break;
+            case 14:
+                if(compress_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --compress");
+                }
+                *use_compress = 1;
+                compress_set = 1;
+                break;
+            case 15:
+                if(dict_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --dict");
+                }
+                *dict_str = optarg;
+                dict_set = 1;
+                break;
+            case 16:
+                if(fec_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --fec");
+                }
+                *fec_str = optarg;
+                fec_set = 1;
+                break;
+            case 17:
+                if(streams_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --streams");
+                }
+                *streams_str = optarg;
+                streams_set = 1;
+                break;
+            case 18:
+                if(session_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --session");
+                }
+                *session_str = optarg;
+                session_set = 1;
+                break;
+            case 19:
+                if(hop_trace_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --hop-trace");
+                }
+                *hop_trace_str = optarg;
+                hop_trace_set = 1;
+                break;
             case 'l':
                 if(log_set) {
                     usage(argv[0], EXIT_FAILURE, "Duplicate option: --log/-l");
@@ -185,6 +572,21 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char*
     fputs("  --target-port <port>     UDP port to listen on\n", stderr);
     fputs("  --timeout <seconds>      Timeout for client messaging\n", stderr);
     fputs("  --max-retries <number>   Maximum resend attempts\n", stderr);
+    fputs("  --cc <reno|delay>        Pipeline messages under this congestion control\n", stderr);
+    fputs("  --window <n>             Largest congestion window in packets (default 64)\n", stderr);
+    fputs("  --cc-stats <file>        Write cwnd and RTT as CSV on every window change\n", stderr);
+    fputs("  --pace <pps|auto>        Space packets at a fixed rate or at cwnd/srtt\n", stderr);
+    fputs("  --tsc                    Time with the calibrated TSC instead of CLOCK_MONOTONIC\n", stderr);
+    fputs("  --rcvbuf <bytes>         Socket receive buffer size (default: kernel)\n", stderr);
+    fputs("  --sndbuf <bytes>         Socket send buffer size (default: kernel)\n", stderr);
+    fputs("  --connect                connect() to the target and use send/recv\n", stderr);
+    fputs("  --gso                    Batch sends with UDP_SEGMENT and receive with UDP_GRO\n", stderr);
+    fputs("  --compress               Send payloads LZ-compressed and only as long as they need\n", stderr);
+    fputs("  --dict <file>            Prime compression with sample messages shared with the server\n", stderr);
+    fputs("  --fec <k:m>              Follow every k packets with m parity packets (k up to 64, m up to 16)\n", stderr);
+    fputs("  --streams <n>            Lines starting \"<stream>:\" go on that of n independently ordered streams\n", stderr);
+    fputs("  --session <id>           Resume this session, given in hex as printed, instead of starting a new one\n", stderr);
+    fputs("  --hop-trace <file>       Timestamp packets and record every send and ACK for merge_traces.py\n", stderr);
     fputs("  -l, --log                Enables logging\n", stderr);
     fputs("  -h, --help               Display this help message\n", stderr);
     exit(exit_code);
@@ -232,6 +634,126 @@ static void parse_timeout_and_retries(char *timeout_str, char *max_retries_str,
     *max_retries = (int) parsed_max_retries;
 }
 
+static void parse_fec(const char *fec_str, int *k, int *m) {
+    char data[16];
+    const char *colon = strchr(fec_str, ':');
+
+    if(!colon || (size_t)(colon - fec_str) >= sizeof(data)) {
+        fprintf(stderr, "fec must be given as k:m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(data, fec_str, (size_t)(colon - fec_str));
+    data[colon - fec_str] = '\0';
+
+    *k = (int) parse_unsigned(data, "fec data packets", FEC_MAX_DATA);
+    *m = (int) parse_unsigned(colon + 1, "fec parity packets", FEC_MAX_PARITY);
+
+    if(*k < 1 || *m < 1) {
+        fprintf(stderr, "fec needs at least one data and one parity packet\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * A new session gets a random nonzero id; 0 is what senders without one use.
+ * A resumed one is read in hex, the way the client and server print it.
+ */
+static uint32_t choose_session(const char *session_str) {
+    char *endptr;
+    uintmax_t id;
+
+    if(session_str) {
+        if(*session_str == '\0') {
+            fprintf(stderr, "session cannot be empty\n");
+            exit(EXIT_FAILURE);
+        }
+
+        errno = 0;
+        id = strtoumax(session_str, &endptr, BASE_SIXTEEN);
+
+        if(errno == ERANGE || id > UINT32_MAX || *session_str == '-') {
+            fprintf(stderr, "session out of range: %s\n", session_str);
+            exit(EXIT_FAILURE);
+        }
+
+        if(*endptr != '\0') {
+            fprintf(stderr, "Invalid character in session arg: %s\n", session_str);
+            exit(EXIT_FAILURE);
+        }
+
+        if(id == 0) {
+            fprintf(stderr, "session must be above 0\n");
+            exit(EXIT_FAILURE);
+        }
+        return (uint32_t) id;
+    }
+
+    return random_nonzero();
+}
+
+static uint32_t random_nonzero(void) {
+    uint32_t value = 0;
+
+    while(value == 0) {
+        if(getrandom(&value, sizeof(value), 0) != sizeof(value)) {
+            perror("getrandom failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return value;
+}
+
+/*
+ * Says hello and returns the sequence to send first. A new session offers 0;
+ * the server answers with the last sequence it delivered in order, which for
+ * a resumed session is wherever the previous run got to. Takes one round trip
+ * unless the hello or its reply is lost. Every attempt carries this run's
+ * epoch, so a copy that turns up late is not taken for a restart.
+ */
+static int open_session(int sock_fd, struct sockaddr *addr, socklen_t addr_len, int timeout, int max_retries) {
+    packet_t hello;
+    packet_t reply;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.session = session_id;
+    hello.stream_sequence = (int) random_nonzero();
+    hello.flags = PACKET_HELLO;
+    strcpy(hello.payload, "Hello");
+    hello.length = (uint16_t)(strlen(hello.payload) + 1);
+
+    for(int attempt = 0; attempt <= max_retries && !exit_flag; attempt++) {
+        int64_t start = clock_refresh();
+
+        log_event(LOG_CLIENT, "Sending hello for session %08" PRIx32 ", Attempt %d", session_id, attempt + 1);
+        send_packet(sock_fd, &hello, addr, addr_len);
+
+        while(clock_now() - start < timeout * NS_PER_SEC) {
+            ssize_t bytes_received = receive_datagram(sock_fd, &reply, sizeof(reply), 0, NULL, NULL, &kernel_drops);
+
+            clock_refresh();
+
+            if(bytes_received < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                perror("Error with Recvfrom");
+                exit(EXIT_FAILURE);
+            }
+
+            if(verify_packet(&reply, (size_t)bytes_received) && (reply.flags & PACKET_HELLO) && reply.session == session_id) {
+                log_event(LOG_CLIENT, "Session %08" PRIx32 " continues after Packet %d", session_id, reply.sequence);
+                fprintf(stderr, "Session %08" PRIx32 "\n", session_id);
+                return reply.sequence + 1;
+            }
+        }
+    }
+
+    fprintf(stderr, "No reply to the hello for session %08" PRIx32 " after %d attempts\n", session_id, max_retries + 1);
+    exit(EXIT_FAILURE);
+}
+
 static int fill_packet(packet_t *packet, int seq) {
 
     char message[LINE_LEN];
@@ -252,30 +774,58 @@ static int fill_packet(packet_t *packet, int seq) {
             continue;
         }
         
+        packet->session = session_id;
+        packet->timestamp_ns = 0;
         packet->sequence = seq;
-        strncpy(packet->payload, message, LINE_LEN);
-        packet->payload[LINE_LEN - 1] = '\0';
+        packet->window_base = seq;
+        packet->stream = 0;
+        packet->stream_sequence = seq;
+        set_payload(packet, message);
+
+        if(hop_trace) {
+            hop_trace_record(hop_trace, HOP_QUEUED, 0, packet, clock_refresh());
+        }
 
         return 1;
     }
 }
 
-static int receive_acknowledgement(int sock_fd, packet_t *ack_packet, struct sockaddr *addr, socklen_t *addr_len, double timeout_time, int *current_sequence) {
+static void set_payload(packet_t *packet, const char *message) {
+
+    if(compressor) {
+        compress_packet(compressor, packet, message);
+        return;
+    }
 
-    struct timeval start, now;
-    gettimeofday(&start, NULL);
+    packet->flags = 0;
+    packet->length = LINE_LEN;
+    strncpy(packet->payload, message, LINE_LEN);
+    packet->payload[LINE_LEN - 1] = '\0';
+}
+
+static int receive_acknowledgement(int sock_fd, packet_t *ack_packet, double timeout_time, int *current_sequence) {
+
+    int64_t start = clock_refresh();
     double elapsed = 0;
     double timeout_sec;
     timeout_sec = timeout_time;
 
     while(elapsed < timeout_sec) {
 
-    ssize_t bytes_received = recvfrom(sock_fd, ack_packet, sizeof(*ack_packet), 0, addr, addr_len);
+    // Where the reply came from is not asked for, so it can never change where the next packet goes
+    ssize_t bytes_received = receive_datagram(sock_fd, ack_packet, sizeof(*ack_packet), 0, NULL, NULL, &kernel_drops);
+
+        clock_refresh();
 
         if (bytes_received >= 0) {
-            if(ack_packet->sequence == *current_sequence) {
+            if(!verify_packet(ack_packet, (size_t)bytes_received)) {
+                log_packet(LOG_CLIENT, "Corrupted", ack_packet->sequence, ack_packet->payload, 0);
+            } else if(ack_packet->session == session_id && !(ack_packet->flags & PACKET_HELLO) && ack_packet->sequence == *current_sequence) {
 
                 (*current_sequence)++;
+                if(hop_trace) {
+                    hop_trace_record(hop_trace, HOP_ACKED, 1, ack_packet, clock_now());
+                }
                 log_packet(LOG_CLIENT, "Received", ack_packet->sequence, ack_packet->payload, 0);
                 log_event(LOG_CLIENT, "Acknowledgement: %s from Packet %d\n", ack_packet->payload, ack_packet->sequence);
                 return 1;
@@ -292,23 +842,23 @@ static int receive_acknowledgement(int sock_fd, packet_t *ack_packet, struct soc
             }
         }
 
-        gettimeofday(&now, NULL);
-        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec)/1e6;
+        elapsed = (double)(clock_now() - start) / NS_PER_SEC;
     }
 
     return 0;
 }
 
-static void drain_socket(int sock_fd, int log) {
+// Discards stale ACKs, but only once a zero-timeout poll says some are queued
+static void drain_socket(int sock_fd) {
     packet_t temp_ack;
-    struct sockaddr temp_addr;
-    socklen_t temp_len = sizeof(temp_addr);
+    struct pollfd pending = {sock_fd, POLLIN, 0};
 
-    while (recvfrom(sock_fd, &temp_ack, sizeof(temp_ack),
-                    MSG_DONTWAIT, &temp_addr, &temp_len) > 0) {
-        if(log) {
-            log_packet(LOG_CLIENT, "Ignored", temp_ack.sequence, temp_ack.payload, 0);
-        }
+    if(poll(&pending, 1, 0) <= 0) {
+        return;
+    }
+
+    while (receive_datagram(sock_fd, &temp_ack, sizeof(temp_ack), MSG_DONTWAIT, NULL, NULL, &kernel_drops) > 0) {
+        log_packet(LOG_CLIENT, "Ignored", temp_ack.sequence, temp_ack.payload, 0);
     }
 
     if (errno != EAGAIN && errno != EWOULDBLOCK) {
@@ -316,3 +866,352 @@ static void drain_socket(int sock_fd, int log) {
         exit(EXIT_FAILURE);
     }
 }
+
+/*
+ * Pipelined sending: up to min(cwnd, max_window) packets are in flight. The
+ * server's ACK carries the highest sequence it has delivered without a gap,
+ * so a new ACK value acknowledges everything up to it and a repeat of the
+ * last one means a later packet overtook a missing one. Three repeats trigger
+ * a fast retransmit; partial ACKs during recovery retransmit the next hole
+ * (NewReno). The oldest packet also has a retransmission timer; once it has
+ * been sent max_retries + 1 times it is given up on, and window_base tells the
+ * server to stop waiting for it.
+ */
+static void send_windowed(int sock_fd, struct sockaddr *addr, socklen_t addr_len, int max_retries, window_sender_t *sender) {
+
+    char message[LINE_LEN];
+
+    while(!exit_flag) {
+        struct pollfd fds[3];
+        nfds_t nfds = 1;
+        int window = cc_window(&sender->cc) < sender->max_window ? cc_window(&sender->cc) : sender->max_window;
+        int room;
+        int pacing_wait = 0;
+        int wait_ms = -1;
+
+        if(sender->paced) {
+            pacer_update(&sender->pacer, &sender->cc);
+        }
+
+        while(sender->next - sender->base < window) {
+            if(sender->paced && !pacer_ready(&sender->pacer, clock_now())) {
+                pacing_wait = 1;
+                break;
+            }
+
+            if(!next_line(&sender->reader, message)) {
+                break;
+            }
+
+            send_message(sender, split_stream(message, sender->streams), message, addr, addr_len);
+
+            if(sender->paced) {
+                pacer_sent(&sender->pacer, clock_now());
+            }
+        }
+
+        // No more data is coming to fill the last group
+        if(sender->coded && sender->fec.count && sender->reader.eof && sender->reader.len == 0) {
+            send_parity(sender, addr, addr_len);
+        }
+
+        // Everything queued this round leaves in as few sends as possible
+        segment_batch_flush(&sender->batch);
+
+        if(sender->reader.eof && sender->next == sender->base) {
+            break;
+        }
+
+        room = sender->next - sender->base < window;
+
+        fds[0].fd = sock_fd;
+        fds[0].events = POLLIN;
+
+        // Stdin only matters once the pacer lets the next packet out
+        if(pacing_wait) {
+            pacer_arm(&sender->pacer);
+            fds[1].fd = sender->pacer.timer_fd;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        } else if(room && !sender->reader.eof) {
+            fds[1].fd = STDIN_FILENO;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        }
+
+        if(sender->next != sender->base) {
+            int64_t remaining_ns = sender->timer_ns + sender->cc.rto_us * NS_PER_US - clock_now();
+
+            wait_ms = remaining_ns <= 0 ? 0 : (int)((remaining_ns + NS_PER_MS - 1) / NS_PER_MS);
+        }
+
+        if(poll(fds, nfds, wait_ms) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Error with poll");
+            exit(EXIT_FAILURE);
+        }
+
+        clock_refresh();
+
+        if(fds[0].revents & POLLIN) {
+            ssize_t bytes_received;
+            size_t segment_len;
+
+            while((bytes_received = segment_receive(sock_fd, sender->acks, sizeof(sender->acks), MSG_DONTWAIT, NULL, NULL, &kernel_drops, &segment_len)) >= 0) {
+                for(size_t offset = 0; offset < (size_t)bytes_received; offset += segment_len) {
+                    packet_t ack_packet;
+                    size_t len = (size_t)bytes_received - offset < segment_len ? (size_t)bytes_received - offset : segment_len;
+
+                    memcpy(&ack_packet, (char *)sender->acks + offset, len < sizeof(ack_packet) ? len : sizeof(ack_packet));
+                    if(!verify_packet(&ack_packet, len)) {
+                        log_packet(LOG_CLIENT, "Corrupted", ack_packet.sequence, ack_packet.payload, 0);
+                        continue;
+                    }
+                    if(ack_packet.session != session_id || (ack_packet.flags & PACKET_HELLO)) {
+                        log_packet(LOG_CLIENT, "Ignored", ack_packet.sequence, ack_packet.payload, 0);
+                        continue;
+                    }
+                    if(hop_trace) {
+                        hop_trace_record(hop_trace, HOP_ACKED, 1, &ack_packet, clock_now());
+                    }
+                    handle_ack(sender, ack_packet.sequence, addr, addr_len);
+                }
+            }
+
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error with recv");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if(pacing_wait) {
+            if(fds[1].revents & POLLIN) {
+                pacer_clear(&sender->pacer);
+            }
+        } else if(nfds == 2 && (fds[1].revents & (POLLIN | POLLHUP)) && !read_stdin(&sender->reader)) {
+            sender->reader.eof = 1;
+        }
+
+        check_timeout(sender, max_retries, addr, addr_len);
+    }
+}
+
+// Strips a leading "<stream>:" naming one of the streams and returns it; anything else goes on stream 0
+static int split_stream(char *message, int streams) {
+    char *end;
+    long stream;
+
+    if(streams < 2 || message[0] < '0' || message[0] > '9') {
+        return 0;
+    }
+
+    stream = strtol(message, &end, BASE_TEN);
+    if(*end != ':' || stream >= streams) {
+        return 0;
+    }
+
+    memmove(message, end + 1, strlen(end + 1) + 1);
+
+    return (int) stream;
+}
+
+/*
+ * Queues a message on a stream and sends it. The packet takes the next
+ * sequence of the association, which the window and ACKs run on, and the next
+ * stream_sequence of its stream, which is all the server orders it by.
+ */
+static void send_message(window_sender_t *sender, int stream, const char *message, struct sockaddr *addr, socklen_t addr_len) {
+    in_flight_t *slot = &sender->slots[sender->next % CLIENT_MAX_WINDOW];
+
+    slot->packet.session = session_id;
+    slot->packet.sequence = sender->next;
+    slot->packet.stream = (uint16_t) stream;
+    slot->packet.stream_sequence = sender->stream_next[stream]++;
+    set_payload(&slot->packet, message);
+    slot->attempts = 0;
+
+    if(hop_trace) {
+        int64_t queued_ns = sender->reader.read_ns < clock_now() ? sender->reader.read_ns : clock_now();
+
+        slot->packet.timestamp_ns = 0;
+        hop_trace_record(hop_trace, HOP_QUEUED, 0, &slot->packet, queued_ns);
+    }
+
+    if(sender->next == sender->base) {
+        sender->timer_ns = clock_now();
+    }
+
+    sender->next++;
+    transmit(sender, slot->packet.sequence, addr, addr_len);
+
+    // Parity covers first transmissions only; retransmits carry the same bytes
+    if(sender->coded && fec_encode(&sender->fec, &slot->packet)) {
+        send_parity(sender, addr, addr_len);
+    }
+}
+
+static void transmit(window_sender_t *sender, int sequence, struct sockaddr *addr, socklen_t addr_len) {
+    in_flight_t *slot = &sender->slots[sequence % CLIENT_MAX_WINDOW];
+
+    slot->attempts++;
+    slot->packet.window_base = sender->base;
+    slot->sent_ns = clock_now();
+
+    log_event(LOG_CLIENT, "Sending Packet %d, Attempt %d", sequence, slot->attempts);
+    if(hop_trace) {
+        slot->packet.timestamp_ns = slot->sent_ns;
+        hop_trace_record(hop_trace, HOP_SENT, 0, &slot->packet, slot->sent_ns);
+    }
+    slot->packet.checksum = packet_checksum(&slot->packet);
+    segment_batch_add(&sender->batch, &slot->packet, packet_wire_len(&slot->packet), addr, addr_len);
+    log_packet(LOG_CLIENT, "Sent", sequence, slot->packet.payload, 0);
+}
+
+// Parity is not tracked in the window: it is never retransmitted and never acknowledged
+static void send_parity(window_sender_t *sender, struct sockaddr *addr, socklen_t addr_len) {
+
+    for(int index = 0; index < sender->fec.m; index++) {
+        fec_parity_packet(&sender->fec, index, &sender->parity);
+        sender->parity.session = session_id;
+        sender->parity.timestamp_ns = 0;
+        sender->parity.window_base = sender->base;
+        sender->parity.checksum = packet_checksum(&sender->parity);
+        segment_batch_add(&sender->batch, &sender->parity, packet_wire_len(&sender->parity), addr, addr_len);
+        log_packet(LOG_CLIENT, "Sent parity", sender->parity.sequence, "Parity", 0);
+    }
+
+    fec_encoder_next(&sender->fec);
+}
+
+static void handle_ack(window_sender_t *sender, int ack_sequence, struct sockaddr *addr, socklen_t addr_len) {
+
+    if(ack_sequence >= sender->base && ack_sequence < sender->next) {
+        in_flight_t *newest = &sender->slots[ack_sequence % CLIENT_MAX_WINDOW];
+        int acked = ack_sequence - sender->base + 1;
+        int retransmitted = 0;
+
+        log_packet(LOG_CLIENT, "Received", ack_sequence, "Acknowledged", 0);
+
+        for(int sequence = sender->base; sequence <= ack_sequence; sequence++) {
+            retransmitted |= sender->slots[sequence % CLIENT_MAX_WINDOW].attempts > 1;
+        }
+
+        // Karn's rule, widened to the whole range: packets held behind a retransmitted hole would inflate the sample
+        if(!retransmitted) {
+            cc_rtt_sample(&sender->cc, (double)(clock_now() - newest->sent_ns) / NS_PER_US);
+        }
+
+        sender->base = ack_sequence + 1;
+        sender->dup_acks = 0;
+        sender->timer_ns = clock_now();
+
+        if(!sender->in_recovery) {
+            cc_on_ack(&sender->cc, acked);
+            cc_record(&sender->cc, "ack", ack_sequence, sender->next - sender->base);
+        } else if(ack_sequence >= sender->recover) {
+            sender->in_recovery = 0;
+            cc_record(&sender->cc, "recovered", ack_sequence, sender->next - sender->base);
+        } else {
+            cc_record(&sender->cc, "partial_ack", ack_sequence, sender->next - sender->base);
+            transmit(sender, sender->base, addr, addr_len);
+        }
+    } else if(ack_sequence == sender->base - 1 && sender->next != sender->base) {
+        log_packet(LOG_CLIENT, "Duplicate", ack_sequence, "Acknowledged", 0);
+
+        if(++sender->dup_acks == sender->dup_threshold && !sender->in_recovery) {
+            cc_on_loss(&sender->cc);
+            sender->in_recovery = 1;
+            sender->recover = sender->next - 1;
+            cc_record(&sender->cc, "loss", sender->base, sender->next - sender->base);
+            transmit(sender, sender->base, addr, addr_len);
+        }
+    } else {
+        log_packet(LOG_CLIENT, "Ignored", ack_sequence, "Acknowledged", 0);
+    }
+}
+
+static void check_timeout(window_sender_t *sender, int max_retries, struct sockaddr *addr, socklen_t addr_len) {
+    in_flight_t *oldest;
+
+    if(sender->next == sender->base) {
+        return;
+    }
+
+    if(clock_now() - sender->timer_ns < sender->cc.rto_us * NS_PER_US) {
+        return;
+    }
+
+    oldest = &sender->slots[sender->base % CLIENT_MAX_WINDOW];
+    sender->timer_ns = clock_now();
+    sender->dup_acks = 0;
+
+    if(oldest->attempts > max_retries) {
+        log_event(LOG_CLIENT, "Error: Failed to receive ACK for packet %d after %d attempts\n", sender->base, oldest->attempts);
+        sender->base++;
+        return;
+    }
+
+    cc_on_timeout(&sender->cc);
+    sender->in_recovery = 1;
+    sender->recover = sender->next - 1;
+    cc_record(&sender->cc, "timeout", sender->base, sender->next - sender->base);
+    transmit(sender, sender->base, addr, addr_len);
+}
+
+// Returns 0 at end of input
+static int read_stdin(line_reader_t *reader) {
+    ssize_t bytes_read;
+
+    if(reader->len == sizeof(reader->buffer)) {
+        return 1;
+    }
+
+    bytes_read = read(STDIN_FILENO, reader->buffer + reader->len, sizeof(reader->buffer) - reader->len);
+
+    if(bytes_read == -1) {
+        if(errno == EINTR || errno == EAGAIN) {
+            return 1;
+        }
+        perror("Error reading stdin");
+        exit(EXIT_FAILURE);
+    }
+
+    reader->len += (size_t) bytes_read;
+    reader->read_ns = clock_refresh();
+
+    return bytes_read > 0;
+}
+
+// Takes the next non-empty line, splitting lines too long for one packet like fgets() would
+static int next_line(line_reader_t *reader, char *message) {
+
+    for(;;) {
+        char *newline = memchr(reader->buffer, '\n', reader->len);
+        size_t len;
+        size_t consumed;
+
+        if(newline && (size_t)(newline - reader->buffer) < LINE_LEN) {
+            len = (size_t)(newline - reader->buffer);
+            consumed = len + 1;
+        } else if(reader->len >= LINE_LEN - 1) {
+            len = LINE_LEN - 1;
+            consumed = len;
+        } else if(reader->eof && reader->len > 0) {
+            len = reader->len;
+            consumed = len;
+        } else {
+            return 0;
+        }
+
+        memcpy(message, reader->buffer, len);
+        message[len] = '\0';
+        reader->len -= consumed;
+        memmove(reader->buffer, reader->buffer + consumed, reader->len);
+
+        if(len > 0) {
+            return 1;
+        }
+    }
+}
@@ -1,4 +1,47 @@
 #include "common.h"
+#include "crc32c.h"
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+/*
+ * Process-wide clock. clock_now() returns CLOCK_MONOTONIC nanoseconds as of
+ * the last clock_refresh(), which each event loop calls once per wake-up, so
+ * timers, deadlines and log records in one iteration share a single read.
+ * With clock_init(1) on a CPU with an invariant TSC, refreshes read the TSC
+ * instead, scaled by a rate calibrated against CLOCK_MONOTONIC at startup.
+ */
+#define CLOCK_TSC_CALIBRATION_NS (20 * NS_PER_MS)
+
+static int64_t clock_read_monotonic(void);
+static int clock_calibrate_tsc(void);
+
+static int64_t     (*clock_read)(void) = clock_read_monotonic;
+static _Thread_local int64_t clock_cached_ns;  // each thread refreshes its own
+static const char  *clock_source_name = "CLOCK_MONOTONIC";
+
+#if defined(__x86_64__)
+static uint64_t tsc_base;
+static int64_t  tsc_base_ns;
+static double   tsc_ns_per_tick;
+
+static int64_t clock_read_tsc(void) {
+    return tsc_base_ns + (int64_t)((double)(__rdtsc() - tsc_base) * tsc_ns_per_tick);
+}
+
+static int tsc_invariant(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (edx >> 8) & 1;
+}
+#endif
 
 volatile sig_atomic_t exit_flag = 0;
 
@@ -71,6 +114,31 @@ void parse_port(char *port_str, in_port_t *port) {
 
 }
 
+uintmax_t parse_unsigned(const char *str, const char *name, uintmax_t max) {
+    char *endptr;
+    uintmax_t value;
+
+    if (str == NULL || *str == '\0') {
+        fprintf(stderr, "%s cannot be empty\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    errno = 0;
+    value = strtoumax(str, &endptr, BASE_TEN);
+
+    if(errno == ERANGE || value > max || *str == '-') {
+        fprintf(stderr, "%s out of range: %s\n", name, str);
+        exit(EXIT_FAILURE);
+    }
+
+    if(*endptr != '\0') {
+        fprintf(stderr, "Invalid character in %s arg: %s\n", name, str);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
 int create_socket(int domain, int type, int protocol){
 
     int sockfd = socket(domain, type, protocol);
@@ -83,6 +151,79 @@ int create_socket(int domain, int type, int protocol){
     return sockfd;
 }
 
+// 0 keeps the kernel default. SO_*BUFFORCE lets root go past rmem_max/wmem_max
+void set_socket_buffers(int sock_fd, int rcvbuf, int sndbuf) {
+
+    if(rcvbuf && setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1 &&
+       setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+        perror("Setting SO_RCVBUF failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if(sndbuf && setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)) == -1 &&
+       setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == -1) {
+        perror("Setting SO_SNDBUF failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// What the kernel actually granted, which Linux reports as double the request
+void socket_buffer_sizes(int sock_fd, int *rcvbuf, int *sndbuf) {
+    socklen_t len = sizeof(*rcvbuf);
+
+    if(getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, rcvbuf, &len) == -1 ||
+       getsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, sndbuf, &len) == -1) {
+        perror("Reading socket buffer sizes failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Every datagram then carries the socket's running count of receive queue overflows
+void enable_drop_counter(int sock_fd) {
+    int on = 1;
+
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1) {
+        perror("Setting SO_RXQ_OVFL failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void read_drop_counter(struct msghdr *msg, uint32_t *kernel_drops) {
+
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(kernel_drops, CMSG_DATA(cmsg), sizeof(*kernel_drops));
+        }
+    }
+}
+
+// recvfrom() that also picks up the SO_RXQ_OVFL count; addr may be NULL
+ssize_t receive_datagram(int sock_fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len, uint32_t *kernel_drops) {
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    ssize_t received;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr ? *addr_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    received = recvmsg(sock_fd, &msg, flags);
+
+    if(received >= 0) {
+        if(addr) {
+            *addr_len = msg.msg_namelen;
+        }
+        read_drop_counter(&msg, kernel_drops);
+    }
+
+    return received;
+}
+
 void bind_socket(int sock_fd, struct sockaddr_storage *addr, in_port_t port) {
 
     char addr_str[INET6_ADDRSTRLEN];
@@ -128,6 +269,77 @@ void bind_socket(int sock_fd, struct sockaddr_storage *addr, in_port_t port) {
     printf("Bound to socket %s:%u\n", addr_str, port);
 }
 
+/*
+ * Dual stack: one AF_INET6 socket with IPV6_V6ONLY off also takes IPv4, whose
+ * peers then show up as ::ffff:a.b.c.d. An IPv4 listen address is moved to
+ * that form first, 0.0.0.0 becoming ::, so the socket can be IPv6.
+ */
+void dual_stack_address(struct sockaddr_storage *addr, socklen_t *addr_len) {
+    struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *ipv6_addr = (struct sockaddr_in6 *)addr;
+    in_port_t port;
+
+    if(addr->ss_family == AF_INET && ipv4_addr->sin_addr.s_addr == htonl(INADDR_ANY)) {
+        port = ipv4_addr->sin_port;
+        memset(addr, 0, sizeof(*addr));
+        ipv6_addr->sin6_family = AF_INET6;
+        ipv6_addr->sin6_port = port;
+        *addr_len = sizeof(*ipv6_addr);
+        return;
+    }
+
+    map_address(addr, addr_len);
+}
+
+void enable_dual_stack(int sock_fd) {
+    int off = 0;
+
+    if(setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == -1) {
+        perror("Clearing IPV6_V6ONLY failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// A v4-mapped peer back to plain IPv4, so one IPv4 client has one address whichever socket saw it
+void normalize_address(struct sockaddr_storage *addr, socklen_t *addr_len) {
+    struct sockaddr_in6 ipv6_addr;
+    struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)addr;
+
+    if(addr->ss_family != AF_INET6) {
+        return;
+    }
+
+    memcpy(&ipv6_addr, addr, sizeof(ipv6_addr));
+    if(!IN6_IS_ADDR_V4MAPPED(&ipv6_addr.sin6_addr)) {
+        return;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    ipv4_addr->sin_family = AF_INET;
+    ipv4_addr->sin_port = ipv6_addr.sin6_port;
+    memcpy(&ipv4_addr->sin_addr, &ipv6_addr.sin6_addr.s6_addr[12], 4);
+    *addr_len = sizeof(*ipv4_addr);
+}
+
+// The reverse, for sending to a normalized IPv4 peer from a dual-stack socket
+void map_address(struct sockaddr_storage *addr, socklen_t *addr_len) {
+    struct sockaddr_in ipv4_addr;
+    struct sockaddr_in6 *ipv6_addr = (struct sockaddr_in6 *)addr;
+
+    if(addr->ss_family != AF_INET) {
+        return;
+    }
+
+    memcpy(&ipv4_addr, addr, sizeof(ipv4_addr));
+    memset(addr, 0, sizeof(*addr));
+    ipv6_addr->sin6_family = AF_INET6;
+    ipv6_addr->sin6_port = ipv4_addr.sin_port;
+    ipv6_addr->sin6_addr.s6_addr[10] = 0xff;
+    ipv6_addr->sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&ipv6_addr->sin6_addr.s6_addr[12], &ipv4_addr.sin_addr, 4);
+    *addr_len = sizeof(*ipv6_addr);
+}
+
 void get_address_to_server(struct sockaddr_storage *addr, in_port_t port) {
 
     if(addr->ss_family == AF_INET) {
@@ -147,9 +359,25 @@ void get_address_to_server(struct sockaddr_storage *addr, in_port_t port) {
     }
 }
 
+// Fixes the peer so sends need no address and the kernel discards datagrams from anyone else
+void connect_socket(int sock_fd, struct sockaddr_storage *addr, socklen_t addr_len) {
+
+    if(connect(sock_fd, (struct sockaddr *)addr, addr_len) == -1) {
+        perror("Connecting socket failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
 void send_packet(int sock_fd, packet_t *packet, struct sockaddr *addr, socklen_t addr_len) {
 
-    ssize_t bytes_sent = sendto(sock_fd, packet, sizeof(*packet), 0, addr, addr_len);
+    packet->checksum = packet_checksum(packet);
+    forward_packet(sock_fd, packet, packet_wire_len(packet), addr, addr_len);
+}
+
+// Sends len bytes exactly as given, without restamping the checksum; a NULL addr means the socket is connected
+void forward_packet(int sock_fd, const void *data, size_t len, struct sockaddr *addr, socklen_t addr_len) {
+
+    ssize_t bytes_sent = addr ? sendto(sock_fd, data, len, 0, addr, addr_len) : send(sock_fd, data, len, 0);
 
     if(bytes_sent == -1) {
         perror("Error sending packet to server");
@@ -157,6 +385,22 @@ void send_packet(int sock_fd, packet_t *packet, struct sockaddr *addr, socklen_t
     }
 }
 
+// Header plus the payload bytes it declares; a corrupted length is capped at a full payload
+size_t packet_wire_len(const packet_t *packet) {
+    return PACKET_HEADER_LEN + (packet->length < PACKET_PAYLOAD_MAX ? packet->length : PACKET_PAYLOAD_MAX);
+}
+
+// CRC32C over everything on the wire after the checksum field itself
+uint32_t packet_checksum(const packet_t *packet) {
+    return crc32c(0, (const char *)packet + sizeof(packet->checksum), packet_wire_len(packet) - sizeof(packet->checksum));
+}
+
+// len is what was received; it has to match the length the header declares
+int verify_packet(const packet_t *packet, size_t len) {
+    return len >= PACKET_HEADER_LEN && packet->length <= PACKET_PAYLOAD_MAX && len == packet_wire_len(packet) &&
+           packet->checksum == packet_checksum(packet);
+}
+
 void close_socket(int sock_fd) {
 
     printf("Closing socket %d\n", sock_fd);
@@ -165,4 +409,60 @@ void close_socket(int sock_fd) {
         perror("Error closing socket");
         exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+}
+
+void clock_init(int use_tsc) {
+
+    if(use_tsc && !clock_calibrate_tsc()) {
+        fprintf(stderr, "No invariant TSC, using CLOCK_MONOTONIC\n");
+    }
+
+    clock_refresh();
+}
+
+int64_t clock_refresh(void) {
+    clock_cached_ns = clock_read();
+    return clock_cached_ns;
+}
+
+int64_t clock_now(void) {
+    return clock_cached_ns ? clock_cached_ns : clock_refresh();
+}
+
+const char *clock_source(void) {
+    return clock_source_name;
+}
+
+// Returns 0 if the TSC cannot stand in for CLOCK_MONOTONIC
+static int clock_calibrate_tsc(void) {
+#if defined(__x86_64__)
+    struct timespec pause = {0, CLOCK_TSC_CALIBRATION_NS};
+    int64_t start_ns;
+    uint64_t start_tsc;
+
+    if(!tsc_invariant()) {
+        return 0;
+    }
+
+    start_ns = clock_read_monotonic();
+    start_tsc = __rdtsc();
+    nanosleep(&pause, NULL);
+    tsc_base_ns = clock_read_monotonic();
+    tsc_base = __rdtsc();
+    tsc_ns_per_tick = (double)(tsc_base_ns - start_ns) / (double)(tsc_base - start_tsc);
+
+    clock_read = clock_read_tsc;
+    clock_source_name = "TSC";
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int64_t clock_read_monotonic(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
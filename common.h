@@ -4,12 +4,36 @@
 #define LINE_LEN 1024
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
 #define BASE_TEN 10
+#define BASE_SIXTEEN 16
 #define MAX_TIMEOUT 100
 #define MAX_RETRIES 100
 #define MIN_INT_PARSE 0
 #define MAX_INT_PARSE 100000
 #define PROXY_TIMEOUT_S 1
 #define PROXY_TIMEOUT_US 0
+#define PROXY_URING_ENTRIES 256
+#define PROXY_URING_BUFFERS 256
+#define PROXY_REORDER_HOLD_MS 100
+#define PROXY_QUEUE_LIMIT (64 * 1024 * 1024)     // default bytes of delayed packets per direction
+#define PROXY_MAX_QUEUE_LIMIT (1ULL << 40)
+#define SERVER_ACK_DELAY_US 40000
+#define MAX_ACK_EVERY 1024
+#define MAX_ACK_DELAY_US 1000000
+#define CLIENT_MAX_WINDOW 256
+#define CLIENT_DEFAULT_WINDOW 64
+#define CLIENT_MIN_RTO_US 20000
+#define CLIENT_MAX_PACE_PPS 10000000
+#define SERVER_REORDER_SLOTS CLIENT_MAX_WINDOW
+#define MAX_STREAMS 256
+#define SERVER_PIPELINE_SLOTS 1024
+#define SERVER_PIPELINE_BATCH 64
+#define SERVER_MAX_SESSIONS 16
+#define SERVER_MAX_WORKERS 64
+#define SERVER_WORKER_SLOTS 256
+#define MAX_SOCKET_BUFFER (64 * 1024 * 1024)
+#define NS_PER_SEC INT64_C(1000000000)
+#define NS_PER_MS INT64_C(1000000)
+#define NS_PER_US INT64_C(1000)
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,22 +46,61 @@
 #include <inttypes.h> 
 #include <signal.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PACKET_COMPRESSED 0x1   // payload is an LZ block, see compress.c
+#define PACKET_DICTIONARY 0x2   // ... primed with the shared dictionary whose id leads it
+#define PACKET_PARITY     0x4   // FEC parity over a group of data packets, see fec.c
+#define PACKET_HELLO      0x8   // opens or resumes a session; the reply carries where it stands
+
+// A parity packet's own header and a coded data header ride on top of a full payload
+#define PACKET_PAYLOAD_MAX (LINE_LEN + 16)
 
 typedef struct packet {
+    uint32_t checksum;
+    uint32_t session;   // 0 for a sender that never said hello
+    int64_t timestamp_ns;   // sender's clock at transmission with --hop-trace, echoed in ACKs; otherwise 0
     int sequence;
-    char payload[LINE_LEN];
+    int window_base;    // lowest sequence the sender has not given up on
+    int stream_sequence;    // order within the stream; sequence orders the whole association; a hello's run epoch
+    uint16_t stream;
+    uint16_t flags;
+    uint16_t length;    // payload bytes on the wire
+    char payload[PACKET_PAYLOAD_MAX];
 } packet_t;
 
+#define PACKET_HEADER_LEN offsetof(packet_t, payload)
+
 extern volatile sig_atomic_t exit_flag;
 void setup_signal_handler(void);
 static void sigint_handler(int signum);
 void convert_address(const char *ip_address, struct sockaddr_storage *addr, socklen_t *addr_len);
 void parse_port(char *port_str, in_port_t *port);
+uintmax_t parse_unsigned(const char *str, const char *name, uintmax_t max);
 int create_socket(int domain, int type, int protocol);
 void bind_socket(int sock_fd, struct sockaddr_storage *addr, in_port_t port);
+void set_socket_buffers(int sock_fd, int rcvbuf, int sndbuf);
+void socket_buffer_sizes(int sock_fd, int *rcvbuf, int *sndbuf);
+void enable_drop_counter(int sock_fd);
+void read_drop_counter(struct msghdr *msg, uint32_t *kernel_drops);
+ssize_t receive_datagram(int sock_fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len, uint32_t *kernel_drops);
+void dual_stack_address(struct sockaddr_storage *addr, socklen_t *addr_len);
+void enable_dual_stack(int sock_fd);
+void normalize_address(struct sockaddr_storage *addr, socklen_t *addr_len);
+void map_address(struct sockaddr_storage *addr, socklen_t *addr_len);
 void get_address_to_server(struct sockaddr_storage *addr, in_port_t port);
+void connect_socket(int sock_fd, struct sockaddr_storage *addr, socklen_t addr_len);
 void send_packet(int sock_fd, packet_t *packet, struct sockaddr *addr, socklen_t addr_len);
+void forward_packet(int sock_fd, const void *data, size_t len, struct sockaddr *addr, socklen_t addr_len);
+size_t packet_wire_len(const packet_t *packet);
+uint32_t packet_checksum(const packet_t *packet);
+int verify_packet(const packet_t *packet, size_t len);
 void close_socket(int sock_fd);
+void clock_init(int use_tsc);
+int64_t clock_refresh(void);
+int64_t clock_now(void);
+const char *clock_source(void);
 
 
 
@@ -0,0 +1,339 @@
+#include "common.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "log.h"
+
+/*
+ * Each sequence is a token (literal count in the high nibble, match length
+ * minus COMPRESS_MIN_MATCH in the low one, 15 meaning "more in 255-run bytes
+ * that follow"), the literals, then a little-endian 16-bit offset back into
+ * the window. The final sequence is literals only. With a dictionary the
+ * payload starts with its 32-bit id so a mismatched peer fails loudly.
+ */
+
+#define COMPRESS_MIN_MATCH     4
+#define COMPRESS_LAST_LITERALS 5
+#define COMPRESS_NO_POSITION   UINT32_MAX
+
+static uint32_t hash4(const unsigned char *p);
+static unsigned char *put_length(unsigned char *op, const unsigned char *op_end, size_t len);
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *op_end, const unsigned char *literals, size_t literal_len,
+                                   size_t match_len, size_t offset);
+static size_t compress_block(compressor_t *compressor, const char *src, size_t len, unsigned char *dst, size_t capacity);
+static ssize_t decompress_block(compressor_t *compressor, const unsigned char *src, size_t len, size_t capacity);
+static void load_dictionary(compressor_t *compressor, const char *dict_file);
+
+void compressor_init(compressor_t *compressor, const char *dict_file) {
+
+    memset(compressor, 0, sizeof(*compressor));
+
+    for(size_t i = 0; i < COMPRESS_HASH_SIZE; i++) {
+        compressor->dict_table[i] = COMPRESS_NO_POSITION;
+    }
+
+    if(dict_file) {
+        load_dictionary(compressor, dict_file);
+        return;
+    }
+
+    compressor->window = malloc(LINE_LEN);
+    if(!compressor->window) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void compressor_close(compressor_t *compressor) {
+    free(compressor->window);
+    compressor->window = NULL;
+}
+
+// Fills in the payload, compressed when that is smaller than the text itself
+void compress_packet(compressor_t *compressor, packet_t *packet, const char *message) {
+    size_t len = strnlen(message, LINE_LEN - 1);
+    size_t header = compressor->dict_len ? sizeof(compressor->dict_id) : 0;
+    size_t compressed = 0;
+
+    // Only worth it if the id and the block together come in under the text and its NUL
+    if(len > header) {
+        compressed = compress_block(compressor, message, len, (unsigned char *)packet->payload + header, len - header);
+    }
+    compressor->raw_bytes += len + 1;
+
+    if(compressed) {
+        packet->flags = PACKET_COMPRESSED;
+        if(header) {
+            packet->flags |= PACKET_DICTIONARY;
+            memcpy(packet->payload, &compressor->dict_id, header);
+        }
+        packet->length = (uint16_t)(header + compressed);
+    } else {
+        packet->flags = 0;
+        memcpy(packet->payload, message, len);
+        packet->payload[len] = '\0';
+        packet->length = (uint16_t)(len + 1);
+    }
+
+    compressor->compressed_bytes += packet->length;
+}
+
+// Replaces a compressed payload with its text; returns 0 if it cannot be decoded here
+int decompress_packet(compressor_t *compressor, packet_t *packet) {
+    const unsigned char *src = (const unsigned char *)packet->payload;
+    size_t len = packet->length;
+    ssize_t produced;
+
+    if(!(packet->flags & PACKET_COMPRESSED)) {
+        return 1;
+    }
+
+    if(packet->flags & PACKET_DICTIONARY) {
+        uint32_t dict_id;
+
+        if(len < sizeof(dict_id)) {
+            return 0;
+        }
+        memcpy(&dict_id, src, sizeof(dict_id));
+        if(!compressor->dict_len || dict_id != compressor->dict_id) {
+            log_event(LOG_SERVER, "Packet %d was compressed with dictionary %08" PRIx32 ", which is not loaded", packet->sequence, dict_id);
+            return 0;
+        }
+        src += sizeof(dict_id);
+        len -= sizeof(dict_id);
+    }
+
+    produced = decompress_block(compressor, src, len, LINE_LEN - 1);
+    if(produced < 0) {
+        return 0;
+    }
+
+    memcpy(packet->payload, compressor->window + compressor->dict_len, (size_t)produced);
+    packet->payload[produced] = '\0';
+    packet->flags &= (uint16_t)~(PACKET_COMPRESSED | PACKET_DICTIONARY);
+    packet->length = (uint16_t)(produced + 1);
+
+    return 1;
+}
+
+static uint32_t hash4(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return (v * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, const unsigned char *op_end, size_t len) {
+
+    for(; len >= 255; len -= 255) {
+        if(op == op_end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+
+    if(op == op_end) {
+        return NULL;
+    }
+    *op++ = (unsigned char) len;
+
+    return op;
+}
+
+// match_len 0 writes the closing literals-only sequence
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *op_end, const unsigned char *literals, size_t literal_len,
+                                   size_t match_len, size_t offset) {
+    size_t match_code = match_len ? match_len - COMPRESS_MIN_MATCH : 0;
+    unsigned char *token = op;
+
+    if(op == op_end) {
+        return NULL;
+    }
+    op++;
+
+    *token = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4 | (match_code < 15 ? match_code : 15));
+
+    if(literal_len >= 15 && !(op = put_length(op, op_end, literal_len - 15))) {
+        return NULL;
+    }
+
+    if((size_t)(op_end - op) < literal_len) {
+        return NULL;
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if(!match_len) {
+        return op;
+    }
+
+    if(op_end - op < 2) {
+        return NULL;
+    }
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+
+    if(match_code >= 15 && !(op = put_length(op, op_end, match_code - 15))) {
+        return NULL;
+    }
+
+    return op;
+}
+
+// Returns the compressed size, or 0 if it would not fit in capacity
+static size_t compress_block(compressor_t *compressor, const char *src, size_t len, unsigned char *dst, size_t capacity) {
+    unsigned char *window = compressor->window;
+    size_t base = compressor->dict_len;
+    size_t end = base + len;
+    size_t ip = base;
+    size_t anchor = base;
+    unsigned char *op = dst;
+    const unsigned char *op_end = dst + capacity;
+
+    memcpy(compressor->table, compressor->dict_table, sizeof(compressor->table));
+    memcpy(window + base, src, len);
+
+    while(ip + COMPRESS_MIN_MATCH + COMPRESS_LAST_LITERALS <= end) {
+        uint32_t hash = hash4(window + ip);
+        uint32_t candidate = compressor->table[hash];
+        size_t match_len;
+
+        compressor->table[hash] = (uint32_t) ip;
+
+        if(candidate == COMPRESS_NO_POSITION || ip - candidate > COMPRESS_MAX_DICT ||
+           memcmp(window + candidate, window + ip, COMPRESS_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        match_len = COMPRESS_MIN_MATCH;
+        while(ip + match_len < end - COMPRESS_LAST_LITERALS && window[candidate + match_len] == window[ip + match_len]) {
+            match_len++;
+        }
+
+        op = put_sequence(op, op_end, window + anchor, ip - anchor, match_len, ip - candidate);
+        if(!op) {
+            return 0;
+        }
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, op_end, window + anchor, end - anchor, 0, 0);
+
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// Decodes into the window after the dictionary; returns the text length or -1 if malformed
+static ssize_t decompress_block(compressor_t *compressor, const unsigned char *src, size_t len, size_t capacity) {
+    unsigned char *window = compressor->window;
+    const unsigned char *ip = src;
+    const unsigned char *ip_end = src + len;
+    size_t base = compressor->dict_len;
+    size_t op = base;
+    size_t op_end = base + capacity;
+
+    while(ip < ip_end) {
+        unsigned token = *ip++;
+        size_t literal_len = token >> 4;
+        size_t match_len = token & 15;
+        size_t offset;
+
+        if(literal_len == 15) {
+            unsigned char more;
+
+            do {
+                if(ip == ip_end) {
+                    return -1;
+                }
+                more = *ip++;
+                literal_len += more;
+            } while(more == 255);
+        }
+
+        if(literal_len > (size_t)(ip_end - ip) || literal_len > op_end - op) {
+            return -1;
+        }
+        memcpy(window + op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if(ip == ip_end) {
+            break;
+        }
+
+        if(ip_end - ip < 2) {
+            return -1;
+        }
+        offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+
+        if(match_len == 15) {
+            unsigned char more;
+
+            do {
+                if(ip == ip_end) {
+                    return -1;
+                }
+                more = *ip++;
+                match_len += more;
+            } while(more == 255);
+        }
+        match_len += COMPRESS_MIN_MATCH;
+
+        if(offset == 0 || offset > op || match_len > op_end - op) {
+            return -1;
+        }
+
+        // Byte by byte, since a match may overlap the bytes it is producing
+        for(size_t i = 0; i < match_len; i++) {
+            window[op + i] = window[op - offset + i];
+        }
+        op += match_len;
+    }
+
+    return (ssize_t)(op - base);
+}
+
+// Keeps the last COMPRESS_MAX_DICT bytes of the file, the part every match can reach
+static void load_dictionary(compressor_t *compressor, const char *dict_file) {
+    FILE *file = fopen(dict_file, "rb");
+    long size;
+    size_t len;
+
+    if(!file) {
+        perror("Failed to open dictionary file");
+        exit(EXIT_FAILURE);
+    }
+
+    if(fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0) {
+        perror("Failed to size dictionary file");
+        exit(EXIT_FAILURE);
+    }
+
+    if(size == 0) {
+        fprintf(stderr, "Dictionary file %s is empty\n", dict_file);
+        exit(EXIT_FAILURE);
+    }
+
+    len = (size_t) size < COMPRESS_MAX_DICT ? (size_t) size : COMPRESS_MAX_DICT;
+    compressor->window = malloc(len + LINE_LEN);
+    if(!compressor->window) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if(fseek(file, size - (long) len, SEEK_SET) != 0 || fread(compressor->window, 1, len, file) != len) {
+        perror("Failed to read dictionary file");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    compressor->dict_len = len;
+    compressor->dict_id = crc32c(0, compressor->window, len);
+
+    for(size_t i = 0; i + COMPRESS_MIN_MATCH <= len; i++) {
+        compressor->dict_table[hash4(compressor->window + i)] = (uint32_t) i;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "common.h"
+
+#define COMPRESS_HASH_BITS 12
+#define COMPRESS_HASH_SIZE (1 << COMPRESS_HASH_BITS)
+#define COMPRESS_MAX_DICT  65535    // farthest back a match offset can reach
+
+/*
+ * Per-packet LZ77 compression of message payloads in the LZ4 block format,
+ * optionally primed with a shared dictionary: raw sample messages that sit
+ * in front of every payload as match history. Packets stay independently
+ * decodable, so loss and reordering cost nothing extra.
+ */
+typedef struct compressor {
+    unsigned char *window;                      // dictionary, then one payload
+    size_t        dict_len;
+    uint32_t      dict_id;                      // CRC32C of the dictionary, 0 without one
+    uint32_t      dict_table[COMPRESS_HASH_SIZE];
+    uint32_t      table[COMPRESS_HASH_SIZE];
+    uint64_t      raw_bytes;
+    uint64_t      compressed_bytes;
+} compressor_t;
+
+void compressor_init(compressor_t *compressor, const char *dict_file);
+void compressor_close(compressor_t *compressor);
+void compress_packet(compressor_t *compressor, packet_t *packet, const char *message);
+int decompress_packet(compressor_t *compressor, packet_t *packet);
+
+#endif
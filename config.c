@@ -0,0 +1,103 @@
+#include "common.h"
+#include "config.h"
+#include <ctype.h>
+
+static char *trim(char *text);
+
+// Returns 0, having said why on stderr, if the file cannot be read or a line is malformed
+int config_load(config_t *config, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    char line[CONFIG_KEY_LEN + CONFIG_VALUE_LEN + 8];
+    int line_number = 0;
+    int ok = 1;
+
+    config->count = 0;
+
+    if(!file) {
+        fprintf(stderr, "Cannot open config file %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+
+    while(ok && fgets(line, sizeof(line), file)) {
+        config_entry_t *entry;
+        char *key;
+        char *value;
+        char *equals;
+
+        line_number++;
+
+        if(!strchr(line, '\n') && !feof(file)) {
+            fprintf(stderr, "%s:%d: line too long\n", filename, line_number);
+            ok = 0;
+            break;
+        }
+
+        key = trim(line);
+        if(*key == '\0' || *key == '#') {
+            continue;
+        }
+
+        equals = strchr(key, '=');
+        if(!equals) {
+            fprintf(stderr, "%s:%d: expected key = value\n", filename, line_number);
+            ok = 0;
+            break;
+        }
+
+        *equals = '\0';
+        key = trim(key);
+        value = trim(equals + 1);
+
+        if(*key == '\0' || *value == '\0' || strlen(key) >= CONFIG_KEY_LEN || strlen(value) >= CONFIG_VALUE_LEN) {
+            fprintf(stderr, "%s:%d: invalid key or value\n", filename, line_number);
+            ok = 0;
+        } else if(config_get(config, key)) {
+            fprintf(stderr, "%s:%d: %s is already set\n", filename, line_number, key);
+            ok = 0;
+        } else if(config->count == CONFIG_MAX_ENTRIES) {
+            fprintf(stderr, "%s:%d: more than %d settings\n", filename, line_number, CONFIG_MAX_ENTRIES);
+            ok = 0;
+        } else {
+            entry = &config->entries[config->count++];
+            strcpy(entry->key, key);
+            strcpy(entry->value, value);
+            entry->line = line_number;
+        }
+    }
+
+    if(ok && ferror(file)) {
+        fprintf(stderr, "Failed to read config file %s\n", filename);
+        ok = 0;
+    }
+
+    fclose(file);
+
+    return ok;
+}
+
+const char *config_get(const config_t *config, const char *key) {
+
+    for(size_t i = 0; i < config->count; i++) {
+        if(strcmp(config->entries[i].key, key) == 0) {
+            return config->entries[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+static char *trim(char *text) {
+    char *end;
+
+    while(isspace((unsigned char) *text)) {
+        text++;
+    }
+
+    end = text + strlen(text);
+    while(end > text && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = '\0';
+
+    return text;
+}
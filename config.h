@@ -0,0 +1,28 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+#define CONFIG_MAX_ENTRIES 64
+#define CONFIG_KEY_LEN     64
+#define CONFIG_VALUE_LEN   256
+
+/*
+ * A config file is "key = value" lines; blank lines and lines starting with
+ * # are skipped. Keys are the long option names without their dashes.
+ */
+typedef struct config_entry {
+    char key[CONFIG_KEY_LEN];
+    char value[CONFIG_VALUE_LEN];
+    int  line;
+} config_entry_t;
+
+typedef struct config {
+    config_entry_t entries[CONFIG_MAX_ENTRIES];
+    size_t         count;
+} config_t;
+
+int config_load(config_t *config, const char *filename);
+const char *config_get(const config_t *config, const char *key);
+
+#endif
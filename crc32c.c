@@ -0,0 +1,196 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli). The kernel is picked on first use: three interleaved
+ * SSE4.2 crc32 streams merged with PCLMULQDQ, a single SSE4.2 stream, or a
+ * portable slicing-by-8 table walk.
+ */
+
+#define CRC32C_POLY 0x82F63B78u
+#define CRC32C_STRIPE 336
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *data, size_t len);
+
+static uint32_t crc32c_resolve(uint32_t crc, const unsigned char *data, size_t len);
+
+static uint32_t    crc_table[8][256];
+static crc32c_fn   crc_kernel = crc32c_resolve;
+static const char *crc_kernel_name = "unresolved";
+
+static void build_table(void) {
+
+    for(uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+
+        for(int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][n] = crc;
+    }
+
+    for(uint32_t n = 0; n < 256; n++) {
+        for(int k = 1; k < 8; k++) {
+            crc_table[k][n] = (crc_table[k - 1][n] >> 8) ^ crc_table[0][crc_table[k - 1][n] & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *data, size_t len) {
+
+    while(len && ((uintptr_t)data & 7)) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+
+    while(len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc_table[7][word & 0xff] ^
+              crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^
+              crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^
+              crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^
+              crc_table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+
+    while(len--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+// x^exponent mod P, bit-reflected
+static uint32_t xpow_mod(unsigned exponent) {
+    uint32_t r = 0x80000000u;
+
+    while(exponent--) {
+        r = (r & 1) ? (r >> 1) ^ CRC32C_POLY : r >> 1;
+    }
+
+    return r;
+}
+
+// Shift constants for moving a stream's CRC past one and two stripes
+static uint64_t k_one_stripe;
+static uint64_t k_two_stripes;
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t crc64 = crc;
+
+    while(len && ((uintptr_t)data & 7)) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        len--;
+    }
+
+    while(len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+
+    while(len--) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+    }
+
+    return (uint32_t)crc64;
+}
+
+/*
+ * Runs three independent crc32 chains over adjacent stripes so the 3-cycle
+ * instruction latency is hidden, then folds the first two chains forward
+ * with a carry-less multiply: crc32(0, clmul(c, x^(8n-33))) == c * x^(8n) mod P.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_clmul(uint32_t crc, const unsigned char *data, size_t len) {
+
+    while(len >= 3 * CRC32C_STRIPE) {
+        uint64_t crc0 = crc;
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char *end = data + CRC32C_STRIPE;
+
+        while(data < end) {
+            uint64_t w0;
+            uint64_t w1;
+            uint64_t w2;
+
+            memcpy(&w0, data, sizeof(w0));
+            memcpy(&w1, data + CRC32C_STRIPE, sizeof(w1));
+            memcpy(&w2, data + 2 * CRC32C_STRIPE, sizeof(w2));
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            data += 8;
+        }
+
+        __m128i folded = _mm_xor_si128(
+            _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long)crc0), _mm_cvtsi64_si128((long long)k_two_stripes), 0x00),
+            _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long)crc1), _mm_cvtsi64_si128((long long)k_one_stripe), 0x00));
+
+        crc = (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(folded)) ^ (uint32_t)crc2;
+
+        data += 2 * CRC32C_STRIPE;
+        len -= 3 * CRC32C_STRIPE;
+    }
+
+    return crc32c_sse42(crc, data, len);
+}
+
+#endif
+
+static uint32_t crc32c_resolve(uint32_t crc, const unsigned char *data, size_t len) {
+
+    build_table();
+    crc_kernel = crc32c_portable;
+    crc_kernel_name = "portable";
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("sse4.2")) {
+        crc_kernel = crc32c_sse42;
+        crc_kernel_name = "sse4.2";
+
+        if(__builtin_cpu_supports("pclmul")) {
+            k_one_stripe = xpow_mod(8 * CRC32C_STRIPE - 33);
+            k_two_stripes = xpow_mod(16 * CRC32C_STRIPE - 33);
+            crc_kernel = crc32c_clmul;
+            crc_kernel_name = "sse4.2+pclmul";
+        }
+    }
+#endif
+
+    return crc_kernel(crc, data, len);
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    return ~crc_kernel(~crc, data, len);
+}
+
+const char *crc32c_kernel_name(void) {
+
+    if(crc_kernel == crc32c_resolve) {
+        crc32c(0, NULL, 0);
+    }
+
+    return crc_kernel_name;
+}
@@ -0,0 +1,381 @@
+#include "common.h"
+#include "fec.h"
+#include "gf256.h"
+
+/*
+ * Data packet i of a group contributes the block flags(2) length(2)
+ * stream(2) stream_sequence(4) payload[length], zero-padded to the group's
+ * longest block. Parity packet j carries sum_i C[j][i] * block_i, where C is
+ * the Cauchy matrix 1 / (x_j + y_i) with y_i = i and x_j = FEC_MAX_DATA + j,
+ * each column scaled so row 0 is all ones: the first parity packet is a plain
+ * XOR. Every square submatrix of C is invertible, so any r missing blocks can
+ * be solved from any r parity packets.
+ *
+ * A parity packet's sequence is the group's first data sequence and its
+ * payload is [count, index, 0, 0] followed by the parity block.
+ */
+
+static uint8_t coefficients[FEC_MAX_PARITY][FEC_MAX_DATA];
+static int     coefficients_ready;
+
+static void build_coefficients(void);
+static void block_header(const packet_t *packet, uint8_t *header);
+static void add_block(uint8_t *dst, const packet_t *packet, uint8_t coeff);
+static void store_data(fec_decoder_t *decoder, const packet_t *packet);
+static fec_group_t *find_group(fec_decoder_t *decoder, int sequence);
+static fec_group_t *store_parity(fec_decoder_t *decoder, const packet_t *packet);
+static int recover(fec_decoder_t *decoder, fec_group_t *group, packet_t *recovered);
+static int invert(uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8_t inverse[FEC_MAX_PARITY][FEC_MAX_PARITY], int n);
+
+void fec_encoder_init(fec_encoder_t *encoder, int k, int m) {
+
+    build_coefficients();
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->k = k;
+    encoder->m = m;
+}
+
+// Folds a data packet into the open group; returns 1 once the group holds k packets
+int fec_encode(fec_encoder_t *encoder, const packet_t *packet) {
+    size_t len = FEC_BLOCK_HEADER + packet->length;
+
+    if(encoder->count == 0) {
+        encoder->first = packet->sequence;
+        encoder->block_len = 0;
+        for(int j = 0; j < encoder->m; j++) {
+            memset(encoder->parity[j], 0, sizeof(encoder->parity[j]));
+        }
+    }
+
+    if(len > encoder->block_len) {
+        encoder->block_len = len;
+    }
+
+    for(int j = 0; j < encoder->m; j++) {
+        add_block(encoder->parity[j], packet, coefficients[j][encoder->count]);
+    }
+    encoder->count++;
+
+    return encoder->count == encoder->k;
+}
+
+// Builds parity packet index of the open group; the caller stamps window_base and the checksum
+void fec_parity_packet(fec_encoder_t *encoder, int index, packet_t *packet) {
+
+    packet->sequence = encoder->first;
+    packet->stream = 0;
+    packet->stream_sequence = 0;
+    packet->flags = PACKET_PARITY;
+    packet->length = (uint16_t)(FEC_PARITY_HEADER + encoder->block_len);
+    packet->payload[0] = (char)encoder->count;
+    packet->payload[1] = (char)index;
+    packet->payload[2] = 0;
+    packet->payload[3] = 0;
+    memcpy(packet->payload + FEC_PARITY_HEADER, encoder->parity[index], encoder->block_len);
+    encoder->parity_sent++;
+}
+
+void fec_encoder_next(fec_encoder_t *encoder) {
+    encoder->count = 0;
+}
+
+void fec_decoder_init(fec_decoder_t *decoder) {
+
+    build_coefficients();
+    memset(decoder, 0, sizeof(*decoder));
+
+    for(int i = 0; i < FEC_DATA_SLOTS; i++) {
+        decoder->data[i].sequence = -1;
+    }
+    for(int i = 0; i < FEC_GROUP_SLOTS; i++) {
+        decoder->groups[i].first = -1;
+    }
+}
+
+/*
+ * Takes every verified packet, data before it is decompressed. Returns how
+ * many lost data packets of the affected group could be rebuilt into
+ * recovered, which has room for FEC_MAX_PARITY.
+ */
+int fec_decode(fec_decoder_t *decoder, const packet_t *packet, packet_t *recovered) {
+    fec_group_t *group;
+
+    if(packet->flags & PACKET_PARITY) {
+        group = store_parity(decoder, packet);
+    } else {
+        store_data(decoder, packet);
+        group = find_group(decoder, packet->sequence);
+    }
+
+    if(!group || group->done) {
+        return 0;
+    }
+
+    return recover(decoder, group, recovered);
+}
+
+static void build_coefficients(void) {
+
+    if(coefficients_ready) {
+        return;
+    }
+
+    for(int i = 0; i < FEC_MAX_DATA; i++) {
+        uint8_t scale = (uint8_t)(FEC_MAX_DATA ^ i);    // 1 / C[0][i]
+
+        for(int j = 0; j < FEC_MAX_PARITY; j++) {
+            coefficients[j][i] = gf256_mul(gf256_inv((uint8_t)((FEC_MAX_DATA + j) ^ i)), scale);
+        }
+    }
+    coefficients_ready = 1;
+}
+
+static void block_header(const packet_t *packet, uint8_t *header) {
+
+    memcpy(header, &packet->flags, 2);
+    memcpy(header + 2, &packet->length, 2);
+    memcpy(header + 4, &packet->stream, 2);
+    memcpy(header + 6, &packet->stream_sequence, 4);
+}
+
+static void add_block(uint8_t *dst, const packet_t *packet, uint8_t coeff) {
+    uint8_t header[FEC_BLOCK_HEADER];
+
+    block_header(packet, header);
+    gf256_mul_add(dst, header, coeff, sizeof(header));
+    gf256_mul_add(dst + FEC_BLOCK_HEADER, (const uint8_t *)packet->payload, coeff, packet->length);
+}
+
+static void store_data(fec_decoder_t *decoder, const packet_t *packet) {
+    fec_received_t *slot = &decoder->data[packet->sequence % FEC_DATA_SLOTS];
+
+    if(packet->sequence < 0 || packet->length > LINE_LEN || slot->sequence == packet->sequence) {
+        return;
+    }
+
+    slot->sequence = packet->sequence;
+    slot->len = FEC_BLOCK_HEADER + packet->length;
+    block_header(packet, slot->block);
+    memcpy(slot->block + FEC_BLOCK_HEADER, packet->payload, packet->length);
+}
+
+static fec_group_t *find_group(fec_decoder_t *decoder, int sequence) {
+
+    for(int i = 0; i < FEC_GROUP_SLOTS; i++) {
+        fec_group_t *group = &decoder->groups[i];
+
+        if(group->first >= 0 && sequence >= group->first && sequence - group->first < group->count) {
+            return group;
+        }
+    }
+
+    return NULL;
+}
+
+// A new group takes a free slot or the one with the oldest first sequence
+static fec_group_t *store_parity(fec_decoder_t *decoder, const packet_t *packet) {
+    const uint8_t *payload = (const uint8_t *)packet->payload;
+    fec_group_t *group = NULL;
+    int count;
+    int index;
+    size_t block_len;
+
+    if(packet->length < FEC_PARITY_HEADER + FEC_BLOCK_HEADER || packet->sequence < 0) {
+        return NULL;
+    }
+
+    count = payload[0];
+    index = payload[1];
+    block_len = packet->length - FEC_PARITY_HEADER;
+
+    if(count < 1 || count > FEC_MAX_DATA || index >= FEC_MAX_PARITY || block_len > FEC_BLOCK_MAX) {
+        return NULL;
+    }
+
+    decoder->parity_received++;
+
+    for(int i = 0; i < FEC_GROUP_SLOTS; i++) {
+        fec_group_t *candidate = &decoder->groups[i];
+
+        if(candidate->first == packet->sequence) {
+            group = candidate;
+            break;
+        }
+        if(!group || candidate->first < group->first) {
+            group = candidate;
+        }
+    }
+
+    if(group->first != packet->sequence) {
+        group->first = packet->sequence;
+        group->count = count;
+        group->block_len = block_len;
+        group->done = 0;
+        group->have = 0;
+    } else if(group->count != count || group->block_len != block_len) {
+        return NULL;
+    }
+
+    if(!(group->have & (UINT32_C(1) << index))) {
+        memcpy(group->parity[index], payload + FEC_PARITY_HEADER, block_len);
+        group->have |= UINT32_C(1) << index;
+    }
+
+    return group;
+}
+
+/*
+ * With r blocks missing and at least r parity packets in, each parity block
+ * minus the contribution of the blocks that did arrive leaves r equations in
+ * the r unknowns, solved by inverting the r x r submatrix of C.
+ */
+static int recover(fec_decoder_t *decoder, fec_group_t *group, packet_t *recovered) {
+    uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    uint8_t inverse[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    int missing[FEC_MAX_PARITY];
+    int rows[FEC_MAX_PARITY];
+    int r = 0;
+    int parity = 0;
+    int produced = 0;
+
+    for(int i = 0; i < group->count; i++) {
+        if(decoder->data[(group->first + i) % FEC_DATA_SLOTS].sequence != group->first + i) {
+            if(r == FEC_MAX_PARITY) {
+                return 0;
+            }
+            missing[r++] = i;
+        }
+    }
+
+    if(r == 0) {
+        group->done = 1;
+        return 0;
+    }
+
+    for(int j = 0; j < FEC_MAX_PARITY && parity < r; j++) {
+        if(group->have & (UINT32_C(1) << j)) {
+            rows[parity++] = j;
+        }
+    }
+
+    if(parity < r) {
+        return 0;
+    }
+
+    group->done = 1;
+
+    for(int t = 0; t < r; t++) {
+        uint8_t *syndrome = decoder->syndromes[t];
+
+        memcpy(syndrome, group->parity[rows[t]], group->block_len);
+
+        for(int i = 0, e = 0; i < group->count; i++) {
+            const fec_received_t *slot = &decoder->data[(group->first + i) % FEC_DATA_SLOTS];
+
+            if(e < r && missing[e] == i) {
+                e++;
+                continue;
+            }
+            if(slot->len > group->block_len) {
+                return 0;
+            }
+            gf256_mul_add(syndrome, slot->block, coefficients[rows[t]][i], slot->len);
+        }
+
+        for(int e = 0; e < r; e++) {
+            matrix[t][e] = coefficients[rows[t]][missing[e]];
+        }
+    }
+
+    if(!invert(matrix, inverse, r)) {
+        return 0;
+    }
+
+    for(int e = 0; e < r; e++) {
+        uint8_t block[FEC_BLOCK_MAX];
+        packet_t *packet = &recovered[produced];
+        uint16_t flags;
+        uint16_t length;
+        uint16_t stream;
+
+        memset(block, 0, group->block_len);
+        for(int t = 0; t < r; t++) {
+            gf256_mul_add(block, decoder->syndromes[t], inverse[e][t], group->block_len);
+        }
+
+        memcpy(&flags, block, 2);
+        memcpy(&length, block + 2, 2);
+        memcpy(&stream, block + 4, 2);
+        if((flags & PACKET_PARITY) || length > LINE_LEN || stream >= MAX_STREAMS || FEC_BLOCK_HEADER + (size_t)length > group->block_len) {
+            continue;
+        }
+
+        memset(packet, 0, PACKET_HEADER_LEN);
+        packet->sequence = group->first + missing[e];
+        packet->flags = flags;
+        packet->length = length;
+        packet->stream = stream;
+        memcpy(&packet->stream_sequence, block + 6, 4);
+        memcpy(packet->payload, block + FEC_BLOCK_HEADER, length);
+        store_data(decoder, packet);
+        produced++;
+    }
+
+    decoder->recovered += (uint64_t)produced;
+
+    return produced;
+}
+
+// Gauss-Jordan elimination; returns 0 if the matrix is singular
+static int invert(uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8_t inverse[FEC_MAX_PARITY][FEC_MAX_PARITY], int n) {
+
+    for(int row = 0; row < n; row++) {
+        for(int col = 0; col < n; col++) {
+            inverse[row][col] = row == col;
+        }
+    }
+
+    for(int col = 0; col < n; col++) {
+        int pivot = col;
+        uint8_t scale;
+
+        while(pivot < n && matrix[pivot][col] == 0) {
+            pivot++;
+        }
+        if(pivot == n) {
+            return 0;
+        }
+
+        if(pivot != col) {
+            for(int k = 0; k < n; k++) {
+                uint8_t swap = matrix[col][k];
+
+                matrix[col][k] = matrix[pivot][k];
+                matrix[pivot][k] = swap;
+                swap = inverse[col][k];
+                inverse[col][k] = inverse[pivot][k];
+                inverse[pivot][k] = swap;
+            }
+        }
+
+        scale = gf256_inv(matrix[col][col]);
+        for(int k = 0; k < n; k++) {
+            matrix[col][k] = gf256_mul(matrix[col][k], scale);
+            inverse[col][k] = gf256_mul(inverse[col][k], scale);
+        }
+
+        for(int row = 0; row < n; row++) {
+            uint8_t factor = matrix[row][col];
+
+            if(row == col || factor == 0) {
+                continue;
+            }
+            for(int k = 0; k < n; k++) {
+                matrix[row][k] ^= gf256_mul(factor, matrix[col][k]);
+                inverse[row][k] ^= gf256_mul(factor, inverse[col][k]);
+            }
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,61 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include "common.h"
+
+#define FEC_MAX_DATA      64
+#define FEC_MAX_PARITY    16
+#define FEC_PARITY_HEADER 4                 // data count, parity index, two reserved bytes
+#define FEC_BLOCK_HEADER  10                // a data packet's flags, length, stream and stream sequence
+#define FEC_BLOCK_MAX     (FEC_BLOCK_HEADER + LINE_LEN)
+#define FEC_DATA_SLOTS    (2 * SERVER_REORDER_SLOTS)
+#define FEC_GROUP_SLOTS   64
+
+/*
+ * Forward error correction over groups of up to FEC_MAX_DATA consecutive data
+ * packets. Each group is followed by up to FEC_MAX_PARITY parity packets of a
+ * systematic Reed-Solomon (Cauchy) code, so any M losses in a group of K can
+ * be rebuilt by the receiver without waiting a round trip for retransmits.
+ */
+typedef struct fec_encoder {
+    int      k;
+    int      m;
+    int      first;                 // sequence of the group's first data packet
+    int      count;
+    size_t   block_len;             // longest block in the group so far
+    uint64_t parity_sent;
+    uint8_t  parity[FEC_MAX_PARITY][FEC_BLOCK_MAX];
+} fec_encoder_t;
+
+// Data blocks as they arrived, before decompression, indexed by sequence % FEC_DATA_SLOTS
+typedef struct fec_received {
+    int      sequence;              // -1 when empty
+    size_t   len;
+    uint8_t  block[FEC_BLOCK_MAX];
+} fec_received_t;
+
+typedef struct fec_group {
+    int      first;                 // -1 when free
+    int      count;
+    int      done;
+    size_t   block_len;
+    uint32_t have;                  // bit per parity index received
+    uint8_t  parity[FEC_MAX_PARITY][FEC_BLOCK_MAX];
+} fec_group_t;
+
+typedef struct fec_decoder {
+    fec_received_t data[FEC_DATA_SLOTS];
+    fec_group_t    groups[FEC_GROUP_SLOTS];
+    uint8_t        syndromes[FEC_MAX_PARITY][FEC_BLOCK_MAX];
+    uint64_t       parity_received;
+    uint64_t       recovered;
+} fec_decoder_t;
+
+void fec_encoder_init(fec_encoder_t *encoder, int k, int m);
+int fec_encode(fec_encoder_t *encoder, const packet_t *packet);
+void fec_parity_packet(fec_encoder_t *encoder, int index, packet_t *packet);
+void fec_encoder_next(fec_encoder_t *encoder);
+void fec_decoder_init(fec_decoder_t *decoder);
+int fec_decode(fec_decoder_t *decoder, const packet_t *packet, packet_t *recovered);
+
+#endif
@@ -0,0 +1,206 @@
+#include "gf256.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Arithmetic in GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1 (0x11d), the field
+ * Reed-Solomon codes usually use. Addition is XOR. dst ^= coeff * src is the
+ * only bulk operation; it is picked on first use like the CRC32C kernel: AVX2
+ * or SSSE3 shuffles that look up the products of the low and high nibble of
+ * 32 or 16 bytes at once, or a portable 256-entry product table.
+ */
+
+#define GF256_POLY 0x11d
+
+typedef void (*gf256_fn)(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len);
+
+static void gf256_resolve(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len);
+
+static uint8_t     gf_exp[510];    // doubled so exp[log a + log b] needs no reduction
+static uint8_t     gf_log[256];
+static int         gf_ready;
+static gf256_fn    gf_kernel = gf256_resolve;
+static const char *gf_kernel_name = "unresolved";
+
+static void build_tables(void) {
+    unsigned x = 1;
+
+    for(int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_exp[i + 255] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if(x & 0x100) {
+            x ^= GF256_POLY;
+        }
+    }
+    gf_ready = 1;
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b) {
+
+    if(!gf_ready) {
+        build_tables();
+    }
+
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+// a must not be 0
+uint8_t gf256_inv(uint8_t a) {
+
+    if(!gf_ready) {
+        build_tables();
+    }
+
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void xor_bytes(uint8_t *dst, const uint8_t *src, size_t len) {
+
+    while(len >= 8) {
+        uint64_t a;
+        uint64_t b;
+
+        memcpy(&a, dst, sizeof(a));
+        memcpy(&b, src, sizeof(b));
+        a ^= b;
+        memcpy(dst, &a, sizeof(a));
+        dst += 8;
+        src += 8;
+        len -= 8;
+    }
+
+    while(len--) {
+        *dst++ ^= *src++;
+    }
+}
+
+static void gf256_mul_add_portable(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len) {
+    uint8_t product[256];
+
+    for(unsigned x = 0; x < 256; x++) {
+        product[x] = gf256_mul(coeff, (uint8_t)x);
+    }
+
+    for(size_t i = 0; i < len; i++) {
+        dst[i] ^= product[src[i]];
+    }
+}
+
+#if defined(__x86_64__)
+
+// coeff * x for every low nibble x, and for every high nibble x << 4
+static void nibble_tables(uint8_t coeff, uint8_t low[16], uint8_t high[16]) {
+
+    for(unsigned x = 0; x < 16; x++) {
+        low[x] = gf256_mul(coeff, (uint8_t)x);
+        high[x] = gf256_mul(coeff, (uint8_t)(x << 4));
+    }
+}
+
+__attribute__((target("ssse3")))
+static void gf256_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len) {
+    uint8_t low[16];
+    uint8_t high[16];
+    __m128i low_table;
+    __m128i high_table;
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    nibble_tables(coeff, low, high);
+    low_table = _mm_loadu_si128((const __m128i *)low);
+    high_table = _mm_loadu_si128((const __m128i *)high);
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = _mm_shuffle_epi8(low_table, _mm_and_si128(s, mask));
+        __m128i hi = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(lo, hi)));
+    }
+
+    for(; i < len; i++) {
+        dst[i] ^= (uint8_t)(low[src[i] & 0x0f] ^ high[src[i] >> 4]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void gf256_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len) {
+    uint8_t low[16];
+    uint8_t high[16];
+    __m256i low_table;
+    __m256i high_table;
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    // vpshufb looks up within each 128-bit lane, so both lanes get the table
+    nibble_tables(coeff, low, high);
+    low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+    high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+
+    for(; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = _mm256_shuffle_epi8(low_table, _mm256_and_si256(s, mask));
+        __m256i hi = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(lo, hi)));
+    }
+
+    for(; i < len; i++) {
+        dst[i] ^= (uint8_t)(low[src[i] & 0x0f] ^ high[src[i] >> 4]);
+    }
+}
+
+#endif
+
+static void gf256_resolve(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len) {
+
+    if(!gf_ready) {
+        build_tables();
+    }
+    gf_kernel = gf256_mul_add_portable;
+    gf_kernel_name = "portable";
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2")) {
+        gf_kernel = gf256_mul_add_avx2;
+        gf_kernel_name = "avx2";
+    } else if(__builtin_cpu_supports("ssse3")) {
+        gf_kernel = gf256_mul_add_ssse3;
+        gf_kernel_name = "ssse3";
+    }
+#endif
+
+    gf_kernel(dst, src, coeff, len);
+}
+
+void gf256_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len) {
+
+    if(coeff == 0) {
+        return;
+    }
+
+    if(coeff == 1) {
+        xor_bytes(dst, src, len);
+        return;
+    }
+
+    gf_kernel(dst, src, coeff, len);
+}
+
+const char *gf256_kernel_name(void) {
+
+    if(gf_kernel == gf256_resolve) {
+        gf256_mul_add(NULL, NULL, 2, 0);
+    }
+
+    return gf_kernel_name;
+}
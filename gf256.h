@@ -0,0 +1,12 @@
+#ifndef GF256_H
+#define GF256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+uint8_t gf256_inv(uint8_t a);
+void gf256_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coeff, size_t len);
+const char *gf256_kernel_name(void);
+
+#endif
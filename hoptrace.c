@@ -0,0 +1,58 @@
+#include "common.h"
+#include "hoptrace.h"
+#include <time.h>
+
+#define HOP_TRACE_BUFFER (1024 * 1024)
+
+void hop_trace_open(hop_trace_t *trace, const char *filename, int hop) {
+    struct timespec wall;
+    uint32_t header[2] = {(uint32_t) hop, 0};
+    int64_t offset_ns;
+
+    memset(trace, 0, sizeof(*trace));
+
+    trace->file = fopen(filename, "wb");
+    if(!trace->file) {
+        perror("Failed to open hop trace file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Records are small and frequent; let stdio gather them into large writes
+    setvbuf(trace->file, NULL, _IOFBF, HOP_TRACE_BUFFER);
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    offset_ns = (int64_t) wall.tv_sec * NS_PER_SEC + wall.tv_nsec - clock_refresh();
+
+    if(fwrite(HOP_TRACE_MAGIC, 1, 8, trace->file) != 8 || fwrite(header, sizeof(header), 1, trace->file) != 1 ||
+       fwrite(&offset_ns, sizeof(offset_ns), 1, trace->file) != 1) {
+        perror("Failed to write hop trace header");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void hop_trace_record(hop_trace_t *trace, int event, int direction, const packet_t *packet, int64_t time_ns) {
+    hop_record_t record;
+
+    record.time_ns = time_ns;
+    record.stamp_ns = packet->timestamp_ns;
+    record.session = packet->session;
+    record.sequence = packet->sequence;
+    record.event = (uint8_t) event;
+    record.direction = (uint8_t) direction;
+    record.flags = packet->flags;
+    record.length = (uint32_t) packet_wire_len(packet);
+
+    if(fwrite(&record, sizeof(record), 1, trace->file) != 1) {
+        perror("Failed to write hop trace");
+        exit(EXIT_FAILURE);
+    }
+    trace->records++;
+}
+
+void hop_trace_close(hop_trace_t *trace) {
+
+    if(fclose(trace->file) != 0) {
+        perror("Failed to close hop trace");
+    }
+    trace->file = NULL;
+}
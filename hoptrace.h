@@ -0,0 +1,47 @@
+#ifndef HOPTRACE_H
+#define HOPTRACE_H
+
+#include "common.h"
+
+#define HOP_TRACE_MAGIC "HOPTRC01"
+
+// Which process wrote a trace
+#define HOP_CLIENT 0
+#define HOP_PROXY  1
+#define HOP_SERVER 2
+
+// Record events; data runs client to server (direction 0), ACKs back (direction 1)
+#define HOP_QUEUED    0     // client: the message was read from stdin
+#define HOP_SENT      1     // client: one transmission of a data packet
+#define HOP_RECEIVED  2     // proxy, server: the datagram arrived
+#define HOP_FORWARDED 3     // proxy: left for the other side, after any delay
+#define HOP_DROPPED   4     // proxy: dropped by the impairment model
+#define HOP_DELIVERED 5     // server: the message was handed to its stream
+#define HOP_ACKED     6     // server: ACK sent; client: ACK received
+
+/*
+ * File layout: HOP_TRACE_MAGIC, uint32 hop, uint32 reserved, int64 offset
+ * from the writer's clock to wall-clock nanoseconds, then hop_record_t until
+ * the end. merge_traces.py lines the files up per sequence.
+ */
+typedef struct hop_record {
+    int64_t  time_ns;       // writer's clock_now()
+    int64_t  stamp_ns;      // the packet's timestamp_ns, the client's clock at that transmission
+    uint32_t session;
+    int32_t  sequence;
+    uint8_t  event;
+    uint8_t  direction;
+    uint16_t flags;
+    uint32_t length;        // bytes on the wire
+} hop_record_t;
+
+typedef struct hop_trace {
+    FILE     *file;
+    uint64_t records;
+} hop_trace_t;
+
+void hop_trace_open(hop_trace_t *trace, const char *filename, int hop);
+void hop_trace_record(hop_trace_t *trace, int event, int direction, const packet_t *packet, int64_t time_ns);
+void hop_trace_close(hop_trace_t *trace);
+
+#endif
@@ -1,5 +1,5 @@
+#include "common.h"
 #include "log.h"
-#include <time.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <sys/stat.h>
@@ -35,12 +35,14 @@ void log_close() {
 void log_packet(log_source_t src, const char *action, int sequence, const char *message, int new_line) {
     if (!log_file) return;
 
-    time_t now = time(NULL);
+    int64_t now = clock_now();
 
+    // Whole lines, since the server's output thread logs alongside the packet-handling one
+    flockfile(log_file);
     fprintf(
         log_file,
-        "%ld %s %s Packet %d\n",
-        now,
+        "%" PRId64 ".%06" PRId64 " %s %s Packet %d\n",
+        now / NS_PER_SEC, now % NS_PER_SEC / NS_PER_US,
         source_to_string(src),
         action,
         sequence
@@ -51,11 +53,13 @@ void log_packet(log_source_t src, const char *action, int sequence, const char *
     }
 
     fflush(log_file);
+    funlockfile(log_file);
 
+    flockfile(stderr);
     fprintf(
         stderr,
-        "%ld %s %s Packet %d\n",
-        now,
+        "%" PRId64 ".%06" PRId64 " %s %s Packet %d\n",
+        now / NS_PER_SEC, now % NS_PER_SEC / NS_PER_US,
         source_to_string(src),
         action,
         sequence
@@ -64,14 +68,16 @@ void log_packet(log_source_t src, const char *action, int sequence, const char *
         fprintf(stderr, "\n");
     }
     fflush(stderr);
+    funlockfile(stderr);
 }
 
 
 void log_event(log_source_t src, const char *text, ...) {
     if (!log_file) return;
 
-    time_t now = time(NULL);
-    fprintf(log_file, "%ld %s ", now, source_to_string(src));
+    int64_t now = clock_now();
+    flockfile(log_file);
+    fprintf(log_file, "%" PRId64 ".%06" PRId64 " %s ", now / NS_PER_SEC, now % NS_PER_SEC / NS_PER_US, source_to_string(src));
 
     va_list args;
     va_start(args, text);
@@ -80,11 +86,14 @@ void log_event(log_source_t src, const char *text, ...) {
 
     fprintf(log_file, "\n");
     fflush(log_file);
+    funlockfile(log_file);
 
-    fprintf(stderr, "%ld %s ", now, source_to_string(src));
+    flockfile(stderr);
+    fprintf(stderr, "%" PRId64 ".%06" PRId64 " %s ", now / NS_PER_SEC, now % NS_PER_SEC / NS_PER_US, source_to_string(src));
     va_start(args, text);  // restart args for stderr
     vfprintf(stderr, text, args);
     va_end(args);
     fprintf(stderr, "\n");
     fflush(stderr);
+    funlockfile(stderr);
 }
\ No newline at end of file
@@ -0,0 +1,827 @@
+#include "common.h"
+#include "hoptrace.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Streams one client, proxy or server log, or one --hop-trace file, into
+ * fixed-width time buckets of event counts, bytes and latency, written as CSV
+ * or as a columnar file of float64 arrays. The file is mapped and scanned
+ * once; log lines are matched on their whole action prefix, so "Sent" and
+ * "Sent delayed packet" land in different columns.
+ *
+ * Latency pairs a start event with the stop event for the same packet:
+ * proxy residence (received to sent on), server hold (received to
+ * delivered) and client RTT (sent to acknowledged; hop traces use the
+ * echoed send timestamp instead).
+ */
+
+#define LOGSTAT_MAX_COLUMNS   32
+#define LOGSTAT_PENDING_SLOTS 65536     // starts waiting for their stop, direct-mapped
+#define LOGSTAT_SUB_BINS      4         // histogram bins per power of two
+#define LOGSTAT_HIST_BINS     (40 * LOGSTAT_SUB_BINS)
+#define LOGSTAT_COLUMNAR_MAGIC "LOGSTAT1"
+
+// What a matched line does to the latency of its packet
+#define LATENCY_NONE   0
+#define LATENCY_START  1
+#define LATENCY_STOP   2
+#define LATENCY_CANCEL 3
+
+// pattern_t.direction when the line ends with "to Client" or "to Server"
+#define DIRECTION_SUFFIX -1
+
+typedef struct pattern {
+    const char *prefix;         // action text right after the source name
+    const char *column;         // NULL for lines that are recognised but not counted
+    int        latency;
+    int        direction;       // keeps client- and server-bound packets apart
+    const char *sequence_after; // the sequence follows the last one of these, not the prefix
+} pattern_t;
+
+typedef struct log_format {
+    const char      *source;
+    const char      *latency_name;
+    const pattern_t *patterns;
+    size_t          count;
+} log_format_t;
+
+typedef struct bucket {
+    uint64_t counts[LOGSTAT_MAX_COLUMNS];
+    uint64_t bytes;
+    uint64_t latency_count;
+    int64_t  latency_sum_ns;
+    int64_t  latency_max_ns;
+    uint32_t histogram[LOGSTAT_HIST_BINS];
+} bucket_t;
+
+typedef struct pending {
+    uint64_t key;
+    int64_t  start_ns;
+} pending_t;
+
+typedef struct stats {
+    const char *columns[LOGSTAT_MAX_COLUMNS];
+    size_t     column_count;
+    const char *latency_name;
+    int        has_bytes;
+    int64_t    bucket_ns;
+    int64_t    first;           // bucket number of buckets[0]
+    bucket_t   *buckets;
+    size_t     bucket_count;
+    size_t     bucket_capacity;
+    pending_t  *pending;
+    uint64_t   lines;
+    uint64_t   unmatched;
+} stats_t;
+
+static const pattern_t client_patterns[] = {
+    {"Sending Packet ", NULL, LATENCY_NONE, 0, NULL},
+    {"Sent Packet ", "sent", LATENCY_START, 0, NULL},
+    {"Sent parity Packet ", "parity_sent", LATENCY_NONE, 0, NULL},
+    {"Received Packet ", "acked", LATENCY_STOP, 0, NULL},
+    {"Duplicate Packet ", "duplicate_acks", LATENCY_NONE, 0, NULL},
+    {"Ignored Packet ", "ignored", LATENCY_NONE, 0, NULL},
+    {"Corrupted Packet ", "corrupted", LATENCY_NONE, 0, NULL},
+    {"Error: Failed to receive ACK", "given_up", LATENCY_NONE, 0, NULL},
+};
+
+static const pattern_t proxy_patterns[] = {
+    {"Received from Client Packet ", "from_client", LATENCY_START, 0, NULL},
+    {"Received from Server Packet ", "from_server", LATENCY_START, 1, NULL},
+    {"Sent to Server Packet ", "to_server", LATENCY_STOP, 0, NULL},
+    {"Sent to Client Packet ", "to_client", LATENCY_STOP, 1, NULL},
+    {"Sent delayed packet ", "sent_delayed", LATENCY_STOP, DIRECTION_SUFFIX, NULL},
+    {"Sent reordered packet ", "sent_reordered", LATENCY_STOP, DIRECTION_SUFFIX, NULL},
+    {"Sent duplicate ", "duplicated", LATENCY_NONE, 0, NULL},
+    {"Delayed Client to Server packet ", "delayed_client_to_server", LATENCY_NONE, 0, NULL},
+    {"Delayed Server to Client packet ", "delayed_server_to_client", LATENCY_NONE, 1, NULL},
+    {"Dropped Client to Server Packet ", "dropped_client_to_server", LATENCY_CANCEL, 0, NULL},
+    {"Dropped Server to Client Packet ", "dropped_server_to_client", LATENCY_CANCEL, 1, NULL},
+    {"Queue full, dropped Client to Server packet ", "queue_full", LATENCY_CANCEL, 0, NULL},
+    {"Queue full, dropped Server to Client packet ", "queue_full", LATENCY_CANCEL, 1, NULL},
+    {"Reordered Client to Server packet ", "reordered", LATENCY_NONE, 0, NULL},
+    {"Reordered Server to Client packet ", "reordered", LATENCY_NONE, 1, NULL},
+    {"Corrupted Client to Server packet ", "corrupted", LATENCY_NONE, 0, NULL},
+    {"Corrupted Server to Client packet ", "corrupted", LATENCY_NONE, 1, NULL},
+};
+
+static const pattern_t server_patterns[] = {
+    {"Received Packet ", "received", LATENCY_START, 0, NULL},
+    {"Recovered Packet ", "recovered", LATENCY_START, 0, NULL},
+    {"Message: ", "delivered", LATENCY_STOP, 0, " from Packet "},
+    {"Sent Packet ", "acks_sent", LATENCY_NONE, 0, NULL},
+    {"Buffered Packet ", "buffered", LATENCY_NONE, 0, NULL},
+    {"Ignored Packet ", "ignored", LATENCY_NONE, 0, NULL},
+    {"Parity Packet ", "parity", LATENCY_NONE, 0, NULL},
+    {"Corrupted Packet ", "corrupted", LATENCY_NONE, 0, NULL},
+    {"Undecodable Packet ", "undecodable", LATENCY_NONE, 0, NULL},
+};
+
+static const log_format_t log_formats[] = {
+    {"CLIENT", "rtt", client_patterns, sizeof(client_patterns) / sizeof(client_patterns[0])},
+    {"PROXY", "residence", proxy_patterns, sizeof(proxy_patterns) / sizeof(proxy_patterns[0])},
+    {"SERVER", "hold", server_patterns, sizeof(server_patterns) / sizeof(server_patterns[0])},
+};
+
+static const char *hop_columns[] = {
+    "queued", "queued_ack", "sent", "sent_ack", "received", "received_ack", "forwarded", "forwarded_ack",
+    "dropped", "dropped_ack", "delivered", "delivered_ack", "acked_data", "acked",
+};
+
+static const char *hop_latency_names[] = {"rtt", "residence", "hold"};
+
+static void parse_args(int argc, char *argv[], char **input_str, char **output_str, char **bucket_str, int *columnar);
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static const unsigned char *map_file(const char *filename, size_t *size);
+static void stats_init(stats_t *stats, int64_t bucket_ns);
+static int add_column(stats_t *stats, const char *name);
+static bucket_t *bucket_at(stats_t *stats, int64_t time_ns);
+static void start_latency(stats_t *stats, uint64_t key, int64_t time_ns);
+static void stop_latency(stats_t *stats, uint64_t key, int64_t time_ns);
+static void add_latency(bucket_t *bucket, int64_t latency_ns);
+static uint64_t hash_key(uint64_t a, uint64_t b);
+static void scan_log(stats_t *stats, const unsigned char *data, size_t size);
+static const log_format_t *find_format(const unsigned char *line, const unsigned char *end);
+static int parse_time(const unsigned char **p, const unsigned char *end, int64_t *time_ns);
+static int parse_sequence(const unsigned char *p, const unsigned char *end, long *sequence);
+static void scan_trace(stats_t *stats, const unsigned char *data, size_t size);
+static int64_t latency_percentile(const bucket_t *bucket, double fraction);
+static void write_csv(const stats_t *stats, FILE *out);
+static void write_columnar(const stats_t *stats, FILE *out);
+static double column_value(const stats_t *stats, const bucket_t *bucket, size_t row, size_t column);
+
+int main(int argc, char *argv[]) {
+
+    char                *input_str;
+    char                *output_str;
+    char                *bucket_str;
+    int                 columnar;
+    const unsigned char *data;
+    size_t              size;
+    FILE                *out;
+    static stats_t      stats;
+
+    input_str = NULL;
+    output_str = NULL;
+    bucket_str = NULL;
+    columnar = 0;
+
+    parse_args(argc, argv, &input_str, &output_str, &bucket_str, &columnar);
+
+    stats_init(&stats, (bucket_str ? (int64_t) parse_unsigned(bucket_str, "bucket", 3600000) : 1000) * NS_PER_MS);
+    if(stats.bucket_ns == 0) {
+        fprintf(stderr, "bucket must be at least 1 ms\n");
+        exit(EXIT_FAILURE);
+    }
+
+    data = map_file(input_str, &size);
+
+    if(size >= sizeof(HOP_TRACE_MAGIC) - 1 && memcmp(data, HOP_TRACE_MAGIC, sizeof(HOP_TRACE_MAGIC) - 1) == 0) {
+        scan_trace(&stats, data, size);
+    } else {
+        scan_log(&stats, data, size);
+    }
+
+    if(size) {
+        munmap((void *) data, size);
+    }
+
+    out = stdout;
+    if(output_str) {
+        out = fopen(output_str, "wb");
+        if(!out) {
+            perror("Failed to open output file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(columnar) {
+        write_columnar(&stats, out);
+    } else {
+        write_csv(&stats, out);
+    }
+
+    if(fclose(out) != 0) {
+        perror("Failed to write output");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "%" PRIu64 " records in %zu buckets of %" PRId64 " ms, %" PRIu64 " not matched, latency is %s\n", stats.lines,
+            stats.bucket_count, stats.bucket_ns / NS_PER_MS, stats.unmatched, stats.latency_name ? stats.latency_name : "not measured");
+
+    free(stats.buckets);
+    free(stats.pending);
+    return EXIT_SUCCESS;
+}
+
+static void parse_args(int argc, char *argv[], char **input_str, char **output_str, char **bucket_str, int *columnar) {
+    int opt;
+    int option_index = 0;
+    int output_set = 0;
+    int bucket_set = 0;
+    int columnar_set = 0;
+
+    static struct option long_options[] = {
+        {"output", required_argument, 0, 1},
+        {"bucket", required_argument, 0, 2},
+        {"columnar", no_argument, 0, 3},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    opterr = 0;
+
+    while((opt = getopt_long(argc, argv, "h", long_options, &option_index)) != -1) {
+        switch(opt){
+            case 1:
+                if(output_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --output");
+                }
+                *output_str = optarg;
+                output_set = 1;
+                break;
+            case 2:
+                if(bucket_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --bucket");
+                }
+                *bucket_str = optarg;
+                bucket_set = 1;
+                break;
+            case 3:
+                if(columnar_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --columnar");
+                }
+                *columnar = 1;
+                columnar_set = 1;
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS, NULL);
+                break;
+            case '?': {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+                snprintf(message, sizeof(message), "Unknown option");
+                usage(argv[0], EXIT_FAILURE, message);
+                break;
+            }
+            default:
+                usage(argv[0], EXIT_FAILURE, NULL);
+        }
+    }
+
+    if(optind != argc - 1) {
+        usage(argv[0], EXIT_FAILURE, optind < argc ? "Unexpected extra arguments." : "Missing required arguments.");
+    }
+
+    *input_str = argv[optind];
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char* message){
+    if(message) {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [options] <log or hop trace>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  --output <file>          Write here instead of stdout\n", stderr);
+    fputs("  --bucket <ms>            Bucket width (default 1000)\n", stderr);
+    fputs("  --columnar               Write a float64 array per column instead of CSV\n", stderr);
+    fputs("  -h, --help               Display this help message\n", stderr);
+    exit(exit_code);
+}
+
+static const unsigned char *map_file(const char *filename, size_t *size) {
+    struct stat st;
+    void *data;
+    int fd = open(filename, O_RDONLY);
+
+    if(fd == -1) {
+        perror("Failed to open input file");
+        exit(EXIT_FAILURE);
+    }
+
+    if(fstat(fd, &st) == -1) {
+        perror("Failed to stat input file");
+        exit(EXIT_FAILURE);
+    }
+
+    *size = (size_t) st.st_size;
+    if(*size == 0) {
+        close(fd);
+        return (const unsigned char *) "";
+    }
+
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+        perror("Failed to map input file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    // One front-to-back pass
+    madvise(data, *size, MADV_SEQUENTIAL);
+
+    return data;
+}
+
+static void stats_init(stats_t *stats, int64_t bucket_ns) {
+
+    memset(stats, 0, sizeof(*stats));
+    stats->bucket_ns = bucket_ns;
+
+    stats->pending = calloc(LOGSTAT_PENDING_SLOTS, sizeof(pending_t));
+    if(!stats->pending) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Returns the index of the named column, adding it the first time
+static int add_column(stats_t *stats, const char *name) {
+
+    for(size_t i = 0; i < stats->column_count; i++) {
+        if(strcmp(stats->columns[i], name) == 0) {
+            return (int) i;
+        }
+    }
+
+    if(stats->column_count == LOGSTAT_MAX_COLUMNS) {
+        fprintf(stderr, "More than %d columns\n", LOGSTAT_MAX_COLUMNS);
+        exit(EXIT_FAILURE);
+    }
+
+    stats->columns[stats->column_count] = name;
+
+    return (int) stats->column_count++;
+}
+
+// Buckets grow forward as time goes on; the odd record from before the first bucket is counted in it
+static bucket_t *bucket_at(stats_t *stats, int64_t time_ns) {
+    int64_t number = time_ns / stats->bucket_ns;
+    size_t index;
+
+    if(stats->bucket_count == 0) {
+        stats->first = number;
+    }
+
+    index = number < stats->first ? 0 : (size_t)(number - stats->first);
+
+    if(index >= stats->bucket_capacity) {
+        size_t capacity = stats->bucket_capacity ? stats->bucket_capacity : 64;
+        bucket_t *buckets;
+
+        while(capacity <= index) {
+            capacity *= 2;
+        }
+
+        buckets = realloc(stats->buckets, capacity * sizeof(bucket_t));
+        if(!buckets) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        memset(buckets + stats->bucket_capacity, 0, (capacity - stats->bucket_capacity) * sizeof(bucket_t));
+        stats->buckets = buckets;
+        stats->bucket_capacity = capacity;
+    }
+
+    if(index >= stats->bucket_count) {
+        stats->bucket_count = index + 1;
+    }
+
+    return &stats->buckets[index];
+}
+
+// A start evicts whatever else hashed to its slot, so memory stays fixed however many never stop
+static void start_latency(stats_t *stats, uint64_t key, int64_t time_ns) {
+    pending_t *slot = &stats->pending[key % LOGSTAT_PENDING_SLOTS];
+
+    slot->key = key;
+    slot->start_ns = time_ns;
+}
+
+static void stop_latency(stats_t *stats, uint64_t key, int64_t time_ns) {
+    pending_t *slot = &stats->pending[key % LOGSTAT_PENDING_SLOTS];
+
+    if(slot->key != key || slot->start_ns == INT64_MIN) {
+        return;
+    }
+
+    if(time_ns >= 0) {
+        add_latency(bucket_at(stats, time_ns), time_ns - slot->start_ns);
+    }
+    slot->start_ns = INT64_MIN;
+}
+
+static void add_latency(bucket_t *bucket, int64_t latency_ns) {
+    uint64_t value = latency_ns > 0 ? (uint64_t) latency_ns : 0;
+    int bin = 0;
+
+    bucket->latency_count++;
+    bucket->latency_sum_ns += (int64_t) value;
+    if((int64_t) value > bucket->latency_max_ns) {
+        bucket->latency_max_ns = (int64_t) value;
+    }
+
+    // Power of two, then which quarter of it: within 25% from 1 ns to about 18 minutes
+    if(value >= LOGSTAT_SUB_BINS) {
+        int exponent = 63 - __builtin_clzll(value);
+        int sub = (int)(value >> (exponent - 2)) & (LOGSTAT_SUB_BINS - 1);
+
+        bin = (exponent - 1) * LOGSTAT_SUB_BINS + sub;
+    } else {
+        bin = (int) value;
+    }
+
+    bucket->histogram[bin < LOGSTAT_HIST_BINS ? bin : LOGSTAT_HIST_BINS - 1]++;
+}
+
+static uint64_t hash_key(uint64_t a, uint64_t b) {
+    uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ b;
+
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+
+    // 0 marks an empty pending slot
+    return h ? h : 1;
+}
+
+/*
+ * Every line is "<seconds>.<microseconds> <SOURCE> <action>"; a file holds
+ * one program's log, told apart by the source of its first line. Blank lines
+ * and lines that match no pattern are skipped.
+ */
+static void scan_log(stats_t *stats, const unsigned char *data, size_t size) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + size;
+    const log_format_t *format = NULL;
+    int columns[LOGSTAT_MAX_COLUMNS];
+    size_t lengths[LOGSTAT_MAX_COLUMNS];
+    size_t source_len = 0;
+
+    while(p < end) {
+        const unsigned char *line_end = memchr(p, '\n', (size_t)(end - p));
+        const unsigned char *line = p;
+        const pattern_t *match = NULL;
+        bucket_t *bucket;
+        int64_t time_ns;
+        long sequence;
+        int direction;
+
+        if(!line_end) {
+            line_end = end;
+        }
+        p = line_end + 1;
+
+        if(line == line_end) {
+            continue;
+        }
+
+        if(!format) {
+            format = find_format(line, line_end);
+            if(!format) {
+                continue;
+            }
+            stats->latency_name = format->latency_name;
+            source_len = strlen(format->source);
+            for(size_t i = 0; i < format->count; i++) {
+                columns[i] = format->patterns[i].column ? add_column(stats, format->patterns[i].column) : -1;
+                lengths[i] = strlen(format->patterns[i].prefix);
+            }
+        }
+
+        if(!parse_time(&line, line_end, &time_ns)) {
+            stats->unmatched++;
+            continue;
+        }
+
+        // The source name and its space
+        line += source_len + 1;
+        if(line >= line_end) {
+            stats->unmatched++;
+            continue;
+        }
+
+        for(size_t i = 0; i < format->count; i++) {
+            const pattern_t *pattern = &format->patterns[i];
+            size_t len = lengths[i];
+
+            if((size_t)(line_end - line) >= len && line[0] == (unsigned char) pattern->prefix[0] && memcmp(line, pattern->prefix, len) == 0) {
+                match = pattern;
+                if(columns[i] >= 0) {
+                    bucket = bucket_at(stats, time_ns);
+                    bucket->counts[columns[i]]++;
+                }
+                break;
+            }
+        }
+
+        stats->lines++;
+        if(!match) {
+            stats->unmatched++;
+            continue;
+        }
+
+        if(match->latency == LATENCY_NONE) {
+            continue;
+        }
+
+        if(match->sequence_after) {
+            size_t marker = strlen(match->sequence_after);
+            const unsigned char *q = line_end - marker;
+
+            while(q > line && memcmp(q, match->sequence_after, marker) != 0) {
+                q--;
+            }
+            if(!parse_sequence(q + marker, line_end, &sequence)) {
+                continue;
+            }
+        } else if(!parse_sequence(line + lengths[match - format->patterns], line_end, &sequence)) {
+            continue;
+        }
+
+        direction = match->direction;
+        if(direction == DIRECTION_SUFFIX) {
+            direction = line_end - line >= 6 && memcmp(line_end - 6, "Client", 6) == 0;
+        }
+
+        if(match->latency == LATENCY_START) {
+            start_latency(stats, hash_key((uint64_t) direction, (uint64_t) sequence), time_ns);
+        } else {
+            stop_latency(stats, hash_key((uint64_t) direction, (uint64_t) sequence), match->latency == LATENCY_STOP ? time_ns : -1);
+        }
+    }
+}
+
+static const log_format_t *find_format(const unsigned char *line, const unsigned char *end) {
+    const unsigned char *space = memchr(line, ' ', (size_t)(end - line));
+
+    if(!space) {
+        return NULL;
+    }
+    space++;
+
+    for(size_t i = 0; i < sizeof(log_formats) / sizeof(log_formats[0]); i++) {
+        size_t len = strlen(log_formats[i].source);
+
+        if((size_t)(end - space) > len && memcmp(space, log_formats[i].source, len) == 0 && space[len] == ' ') {
+            return &log_formats[i];
+        }
+    }
+
+    return NULL;
+}
+
+// "<seconds>.<microseconds> ", leaving p after the space
+static int parse_time(const unsigned char **p, const unsigned char *end, int64_t *time_ns) {
+    const unsigned char *q = *p;
+    int64_t seconds = 0;
+    int64_t micros = 0;
+    int digits = 0;
+
+    while(q < end && *q >= '0' && *q <= '9') {
+        seconds = seconds * 10 + (*q++ - '0');
+    }
+
+    if(q == *p || q == end || *q++ != '.') {
+        return 0;
+    }
+
+    while(q < end && *q >= '0' && *q <= '9') {
+        micros = micros * 10 + (*q++ - '0');
+        digits++;
+    }
+
+    if(digits != 6 || q == end || *q++ != ' ') {
+        return 0;
+    }
+
+    *time_ns = seconds * NS_PER_SEC + micros * NS_PER_US;
+    *p = q;
+
+    return 1;
+}
+
+static int parse_sequence(const unsigned char *p, const unsigned char *end, long *sequence) {
+    int negative = p < end && *p == '-';
+    long value = 0;
+
+    p += negative;
+    if(p == end || *p < '0' || *p > '9') {
+        return 0;
+    }
+
+    while(p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+    }
+
+    *sequence = negative ? -value : value;
+
+    return 1;
+}
+
+/*
+ * Hop traces are bucketed on wall-clock time so files from the three
+ * programs line up. Parity and hellos are counted but kept out of latency.
+ */
+static void scan_trace(stats_t *stats, const unsigned char *data, size_t size) {
+    const size_t header = sizeof(HOP_TRACE_MAGIC) - 1 + 2 * sizeof(uint32_t) + sizeof(int64_t);
+    uint32_t hop;
+    int64_t offset_ns;
+
+    if(size < header) {
+        fprintf(stderr, "Hop trace is too short\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&hop, data + sizeof(HOP_TRACE_MAGIC) - 1, sizeof(hop));
+    memcpy(&offset_ns, data + sizeof(HOP_TRACE_MAGIC) - 1 + 2 * sizeof(uint32_t), sizeof(offset_ns));
+
+    if(hop > HOP_SERVER) {
+        fprintf(stderr, "Hop trace from unknown hop %" PRIu32 "\n", hop);
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t i = 0; i < sizeof(hop_columns) / sizeof(hop_columns[0]); i++) {
+        add_column(stats, hop_columns[i]);
+    }
+    stats->latency_name = hop_latency_names[hop];
+    stats->has_bytes = 1;
+
+    for(size_t pos = header; pos + sizeof(hop_record_t) <= size; pos += sizeof(hop_record_t)) {
+        hop_record_t record;
+        int64_t time_ns;
+        bucket_t *bucket;
+        uint64_t key;
+
+        memcpy(&record, data + pos, sizeof(record));
+        time_ns = record.time_ns + offset_ns;
+        stats->lines++;
+
+        if(record.event > HOP_ACKED || record.direction > 1) {
+            stats->unmatched++;
+            continue;
+        }
+
+        bucket = bucket_at(stats, time_ns);
+        bucket->counts[record.event * 2 + record.direction]++;
+
+        // Only what crossed the wire here, not queueing, drops or deliveries
+        if(record.event == HOP_SENT || record.event == HOP_RECEIVED || record.event == HOP_FORWARDED || record.event == HOP_ACKED) {
+            bucket->bytes += record.length;
+        }
+
+        if(record.flags & (PACKET_PARITY | PACKET_HELLO)) {
+            continue;
+        }
+
+        if(hop == HOP_CLIENT) {
+            if(record.event == HOP_ACKED && record.stamp_ns) {
+                add_latency(bucket, record.time_ns - record.stamp_ns);
+            }
+            continue;
+        }
+
+        // The proxy follows each transmission, the server each sequence
+        key = hash_key((uint64_t) record.session << 32 | (uint32_t) record.sequence,
+                       hop == HOP_PROXY ? (uint64_t) record.stamp_ns ^ record.direction : 0);
+
+        if(record.event == HOP_RECEIVED && (hop == HOP_PROXY || record.direction == 0)) {
+            start_latency(stats, key, time_ns);
+        } else if(record.event == HOP_FORWARDED || record.event == HOP_DELIVERED) {
+            stop_latency(stats, key, time_ns);
+        } else if(record.event == HOP_DROPPED) {
+            stop_latency(stats, key, -1);
+        }
+    }
+}
+
+// Upper edge of the histogram bin holding the given fraction of the samples
+static int64_t latency_percentile(const bucket_t *bucket, double fraction) {
+    uint64_t target = (uint64_t)(fraction * (double)(bucket->latency_count - 1)) + 1;
+    uint64_t seen = 0;
+
+    for(int bin = 0; bin < LOGSTAT_HIST_BINS; bin++) {
+        seen += bucket->histogram[bin];
+        if(seen >= target) {
+            int exponent;
+            int64_t upper;
+
+            if(bin < LOGSTAT_SUB_BINS) {
+                return bin;
+            }
+            exponent = bin / LOGSTAT_SUB_BINS + 1;
+            upper = ((int64_t)(LOGSTAT_SUB_BINS + bin % LOGSTAT_SUB_BINS + 1) << (exponent - 2)) - 1;
+
+            return upper < bucket->latency_max_ns ? upper : bucket->latency_max_ns;
+        }
+    }
+
+    return bucket->latency_max_ns;
+}
+
+// Column order: time, the event counts, bytes for hop traces, then latency
+static double column_value(const stats_t *stats, const bucket_t *bucket, size_t row, size_t column) {
+    size_t extra;
+
+    if(column == 0) {
+        return (double)((stats->first + (int64_t) row) * stats->bucket_ns) / NS_PER_SEC;
+    }
+    column--;
+
+    if(column < stats->column_count) {
+        return (double) bucket->counts[column];
+    }
+    column -= stats->column_count;
+
+    if(stats->has_bytes) {
+        if(column == 0) {
+            return (double) bucket->bytes;
+        }
+        column--;
+    }
+
+    extra = column;
+    if(extra == 0) {
+        return (double) bucket->latency_count;
+    }
+    if(bucket->latency_count == 0) {
+        return 0;
+    }
+
+    switch(extra) {
+        case 1:  return (double) bucket->latency_sum_ns / (double) bucket->latency_count / NS_PER_MS;
+        case 2:  return (double) latency_percentile(bucket, 0.5) / NS_PER_MS;
+        case 3:  return (double) latency_percentile(bucket, 0.99) / NS_PER_MS;
+        default: return (double) bucket->latency_max_ns / NS_PER_MS;
+    }
+}
+
+static const char *latency_columns[] = {"latency_count", "latency_mean_ms", "latency_p50_ms", "latency_p99_ms", "latency_max_ms"};
+
+static void write_csv(const stats_t *stats, FILE *out) {
+    size_t width = 1 + stats->column_count + (size_t) stats->has_bytes + 5;
+
+    fputs("time_s", out);
+    for(size_t i = 0; i < stats->column_count; i++) {
+        fprintf(out, ",%s", stats->columns[i]);
+    }
+    if(stats->has_bytes) {
+        fputs(",bytes", out);
+    }
+    for(size_t i = 0; i < 5; i++) {
+        fprintf(out, ",%s", latency_columns[i]);
+    }
+    fputc('\n', out);
+
+    for(size_t row = 0; row < stats->bucket_count; row++) {
+        const bucket_t *bucket = &stats->buckets[row];
+
+        fprintf(out, "%.3f", column_value(stats, bucket, row, 0));
+        for(size_t column = 1; column < width; column++) {
+            double value = column_value(stats, bucket, row, column);
+
+            // Counts print as integers, latencies to the microsecond
+            if(column + 4 < width) {
+                fprintf(out, ",%.0f", value);
+            } else {
+                fprintf(out, ",%.3f", value);
+            }
+        }
+        fputc('\n', out);
+    }
+}
+
+/*
+ * LOGSTAT_COLUMNAR_MAGIC, uint32 columns, uint64 rows, the column names each
+ * NUL-terminated, then each column as rows little-endian float64 in turn, so
+ * numpy.frombuffer() reads a column without parsing anything.
+ */
+static void write_columnar(const stats_t *stats, FILE *out) {
+    uint32_t width = (uint32_t)(1 + stats->column_count + (size_t) stats->has_bytes + 5);
+    uint64_t rows = stats->bucket_count;
+
+    fwrite(LOGSTAT_COLUMNAR_MAGIC, 1, sizeof(LOGSTAT_COLUMNAR_MAGIC) - 1, out);
+    fwrite(&width, sizeof(width), 1, out);
+    fwrite(&rows, sizeof(rows), 1, out);
+
+    fwrite("time_s", 1, sizeof("time_s"), out);
+    for(size_t i = 0; i < stats->column_count; i++) {
+        fwrite(stats->columns[i], 1, strlen(stats->columns[i]) + 1, out);
+    }
+    if(stats->has_bytes) {
+        fwrite("bytes", 1, sizeof("bytes"), out);
+    }
+    for(size_t i = 0; i < 5; i++) {
+        fwrite(latency_columns[i], 1, strlen(latency_columns[i]) + 1, out);
+    }
+
+    for(uint32_t column = 0; column < width; column++) {
+        for(size_t row = 0; row < stats->bucket_count; row++) {
+            double value = column_value(stats, &stats->buckets[row], row, column);
+
+            fwrite(&value, sizeof(value), 1, out);
+        }
+    }
+}
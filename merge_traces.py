@@ -0,0 +1,199 @@
+"""
+Lines up the --hop-trace files of a client, proxy and server run and breaks
+each message's latency down by hop. Every file carries the offset from its
+writer's clock to wall-clock time, so hosts need synchronised clocks; on one
+host they share CLOCK_MONOTONIC and line up exactly.
+
+Transmissions are told apart by the client's send timestamp, which the proxy
+and server see in the header, so a retransmission is followed on its own.
+Each message is broken down along the first transmission to reach the server.
+"""
+import struct
+import sys
+
+MAGIC = b"HOPTRC01"
+HEADER = struct.Struct("<8sIIq")
+RECORD = struct.Struct("<qqIiBBHI")
+
+HOP_NAMES = ["client", "proxy", "server"]
+QUEUED, SENT, RECEIVED, FORWARDED, DROPPED, DELIVERED, ACKED = range(7)
+
+PACKET_PARITY = 0x4
+PACKET_HELLO = 0x8
+
+SEGMENTS = [
+    ("client queue", "queued", "sent"),
+    ("retransmission", "sent", "delivered_sent"),
+    ("client to proxy", "delivered_sent", "proxy_in"),
+    ("proxy delay", "proxy_in", "proxy_out"),
+    ("proxy to server", "proxy_out", "server_in"),
+    ("client to server", "delivered_sent", "server_in"),
+    ("server hold", "server_in", "delivered"),
+    ("ack delay", "delivered", "server_ack"),
+    ("ack return", "server_ack", "client_ack"),
+    ("total", "queued", "client_ack"),
+]
+
+
+def load(filename):
+    with open(filename, "rb") as f:
+        data = f.read()
+
+    if len(data) < HEADER.size:
+        sys.exit(f"{filename}: too short for a hop trace")
+
+    magic, hop, _, offset = HEADER.unpack_from(data)
+    if magic != MAGIC or hop >= len(HOP_NAMES):
+        sys.exit(f"{filename}: not a hop trace")
+
+    records = []
+    end = len(data) - (len(data) - HEADER.size) % RECORD.size
+    for pos in range(HEADER.size, end, RECORD.size):
+        time_ns, stamp, session, sequence, event, direction, flags, _length = RECORD.unpack_from(data, pos)
+        records.append((time_ns + offset, stamp, session, sequence, event, direction, flags))
+
+    return HOP_NAMES[hop], offset, records
+
+
+def first(table, key, time_ns):
+    if key not in table or time_ns < table[key]:
+        table[key] = time_ns
+
+
+def sweep_acks(acks, messages):
+    """Gives each message the time of the first cumulative ACK that covered it."""
+    by_session = {}
+    for session, sequence in messages:
+        by_session.setdefault(session, []).append(sequence)
+
+    covered = {}
+    for session, sequences in by_session.items():
+        sequences.sort()
+        i = 0
+        for time_ns, ack in sorted(acks.get(session, [])):
+            while i < len(sequences) and sequences[i] <= ack:
+                covered[(session, sequences[i])] = time_ns
+                i += 1
+
+    return covered
+
+
+def merge(traces):
+    hops = {}
+    for filename in traces:
+        name, offset, records = load(filename)
+        if name in hops:
+            sys.exit(f"{filename}: second {name} trace")
+        hops[name] = (offset, records)
+
+    if "client" not in hops:
+        sys.exit("The client trace is needed to follow packets by their send timestamp")
+
+    client_offset = hops["client"][0]
+    points = {}         # (session, sequence) -> {point: wall ns}
+    arrivals = {}       # (point, session, sequence, stamp) -> wall ns
+    acks = {"server_ack": {}, "client_ack": {}}
+    attempts = {}
+    drops = [0, 0]
+
+    for name, (_, records) in hops.items():
+        for time_ns, stamp, session, sequence, event, direction, flags in records:
+            if flags & (PACKET_PARITY | PACKET_HELLO):
+                continue
+            key = (session, sequence)
+
+            if direction == 1:
+                if event == ACKED:
+                    acks["server_ack" if name == "server" else "client_ack"].setdefault(session, []).append((time_ns, sequence))
+                elif event == DROPPED:
+                    drops[1] += 1
+                continue
+
+            if event == QUEUED:
+                first(points.setdefault(key, {}), "queued", time_ns)
+            elif event == SENT:
+                first(points.setdefault(key, {}), "sent", time_ns)
+                attempts[key] = attempts.get(key, 0) + 1
+                arrivals[("sent", session, sequence, stamp)] = time_ns
+            elif event == RECEIVED:
+                first(arrivals, ("proxy_in" if name == "proxy" else "server_in", session, sequence, stamp), time_ns)
+            elif event == FORWARDED:
+                first(arrivals, ("proxy_out", session, sequence, stamp), time_ns)
+            elif event == DROPPED:
+                drops[0] += 1
+            elif event == DELIVERED:
+                first(points.setdefault(key, {}), "delivered", time_ns)
+
+    # The transmission that got through is the first to reach the server
+    winners = {}
+    for (point, session, sequence, stamp), time_ns in arrivals.items():
+        key = (session, sequence)
+        if point == "server_in" and stamp and (key not in winners or time_ns < winners[key][1]):
+            winners[key] = (stamp, time_ns)
+
+    for key, (stamp, time_ns) in winners.items():
+        if key not in points:
+            continue
+        row = points[key]
+        row["server_in"] = time_ns
+        # The stamp is the send time itself, in case the client trace lost its tail
+        row["delivered_sent"] = stamp + client_offset
+        for point in ("proxy_in", "proxy_out"):
+            if (point, key[0], key[1], stamp) in arrivals:
+                row[point] = arrivals[(point, key[0], key[1], stamp)]
+
+    for point, table in acks.items():
+        for key, time_ns in sweep_acks(table, points).items():
+            points[key][point] = time_ns
+
+    return points, attempts, drops
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def report(points, attempts, drops):
+    sent = sum(attempts.values())
+    print(f"{len(points)} messages, {sent} transmissions, {drops[0]} data and {drops[1]} ACKs dropped by the proxy")
+    print(f"{'segment':<18}{'count':>8}{'mean':>10}{'p50':>10}{'p90':>10}{'p99':>10}{'max':>10}   (ms)")
+
+    for name, start, end in SEGMENTS:
+        values = sorted((row[end] - row[start]) / 1e6 for row in points.values() if start in row and end in row)
+        if not values:
+            continue
+        mean = sum(values) / len(values)
+        print(f"{name:<18}{len(values):>8}{mean:>10.3f}{percentile(values, 0.5):>10.3f}{percentile(values, 0.9):>10.3f}"
+              f"{percentile(values, 0.99):>10.3f}{values[-1]:>10.3f}")
+
+
+def write_csv(filename, points, attempts):
+    with open(filename, "w") as f:
+        f.write("session,sequence,attempts," + ",".join(name.replace(" ", "_") + "_ms" for name, _, _ in SEGMENTS) + "\n")
+        for key in sorted(points):
+            row = points[key]
+            cells = [f"{key[0]:08x}", str(key[1]), str(attempts.get(key, 0))]
+            for _, start, end in SEGMENTS:
+                cells.append(f"{(row[end] - row[start]) / 1e6:.3f}" if start in row and end in row else "")
+            f.write(",".join(cells) + "\n")
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    csv_file = None
+
+    if "--csv" in args:
+        i = args.index("--csv")
+        if i + 1 >= len(args):
+            sys.exit("--csv needs a file name")
+        csv_file = args[i + 1]
+        del args[i:i + 2]
+
+    if not args:
+        print("Usage: python3 merge_traces.py <client trace> [<proxy trace>] [<server trace>] [--csv <file>]")
+        sys.exit(1)
+
+    points, attempts, drops = merge(args)
+    report(points, attempts, drops)
+    if csv_file:
+        write_csv(csv_file, points, attempts)
@@ -0,0 +1,85 @@
+#include "common.h"
+#include "pace.h"
+#include <sys/timerfd.h>
+#include <time.h>
+
+/*
+ * Transmission pacing for the windowed client. Each packet pushes next_ns
+ * one interval further out; a packet may leave once next_ns is within
+ * PACE_QUANTUM_NS of now, so gaps shorter than the quantum go out as a small
+ * burst and the timerfd is only armed once per quantum rather than per
+ * packet. Credit does not build up while idle: a sender that falls more than
+ * a quantum behind restarts from now.
+ *
+ * In auto mode the rate follows the congestion controller, cwnd / srtt scaled
+ * by PACE_GAIN_SLOW_START or PACE_GAIN so the window can still grow.
+ */
+
+#define PACE_QUANTUM_NS      250000
+#define PACE_GAIN_SLOW_START 2.0
+#define PACE_GAIN            1.2
+
+void pacer_init(pacer_t *pacer, long rate_pps) {
+
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->rate_pps = rate_pps;
+    pacer->interval_ns = rate_pps ? NS_PER_SEC / rate_pps : 0;
+
+    pacer->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(pacer->timer_fd == -1) {
+        perror("timerfd_create failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void pacer_close(pacer_t *pacer) {
+    close(pacer->timer_fd);
+    pacer->timer_fd = -1;
+}
+
+void pacer_update(pacer_t *pacer, const cc_t *cc) {
+    double gain;
+
+    if(pacer->rate_pps || cc->srtt_us == 0) {
+        return;
+    }
+
+    gain = cc->cwnd < cc->ssthresh ? PACE_GAIN_SLOW_START : PACE_GAIN;
+    pacer->interval_ns = (int64_t)(cc->srtt_us * NS_PER_US / (cc->cwnd * gain));
+}
+
+int pacer_ready(const pacer_t *pacer, int64_t now_ns) {
+    return pacer->interval_ns == 0 || pacer->next_ns - now_ns <= PACE_QUANTUM_NS;
+}
+
+void pacer_sent(pacer_t *pacer, int64_t now_ns) {
+
+    if(pacer->next_ns < now_ns - PACE_QUANTUM_NS) {
+        pacer->next_ns = now_ns;
+    }
+
+    pacer->next_ns += pacer->interval_ns;
+}
+
+// Fires once the next packet is allowed out; poll timer_fd for it
+void pacer_arm(pacer_t *pacer) {
+    struct itimerspec when;
+
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = pacer->next_ns / NS_PER_SEC;
+    when.it_value.tv_nsec = pacer->next_ns % NS_PER_SEC;
+
+    if(timerfd_settime(pacer->timer_fd, TFD_TIMER_ABSTIME, &when, NULL) == -1) {
+        perror("timerfd_settime failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void pacer_clear(pacer_t *pacer) {
+    uint64_t expirations;
+
+    if(read(pacer->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        perror("Error reading pacing timer");
+        exit(EXIT_FAILURE);
+    }
+}
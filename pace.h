@@ -0,0 +1,22 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdint.h>
+#include "cc.h"
+
+typedef struct pacer {
+    int     timer_fd;
+    long    rate_pps;       // fixed rate, or 0 to follow cwnd / srtt
+    int64_t interval_ns;    // 0 while there is nothing to pace by
+    int64_t next_ns;        // earliest clock_now() time the next packet may leave
+} pacer_t;
+
+void pacer_init(pacer_t *pacer, long rate_pps);
+void pacer_close(pacer_t *pacer);
+void pacer_update(pacer_t *pacer, const cc_t *cc);
+int pacer_ready(const pacer_t *pacer, int64_t now_ns);
+void pacer_sent(pacer_t *pacer, int64_t now_ns);
+void pacer_arm(pacer_t *pacer);
+void pacer_clear(pacer_t *pacer);
+
+#endif
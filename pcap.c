@@ -0,0 +1,364 @@
+#include "common.h"
+#include "log.h"
+#include "pcap.h"
+#include <netinet/in.h>
+#include <time.h>
+
+/*
+ * pcapng capture of proxied datagrams. Each record carries a synthesised
+ * IPv4 or IPv6 + UDP header for the logical client <-> server endpoints and
+ * an opt_comment naming the packet's fate, and is stamped with clock_now()
+ * shifted to the wall clock by an offset taken once at open. Records are
+ * appended to one of two large buffers; a writer thread drains the full one
+ * to disk so file I/O never runs on the forwarding path. If both buffers are
+ * full the record is dropped and counted rather than stalling forwarding.
+ */
+
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BYTE_ORDER   0x1A2B3C4D
+#define PCAPNG_OPT_END      0
+#define PCAPNG_OPT_COMMENT  1
+#define PCAPNG_OPT_FLAGS    2
+#define PCAPNG_IF_TSRESOL   9
+#define PCAPNG_INBOUND      0x1
+#define LINKTYPE_RAW        101
+#define PCAP_RECORD_MAX     (LINE_LEN * 2 + 256)
+
+static void *writer_main(void *arg);
+static void append_record(pcap_writer_t *writer, const void *record, size_t len);
+static size_t put_u16(unsigned char *out, uint16_t value);
+static size_t put_u32(unsigned char *out, uint32_t value);
+static size_t put_option(unsigned char *out, uint16_t code, const void *value, size_t len);
+static size_t build_headers(unsigned char *out, const struct sockaddr_storage *src, const struct sockaddr_storage *dst, size_t payload_len);
+static void address_as_ipv6(const struct sockaddr_storage *addr, unsigned char *out, in_port_t *port);
+static uint16_t ipv4_checksum(const unsigned char *header, size_t len);
+
+void pcap_open(pcap_writer_t *writer, const char *filename) {
+    unsigned char header[64];
+    size_t len;
+    size_t block_start;
+    uint32_t block_len;
+    struct timespec wall;
+
+    memset(writer, 0, sizeof(*writer));
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    writer->epoch_offset_ns = (int64_t)wall.tv_sec * NS_PER_SEC + wall.tv_nsec - clock_refresh();
+
+    writer->file = fopen(filename, "wb");
+    if(!writer->file) {
+        perror("Failed to open pcap file");
+        exit(EXIT_FAILURE);
+    }
+
+    // We do our own buffering
+    setvbuf(writer->file, NULL, _IONBF, 0);
+
+    for(int i = 0; i < 2; i++) {
+        writer->buffers[i].data = malloc(PCAP_BUFFER_SIZE);
+        if(!writer->buffers[i].data) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    writer->active = &writer->buffers[0];
+
+    // Section header block
+    len = 0;
+    len += put_u32(header + len, PCAPNG_SHB);
+    len += put_u32(header + len, 28);
+    len += put_u32(header + len, PCAPNG_BYTE_ORDER);
+    len += put_u16(header + len, 1);
+    len += put_u16(header + len, 0);
+    len += put_u32(header + len, 0xFFFFFFFF);
+    len += put_u32(header + len, 0xFFFFFFFF);
+    len += put_u32(header + len, 28);
+
+    // Interface description block, nanosecond timestamps
+    block_start = len;
+    len += put_u32(header + len, PCAPNG_IDB);
+    len += 4;
+    len += put_u16(header + len, LINKTYPE_RAW);
+    len += put_u16(header + len, 0);
+    len += put_u32(header + len, 0);
+    len += put_option(header + len, PCAPNG_IF_TSRESOL, "\x09", 1);
+    len += put_option(header + len, PCAPNG_OPT_END, NULL, 0);
+    block_len = (uint32_t)(len + 4 - block_start);
+    put_u32(header + block_start + 4, block_len);
+    len += put_u32(header + len, block_len);
+
+    append_record(writer, header, len);
+    writer->records = 0;
+
+    if(pthread_mutex_init(&writer->lock, NULL) != 0 ||
+       pthread_cond_init(&writer->ready, NULL) != 0 ||
+       pthread_cond_init(&writer->drained, NULL) != 0) {
+        fprintf(stderr, "Failed to initialise pcap writer synchronisation\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+        fprintf(stderr, "Failed to start pcap writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void pcap_record(pcap_writer_t *writer, const struct sockaddr_storage *src, const struct sockaddr_storage *dst,
+                 const void *data, size_t len, const char *comment) {
+
+    unsigned char record[PCAP_RECORD_MAX];
+    uint64_t timestamp;
+    size_t kept = len;
+    size_t captured;
+    size_t headers;
+    size_t pos;
+    size_t comment_len;
+    uint32_t flags;
+
+    // Only the start of a long datagram is kept; its headers and original length still say how long it was
+    if(kept > LINE_LEN + 64) {
+        kept = LINE_LEN + 64;
+    }
+
+    comment_len = strlen(comment);
+    if(comment_len > PCAP_COMMENT_LEN) {
+        comment_len = PCAP_COMMENT_LEN;
+    }
+
+    timestamp = (uint64_t)(clock_now() + writer->epoch_offset_ns);
+
+    pos = 0;
+    pos += put_u32(record + pos, PCAPNG_EPB);
+    pos += 4;
+    pos += put_u32(record + pos, 0);
+    pos += put_u32(record + pos, (uint32_t)(timestamp >> 32));
+    pos += put_u32(record + pos, (uint32_t)timestamp);
+    pos += 8;
+
+    headers = build_headers(record + pos, src, dst, len);
+    memcpy(record + pos + headers, data, kept);
+    captured = headers + kept;
+    put_u32(record + 20, (uint32_t)captured);
+    put_u32(record + 24, (uint32_t)(headers + len));
+    pos += captured;
+
+    while(pos % 4) {
+        record[pos++] = 0;
+    }
+
+    flags = PCAPNG_INBOUND;
+    pos += put_option(record + pos, PCAPNG_OPT_COMMENT, comment, comment_len);
+    pos += put_option(record + pos, PCAPNG_OPT_FLAGS, &flags, sizeof(flags));
+    pos += put_option(record + pos, PCAPNG_OPT_END, NULL, 0);
+    put_u32(record + 4, (uint32_t)(pos + 4));
+    pos += put_u32(record + pos, (uint32_t)(pos + 4));
+
+    pthread_mutex_lock(&writer->lock);
+    append_record(writer, record, pos);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void pcap_close(pcap_writer_t *writer) {
+
+    pthread_mutex_lock(&writer->lock);
+
+    while(writer->pending) {
+        pthread_cond_wait(&writer->drained, &writer->lock);
+    }
+
+    if(writer->active->used) {
+        writer->pending = writer->active;
+    }
+
+    writer->closing = 1;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+
+    if(fclose(writer->file) != 0) {
+        perror("Error closing pcap file");
+    }
+
+    log_event(LOG_PROXY, "pcap capture closed: %" PRIu64 " records, %" PRIu64 " dropped", writer->records, writer->dropped);
+
+    free(writer->buffers[0].data);
+    free(writer->buffers[1].data);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->ready);
+    pthread_cond_destroy(&writer->drained);
+}
+
+static void *writer_main(void *arg) {
+    pcap_writer_t *writer = arg;
+    int reported = 0;
+
+    pthread_mutex_lock(&writer->lock);
+
+    for(;;) {
+        pcap_buffer_t *buffer;
+
+        while(!writer->pending && !writer->closing) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+        }
+
+        if(!writer->pending) {
+            break;
+        }
+
+        buffer = writer->pending;
+        pthread_mutex_unlock(&writer->lock);
+
+        if(fwrite(buffer->data, 1, buffer->used, writer->file) != buffer->used && !reported) {
+            perror("Error writing pcap file");
+            reported = 1;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        buffer->used = 0;
+        writer->pending = NULL;
+        pthread_cond_broadcast(&writer->drained);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+// Caller holds the lock (or is still single-threaded)
+static void append_record(pcap_writer_t *writer, const void *record, size_t len) {
+
+    if(writer->active->used + len > PCAP_BUFFER_SIZE) {
+        if(writer->pending) {
+            writer->dropped++;
+            return;
+        }
+
+        writer->pending = writer->active;
+        writer->active = writer->active == &writer->buffers[0] ? &writer->buffers[1] : &writer->buffers[0];
+        pthread_cond_signal(&writer->ready);
+    }
+
+    memcpy(writer->active->data + writer->active->used, record, len);
+    writer->active->used += len;
+    writer->records++;
+}
+
+static size_t put_u16(unsigned char *out, uint16_t value) {
+    memcpy(out, &value, sizeof(value));
+    return sizeof(value);
+}
+
+static size_t put_u32(unsigned char *out, uint32_t value) {
+    memcpy(out, &value, sizeof(value));
+    return sizeof(value);
+}
+
+static size_t put_option(unsigned char *out, uint16_t code, const void *value, size_t len) {
+    size_t pos = 0;
+
+    pos += put_u16(out + pos, code);
+    pos += put_u16(out + pos, (uint16_t)len);
+
+    if(len) {
+        memcpy(out + pos, value, len);
+        pos += len;
+    }
+
+    while(pos % 4) {
+        out[pos++] = 0;
+    }
+
+    return pos;
+}
+
+// IPv4 + UDP when both ends are IPv4, otherwise IPv6 + UDP with v4-mapped addresses
+static size_t build_headers(unsigned char *out, const struct sockaddr_storage *src_addr, const struct sockaddr_storage *dst_addr, size_t payload_len) {
+    uint16_t udp_len = (uint16_t)(8 + payload_len);
+    struct sockaddr_storage plain[2] = {*src_addr, *dst_addr};
+    const struct sockaddr_storage *src = &plain[0];
+    const struct sockaddr_storage *dst = &plain[1];
+    socklen_t plain_len;
+    in_port_t src_port;
+    in_port_t dst_port;
+    size_t pos;
+
+    // A dual-stack socket sees IPv4 clients as ::ffff:a.b.c.d; capture them as the IPv4 they are
+    normalize_address(&plain[0], &plain_len);
+    normalize_address(&plain[1], &plain_len);
+
+    if(src->ss_family != AF_INET6 && dst->ss_family != AF_INET6) {
+        const struct sockaddr_in *src4 = (const struct sockaddr_in *)src;
+        const struct sockaddr_in *dst4 = (const struct sockaddr_in *)dst;
+        uint16_t total_len = htons((uint16_t)(20 + udp_len));
+        uint16_t checksum;
+
+        memset(out, 0, 28);
+        out[0] = 0x45;
+        memcpy(out + 2, &total_len, 2);
+        out[6] = 0x40;
+        out[8] = 64;
+        out[9] = IPPROTO_UDP;
+        memcpy(out + 12, &src4->sin_addr, 4);
+        memcpy(out + 16, &dst4->sin_addr, 4);
+        checksum = ipv4_checksum(out, 20);
+        memcpy(out + 10, &checksum, 2);
+        src_port = src4->sin_port;
+        dst_port = dst4->sin_port;
+        pos = 20;
+    } else {
+        uint16_t payload = htons(udp_len);
+
+        memset(out, 0, 48);
+        out[0] = 0x60;
+        memcpy(out + 4, &payload, 2);
+        out[6] = IPPROTO_UDP;
+        out[7] = 64;
+        address_as_ipv6(src, out + 8, &src_port);
+        address_as_ipv6(dst, out + 24, &dst_port);
+        pos = 40;
+    }
+
+    udp_len = htons(udp_len);
+    memcpy(out + pos, &src_port, 2);
+    memcpy(out + pos + 2, &dst_port, 2);
+    memcpy(out + pos + 4, &udp_len, 2);
+    memset(out + pos + 6, 0, 2);
+
+    return pos + 8;
+}
+
+static void address_as_ipv6(const struct sockaddr_storage *addr, unsigned char *out, in_port_t *port) {
+
+    if(addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+
+        memcpy(out, &addr6->sin6_addr, 16);
+        *port = addr6->sin6_port;
+    } else {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)addr;
+
+        memset(out, 0, 10);
+        out[10] = 0xff;
+        out[11] = 0xff;
+        memcpy(out + 12, &addr4->sin_addr, 4);
+        *port = addr->ss_family == AF_INET ? addr4->sin_port : 0;
+    }
+}
+
+static uint16_t ipv4_checksum(const unsigned char *header, size_t len) {
+    uint32_t sum = 0;
+
+    for(size_t i = 0; i < len; i += 2) {
+        sum += (uint32_t)(header[i] << 8 | header[i + 1]);
+    }
+
+    while(sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return htons((uint16_t)~sum);
+}
@@ -0,0 +1,38 @@
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define PCAP_BUFFER_SIZE (4 * 1024 * 1024)
+#define PCAP_COMMENT_LEN 128    // longest packet comment kept, not counting the terminator
+
+typedef struct pcap_buffer {
+    char   *data;
+    size_t used;
+} pcap_buffer_t;
+
+typedef struct pcap_writer {
+    FILE            *file;
+    pcap_buffer_t   buffers[2];
+    pcap_buffer_t   *active;
+    pcap_buffer_t   *pending;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    pthread_cond_t  drained;
+    int             closing;
+    uint64_t        records;
+    uint64_t        dropped;
+    int64_t         epoch_offset_ns;    // added to clock_now() for wall-clock timestamps
+} pcap_writer_t;
+
+void pcap_open(pcap_writer_t *writer, const char *filename);
+void pcap_record(pcap_writer_t *writer, const struct sockaddr_storage *src, const struct sockaddr_storage *dst,
+                 const void *data, size_t len, const char *comment);
+void pcap_close(pcap_writer_t *writer);
+
+#endif
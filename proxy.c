@@ -1,113 +1,367 @@
 
 #include "common.h"
 #include "log.h"
+#include "uring.h"
+#include "replay.h"
+#include "pcap.h"
+#include "segment.h"
+#include "config.h"
+#include "schedule.h"
+#include "hoptrace.h"
+#include <poll.h>
 #include <time.h>
 #include <sys/time.h>
-
-
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+// Fate of a packet in the low bits, independent modifiers above them
+#define NOISE_NONE      0
+#define NOISE_DROP      1
+#define NOISE_DELAY     2
+#define NOISE_REORDER   3
+#define NOISE_FATE_MASK 0x0f
+#define NOISE_DUPLICATE 0x10
+#define NOISE_CORRUPT   0x20
+
+// Room for the SO_RXQ_OVFL control message on io_uring receives
+#define PROXY_URING_CONTROL_LEN CMSG_SPACE(sizeof(uint32_t))
+
+_Static_assert(NOISE_DROP == REPLAY_DROP && NOISE_DELAY == REPLAY_DELAY && NOISE_REORDER == REPLAY_REORDER &&
+               NOISE_DUPLICATE == REPLAY_DUPLICATE && NOISE_CORRUPT == REPLAY_CORRUPT,
+               "trace actions must match the noise encoding");
+
+// Allocated only up to the packet's wire length, so packet has to stay last
 typedef struct delayed_packet {
-    packet_t packet;
-    struct timeval send_time;
+    int64_t send_ns;        // clock_now() time it is due
+    int noise;
+    size_t size;            // bytes allocated, charged to the path's queue
+    size_t len;             // bytes received, which is what gets sent
     struct delayed_packet *next;
-    
+    packet_t packet;
 } delayed_packet_t;
 
+typedef struct path {
+    impairment_t impairment;    // replaced whole on a config reload or by the schedule
+    int direction;
+    delayed_packet_t *queue;
+    delayed_packet_t *held;
+    replay_trace_t *replay;
+    pcap_writer_t *pcap;
+    struct sockaddr_storage *src_addr;
+    struct sockaddr_storage *dst_addr;
+    uint64_t emulated_drops;    // dropped by the impairment model
+    uint32_t kernel_drops;      // SO_RXQ_OVFL count on the receiving socket
+    size_t queued_bytes;        // delayed and held packets waiting to leave
+    size_t peak_queued_bytes;
+    size_t queue_limit;         // a packet that would take queued_bytes past this is dropped instead
+    uint64_t overflow_drops;
+} path_t;
+
+typedef struct proxy_options {
+    char *listen_ip_str;
+    char *listen_port_str;
+    char *target_ip_str;
+    char *target_port_str;
+    char *client_drop_str;
+    char *server_drop_str;
+    char *client_delay_str;
+    char *server_delay_str;
+    char *client_delay_min_time_str;
+    char *client_delay_max_time_str;
+    char *server_delay_min_time_str;
+    char *server_delay_max_time_str;
+    char *client_dup_str;
+    char *server_dup_str;
+    char *client_corrupt_str;
+    char *server_corrupt_str;
+    char *client_reorder_str;
+    char *server_reorder_str;
+    char *trace_str;
+    char *pcap_str;
+    char *rcvbuf_str;
+    char *sndbuf_str;
+    char *config_str;
+    char *schedule_str;
+    char *hop_trace_str;
+    char *client_queue_limit_str;
+    char *server_queue_limit_str;
+    int  trace_loop;
+    int  use_uring;
+    int  use_tsc;
+    int  connect_upstream;
+    int  use_gso;
+    int  dual_stack;
+} proxy_options_t;
+
+enum {
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_TIMEOUT,
+    URING_OP_HOLD
+};
+
+typedef struct uring_op {
+    int                      type;
+    path_t                   *path;
+    int                      bid;
+    int                      duplicate;
+    delayed_packet_t         *delayed;
+    struct sockaddr_storage  addr;
+    struct msghdr            msg;
+    struct iovec             iov;
+    struct __kernel_timespec ts;
+    struct uring_op          *next_free;
+} uring_op_t;
+
+typedef struct uring_proxy {
+    uring_t                 ring;
+    int                     recv_fds[2];
+    int                     send_fds[2];
+    path_t                  *paths[2];
+    struct sockaddr_storage client_addr;
+    socklen_t               client_addr_len;
+    struct sockaddr_storage *target_ip;
+    socklen_t               target_ip_len;
+    uring_op_t              recv_ops[2];
+    struct io_uring_sqe     *last_send[2];
+    uring_op_t              *free_ops;
+} uring_proxy_t;
+
 static void init_random();
-static void parse_args(int argc,char *argv[], char **listen_ip_str, char **listen_port_str, char **target_ip_str, char **target_port_str,
-                    char **client_drop_str, char **server_drop_str, char **client_delay_str, char **server_delay_str, char **client_delay_min_time_str,
-                    char **client_delay_max_time_str, char **server_delay_min_time_str, char **server_delay_max_time_str);
+static void parse_args(int argc,char *argv[], proxy_options_t *options);
+static void set_option(const char *program_name, char **option, const char *name);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
-static int parse_int_param(const char *str, const char *name);
-static int determine_noise(const int drop_chance, const int delay_chance);
-static void delay_packet(packet_t *packet, int delay_min, int delay_max, delayed_packet_t **delay_queue, int queue_direction); 
+static int read_config(const char *filename, config_t *config, proxy_options_t *options, int reload);
+static int parse_param(const char *str, const char *name, int *value);
+static int parse_impairments(const proxy_options_t *options, impairment_t *client, impairment_t *server);
+static void sighup_handler(int signum);
+static void reload_config(path_t *client_path, path_t *server_path);
+static void follow_schedule(path_t *client_path, path_t *server_path);
+static void log_impairments(const path_t *client_path, const path_t *server_path);
+static int determine_noise(path_t *path, int *delay_time, unsigned *corrupt_seed);
+static delayed_packet_t *alloc_delayed(path_t *path, const packet_t *packet, size_t len);
+static void free_delayed(path_t *path, delayed_packet_t *node);
+static delayed_packet_t *delay_packet(path_t *path, packet_t *packet, size_t len, int delay_time);
 static int determine_delay(const int min_time, const int max_time);
 static void add_to_delay_queue(delayed_packet_t **queue, delayed_packet_t *new_node);
-static void process_delay_queue(int sock_fd, delayed_packet_t **queue, struct sockaddr *dest_addr, socklen_t addr_len, int queue_direction);
+static void process_delay_queue(segment_batch_t *out, path_t *path, struct sockaddr *dest_addr, socklen_t addr_len);
+static int classify_packet(path_t *path, packet_t *packet, size_t len, delayed_packet_t **delayed);
+static void corrupt_packet(packet_t *packet, size_t len, unsigned seed);
+static void capture_packet(path_t *path, packet_t *packet, size_t len, int noise, int delay_time);
+static delayed_packet_t *hold_packet(path_t *path, packet_t *packet, size_t len);
+static delayed_packet_t *take_held_packet(path_t *path);
+static int held_packet_due(const path_t *path);
+static void forward_now(segment_batch_t *out, path_t *path, packet_t *packet, size_t len, int noise, struct sockaddr *dest_addr, socklen_t addr_len);
+static void send_delayed_node(segment_batch_t *out, path_t *path, delayed_packet_t *node, struct sockaddr *dest_addr, socklen_t addr_len);
+static void remove_from_delay_queue(delayed_packet_t **queue, delayed_packet_t *node);
+static void relay_packet(path_t *path, void *data, size_t len, segment_batch_t *out, struct sockaddr *dest_addr, socklen_t addr_len);
+static void configure_buffers(int client_sock_fd, int server_sock_fd, const proxy_options_t *options);
+static void report_drops(const path_t *path);
+static void report_memory(void);
+static int run_uring_loop(int client_sock_fd, int server_sock_fd, path_t *client_path, path_t *server_path, struct sockaddr_storage *target_ip, socklen_t target_ip_len);
+static struct io_uring_sqe *uring_next_sqe(uring_proxy_t *proxy);
+static uring_op_t *uring_op_alloc(uring_proxy_t *proxy, int type, path_t *path);
+static void uring_op_free(uring_proxy_t *proxy, uring_op_t *op);
+static void uring_arm_recv(uring_proxy_t *proxy, int direction);
+static void uring_queue_send(uring_proxy_t *proxy, uring_op_t *op, void *data, size_t len);
+static void uring_queue_delayed(uring_proxy_t *proxy, path_t *path, delayed_packet_t *node);
+static void uring_arm_timeout(uring_proxy_t *proxy, path_t *path, int type, delayed_packet_t *node);
+static void uring_handle_cqe(uring_proxy_t *proxy, struct io_uring_cqe *cqe);
+
+// Options a config file may set; only the impairments are read again on SIGHUP
+static const struct config_option {
+    const char *key;
+    size_t     offset;      // of its string in proxy_options_t
+    int        reloadable;
+} config_options[] = {
+    {"listen-ip", offsetof(proxy_options_t, listen_ip_str), 0},
+    {"listen-port", offsetof(proxy_options_t, listen_port_str), 0},
+    {"target-ip", offsetof(proxy_options_t, target_ip_str), 0},
+    {"target-port", offsetof(proxy_options_t, target_port_str), 0},
+    {"client-drop", offsetof(proxy_options_t, client_drop_str), 1},
+    {"server-drop", offsetof(proxy_options_t, server_drop_str), 1},
+    {"client-delay", offsetof(proxy_options_t, client_delay_str), 1},
+    {"server-delay", offsetof(proxy_options_t, server_delay_str), 1},
+    {"client-delay-time-min", offsetof(proxy_options_t, client_delay_min_time_str), 1},
+    {"client-delay-time-max", offsetof(proxy_options_t, client_delay_max_time_str), 1},
+    {"server-delay-time-min", offsetof(proxy_options_t, server_delay_min_time_str), 1},
+    {"server-delay-time-max", offsetof(proxy_options_t, server_delay_max_time_str), 1},
+    {"client-dup", offsetof(proxy_options_t, client_dup_str), 1},
+    {"server-dup", offsetof(proxy_options_t, server_dup_str), 1},
+    {"client-corrupt", offsetof(proxy_options_t, client_corrupt_str), 1},
+    {"server-corrupt", offsetof(proxy_options_t, server_corrupt_str), 1},
+    {"client-reorder", offsetof(proxy_options_t, client_reorder_str), 1},
+    {"server-reorder", offsetof(proxy_options_t, server_reorder_str), 1},
+    {"trace", offsetof(proxy_options_t, trace_str), 0},
+    {"pcap", offsetof(proxy_options_t, pcap_str), 0},
+    {"rcvbuf", offsetof(proxy_options_t, rcvbuf_str), 0},
+    {"sndbuf", offsetof(proxy_options_t, sndbuf_str), 0},
+    {"schedule", offsetof(proxy_options_t, schedule_str), 0},
+    {"hop-trace", offsetof(proxy_options_t, hop_trace_str), 0},
+    {"client-queue-limit", offsetof(proxy_options_t, client_queue_limit_str), 0},
+    {"server-queue-limit", offsetof(proxy_options_t, server_queue_limit_str), 0},
+};
+
+// Set by SIGHUP, acted on between packets by whichever loop is forwarding
+static volatile sig_atomic_t reload_flag;
+static const char *config_file;
+
+// Set with --schedule; the impairments then follow it
+static schedule_t *schedule;
+
+// Set with --hop-trace; every arrival, drop and departure is recorded for merge_traces.py
+static hop_trace_t *hop_trace;
 
 int main(int argc, char *argv[]) {
-    
-    char                   *listen_ip_str;
-    char                   *listen_port_str;
-    char                   *target_ip_str;
-    char                   *target_port_str;
-    char                   *client_drop_str;
-    char                   *server_drop_str;
-    char                   *client_delay_str;
-    char                   *server_delay_str;
-    char                   *client_delay_min_time_str;
-    char                   *client_delay_max_time_str;
-    char                   *server_delay_min_time_str;
-    char                   *server_delay_max_time_str;
+
+    proxy_options_t         options;
     struct sockaddr_storage listen_ip;
     struct sockaddr_storage target_ip;
     socklen_t               listen_ip_len;
     socklen_t               target_ip_len;
     in_port_t               listen_port;
     in_port_t               target_port;
-    int                     client_drop;
-    int                     server_drop;
-    int                     client_delay;
-    int                     server_delay;
-    int                     client_delay_min;
-    int                     client_delay_max;
-    int                     server_delay_min;
-    int                     server_delay_max;
+    path_t                  client_path;
+    path_t                  server_path;
     int                     client_sock_fd;
     int                     server_sock_fd;
     struct timeval          socket_timevalue;
     struct sockaddr_storage client_addr;
     socklen_t               client_addr_len;
-    delayed_packet_t        *client_to_server_queue;
-    delayed_packet_t        *server_to_client_queue;
-
-    listen_ip_str = NULL;
-    listen_port_str = NULL;
-    target_ip_str = NULL;
-    target_port_str = NULL;
-    client_drop_str = NULL;
-    server_drop_str = NULL;
-    client_delay_str = NULL;
-    server_delay_str = NULL;
-    client_delay_min_time_str = NULL;
-    client_delay_max_time_str = NULL;
-    server_delay_min_time_str = NULL;
-    server_delay_max_time_str = NULL;
+    struct sockaddr         *upstream_addr;
+    socklen_t               upstream_len;
+    static segment_batch_t  to_server;
+    static segment_batch_t  to_client;
+    static packet_t         received[SEGMENT_RECEIVE_PACKETS];
+    size_t                  segment_len;
+    replay_trace_t          replay;
+    pcap_writer_t           pcap;
+    static schedule_t       timeline;
+    static hop_trace_t      tracing;
+
+    memset(&options, 0, sizeof(options));
     socket_timevalue.tv_sec = PROXY_TIMEOUT_S;
     socket_timevalue.tv_usec = PROXY_TIMEOUT_US;
     client_addr_len = sizeof(client_addr);
-    client_to_server_queue = NULL;
-    server_to_client_queue = NULL;
+    memset(&client_path, 0, sizeof(client_path));
+    memset(&server_path, 0, sizeof(server_path));
+    client_path.direction = 0;
+    server_path.direction = 1;
+    client_path.src_addr = &client_addr;
+    client_path.dst_addr = &target_ip;
+    server_path.src_addr = &target_ip;
+    server_path.dst_addr = &client_addr;
+    memset(&client_addr, 0, sizeof(client_addr));
 
     init_random();
     setup_signal_handler();
-    parse_args(argc, argv, &listen_ip_str, &listen_port_str, &target_ip_str, &target_port_str, &client_drop_str, &server_drop_str, &client_delay_str,
-            &server_delay_str, &client_delay_min_time_str, &client_delay_max_time_str, &server_delay_min_time_str, &server_delay_max_time_str);
+    parse_args(argc, argv, &options);
+    clock_init(options.use_tsc);
+    log_event(LOG_PROXY, "Clock source: %s", clock_source());
 
-    convert_address(listen_ip_str, &listen_ip, &listen_ip_len);
-    convert_address(target_ip_str, &target_ip, &target_ip_len);
+    convert_address(options.listen_ip_str, &listen_ip, &listen_ip_len);
+    convert_address(options.target_ip_str, &target_ip, &target_ip_len);
 
-    parse_port(listen_port_str, &listen_port);
-    parse_port(target_port_str, &target_port);
+    parse_port(options.listen_port_str, &listen_port);
+    parse_port(options.target_port_str, &target_port);
 
-    client_drop         = parse_int_param(client_drop_str, "client-drop");
-    server_drop         = parse_int_param(server_drop_str, "server-drop");
-    client_delay        = parse_int_param(client_delay_str, "client-delay");
-    server_delay        = parse_int_param(server_delay_str, "server-delay");
-    client_delay_min    = parse_int_param(client_delay_min_time_str, "client-delay-min");
-    client_delay_max    = parse_int_param(client_delay_max_time_str, "client-delay-max");
-    server_delay_min    = parse_int_param(server_delay_min_time_str, "server-delay-min");
-    server_delay_max    = parse_int_param(server_delay_max_time_str, "server-delay-max");
-
-    if(client_delay_min > client_delay_max || server_delay_min > server_delay_max) {
-        fprintf(stderr, "Delay min time cannot be greater than delay max time\n");
+    if(!parse_impairments(&options, &client_path.impairment, &server_path.impairment)) {
         exit(EXIT_FAILURE);
     }
 
+    client_path.queue_limit = options.client_queue_limit_str ?
+        (size_t) parse_unsigned(options.client_queue_limit_str, "client-queue-limit", PROXY_MAX_QUEUE_LIMIT) : PROXY_QUEUE_LIMIT;
+    server_path.queue_limit = options.server_queue_limit_str ?
+        (size_t) parse_unsigned(options.server_queue_limit_str, "server-queue-limit", PROXY_MAX_QUEUE_LIMIT) : PROXY_QUEUE_LIMIT;
+
+    if(options.config_str) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sighup_handler;
+        sigemptyset(&sa.sa_mask);
+
+        if(sigaction(SIGHUP, &sa, NULL) == -1) {
+            perror("Signal handler setup failed");
+            exit(EXIT_FAILURE);
+        }
+
+        config_file = options.config_str;
+        log_event(LOG_PROXY, "Settings from %s, reloaded on SIGHUP", config_file);
+    }
+
+    if(options.schedule_str) {
+        schedule_load(&timeline, options.schedule_str, &client_path.impairment, &server_path.impairment);
+        schedule = &timeline;
+    }
+
+    if(options.trace_str) {
+        replay_load(&replay, options.trace_str, options.trace_loop);
+        client_path.replay = &replay;
+        server_path.replay = &replay;
+    } else if(options.trace_loop) {
+        usage(argv[0], EXIT_FAILURE, "--trace-loop requires --trace");
+    }
+
+    if(options.pcap_str) {
+        pcap_open(&pcap, options.pcap_str);
+        client_path.pcap = &pcap;
+        server_path.pcap = &pcap;
+    }
+
+    if(options.hop_trace_str) {
+        hop_trace_open(&tracing, options.hop_trace_str, HOP_PROXY);
+        hop_trace = &tracing;
+    }
+
+    if(options.dual_stack) {
+        dual_stack_address(&listen_ip, &listen_ip_len);
+    }
+
     client_sock_fd = create_socket(listen_ip.ss_family, SOCK_DGRAM, 0);
     server_sock_fd = create_socket(target_ip.ss_family, SOCK_DGRAM, 0);
+    if(options.dual_stack) {
+        enable_dual_stack(client_sock_fd);
+        log_event(LOG_PROXY, "Dual stack: IPv4 clients share the IPv6 listening socket");
+    }
 
     bind_socket(client_sock_fd, &listen_ip, listen_port);
     get_address_to_server(&target_ip, target_port);
+    configure_buffers(client_sock_fd, server_sock_fd, &options);
+
+    // Once connected, the upstream socket sends without an address and the kernel drops strays
+    upstream_addr = (struct sockaddr *)&target_ip;
+    upstream_len = target_ip_len;
+    if(options.connect_upstream) {
+        connect_socket(server_sock_fd, &target_ip, target_ip_len);
+        upstream_addr = NULL;
+        upstream_len = 0;
+        log_event(LOG_PROXY, "Upstream socket connected to the target");
+    }
+
+    segment_batch_init(&to_server, server_sock_fd, options.use_gso);
+    segment_batch_init(&to_client, client_sock_fd, options.use_gso);
+    if(options.use_gso) {
+        segment_enable_gso(client_sock_fd);
+        segment_enable_gso(server_sock_fd);
+        segment_enable_gro(client_sock_fd);
+        segment_enable_gro(server_sock_fd);
+        log_event(LOG_PROXY, "UDP segmentation offload on, up to %d packets per send", SEGMENT_MAX_COUNT);
+    }
+
+    // The timeline runs from when forwarding begins
+    if(schedule) {
+        schedule_start(schedule, clock_refresh());
+        follow_schedule(&client_path, &server_path);
+    }
+
+    if(options.use_uring) {
+        if(run_uring_loop(client_sock_fd, server_sock_fd, &client_path, &server_path, &target_ip, upstream_len) == 0) {
+            exit_flag = 1;
+        } else {
+            fprintf(stderr, "io_uring unavailable (%s), falling back to recvfrom loop\n", strerror(errno));
+        }
+    }
 
     if (setsockopt(client_sock_fd, SOL_SOCKET, SO_RCVTIMEO, &socket_timevalue, sizeof(socket_timevalue)) < 0) {
         perror("setsockopt client_sock_fd SO_RCVTIMEO");
@@ -121,59 +375,106 @@ int main(int argc, char *argv[]) {
 
     while (!exit_flag) {
 
-        packet_t packet;
-        packet_t packet_server;
+        ssize_t n;
+        struct pollfd fds[2];
+        int busy = client_path.queue || server_path.queue || client_path.held || server_path.held;
+
+        /*
+         * Wait on both sockets so a pipelining sender is not held in lockstep
+         * with the replies; wake every millisecond while packets are queued.
+         */
+        fds[0].fd = client_sock_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server_sock_fd;
+        fds[1].events = POLLIN;
+
+        if(poll(fds, 2, busy ? 1 : PROXY_TIMEOUT_S * 1000 + PROXY_TIMEOUT_US / 1000) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
 
-        ssize_t n = recvfrom(client_sock_fd, &packet, sizeof(packet), 0, (struct sockaddr *)&client_addr, &client_addr_len);
+        clock_refresh();
 
-        if (n > 0) {
-            log_packet(LOG_PROXY, "Received from Client", packet.sequence, packet.payload, 0);
-            int noise = determine_noise(client_drop, client_delay);
+        if(reload_flag) {
+            reload_config(&client_path, &server_path);
+        }
 
-            if(!noise) {
-                send_packet(server_sock_fd, &packet, (struct sockaddr *)&target_ip, target_ip_len);
-                log_packet(LOG_PROXY, "Sent to Server", packet.sequence, packet.payload, 1);
-            } else if (noise == 2) {
-                delay_packet(&packet, client_delay_min, client_delay_max, &client_to_server_queue, 0);
+        if(schedule) {
+            follow_schedule(&client_path, &server_path);
+        }
 
-            } else {
-                log_packet(LOG_PROXY, "Dropped Client to Server", packet.sequence, packet.payload, 1);
-            }
+        // With GRO one receive may hold several datagrams, each segment_len long
+        n = segment_receive(client_sock_fd, received, sizeof(received), MSG_DONTWAIT, (struct sockaddr *)&client_addr, &client_addr_len, &client_path.kernel_drops, &segment_len);
 
+        if (n > 0) {
+            for(size_t offset = 0; offset < (size_t)n; offset += segment_len) {
+                relay_packet(&client_path, (char *)received + offset, (size_t)n - offset < segment_len ? (size_t)n - offset : segment_len,
+                             &to_server, upstream_addr, upstream_len);
+            }
         } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
             perror("recvfrom client");
             break;
         }
 
-        n = recvfrom(server_sock_fd, &packet_server, sizeof(packet_server), 0, (struct sockaddr *)&target_ip, &target_ip_len);
+        n = segment_receive(server_sock_fd, received, sizeof(received), MSG_DONTWAIT, upstream_addr, &upstream_len, &server_path.kernel_drops, &segment_len);
 
         if (n > 0) {
-            log_packet(LOG_PROXY, "Received from Server", packet_server.sequence, packet_server.payload, 0);
-            int noise = determine_noise(server_drop, server_delay);
-
-            if(!noise) {
-                send_packet(client_sock_fd, &packet_server, (struct sockaddr *)&client_addr, client_addr_len);
-                log_packet(LOG_PROXY, "Sent to Client", packet_server.sequence, packet_server.payload, 1);
-
-            } else if (noise == 2) {
-                delay_packet(&packet_server, server_delay_min, server_delay_max, &server_to_client_queue, 1);
-            } else {
-                log_packet(LOG_PROXY, "Dropped Server to Client", packet_server.sequence, packet_server.payload, 1);
-
+            for(size_t offset = 0; offset < (size_t)n; offset += segment_len) {
+                relay_packet(&server_path, (char *)received + offset, (size_t)n - offset < segment_len ? (size_t)n - offset : segment_len,
+                             &to_client, (struct sockaddr *)&client_addr, client_addr_len);
             }
         } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
             perror("recvfrom server");
             break;
         }
 
-        process_delay_queue(server_sock_fd, &client_to_server_queue, (struct sockaddr *)&target_ip, target_ip_len, 0);
-        process_delay_queue(client_sock_fd, &server_to_client_queue, (struct sockaddr *)&client_addr, client_addr_len, 1);
+        process_delay_queue(&to_server, &client_path, upstream_addr, upstream_len);
+        process_delay_queue(&to_client, &server_path, (struct sockaddr *)&client_addr, client_addr_len);
+
+        // Nothing overtook a reordered packet within the hold time
+        if(held_packet_due(&client_path)) {
+            send_delayed_node(&to_server, &client_path, take_held_packet(&client_path), upstream_addr, upstream_len);
+        }
+
+        if(held_packet_due(&server_path)) {
+            send_delayed_node(&to_client, &server_path, take_held_packet(&server_path), (struct sockaddr *)&client_addr, client_addr_len);
+        }
+
+        segment_batch_flush(&to_server);
+        segment_batch_flush(&to_client);
 
     }
 
 
+    report_drops(&client_path);
+    report_drops(&server_path);
+    report_memory();
+
+    if(options.use_gso) {
+        log_event(LOG_PROXY, "Sent %" PRIu64 " packets to the server in %" PRIu64 " sends, %" PRIu64 " to the client in %" PRIu64,
+                  to_server.sent, to_server.sends, to_client.sent, to_client.sends);
+    }
+
     close_socket(client_sock_fd);
     close_socket(server_sock_fd);
+
+    if(options.trace_str) {
+        replay_close(&replay);
+    }
+
+    if(options.pcap_str) {
+        pcap_close(&pcap);
+    }
+
+    if(schedule) {
+        schedule_close(schedule);
+    }
+
+    if(hop_trace) {
+        log_event(LOG_PROXY, "Wrote %" PRIu64 " hop trace records", hop_trace->records);
+        hop_trace_close(hop_trace);
+    }
+
     log_close();
 
     exit(EXIT_SUCCESS);
@@ -183,25 +484,18 @@ static void init_random() {
     srand((unsigned int)time(NULL));
 }
 
-static void parse_args(int argc,char *argv[], char **listen_ip_str, char **listen_port_str, char **target_ip_str, char **target_port_str,
-                    char **client_drop_str, char **server_drop_str, char **client_delay_str, char **server_delay_str, char **client_delay_min_time_str,
-                    char **client_delay_max_time_str, char **server_delay_min_time_str, char **server_delay_max_time_str){
+static void parse_args(int argc,char *argv[], proxy_options_t *options){
 
     int opt;
     int option_index = 0;
-    int listen_ip_set = 0;
-    int listen_port_set = 0;
-    int target_ip_set = 0;
-    int target_port_set = 0;
-    int client_drop_set = 0;
-    int server_drop_set = 0;
-    int client_delay_set = 0;
-    int server_delay_set = 0;
-    int client_delay_min_set = 0;
-    int client_delay_max_set = 0;
-    int server_delay_min_set = 0;
-    int server_delay_max_set = 0;
     int log_set = 0;
+    int uring_set = 0;
+    int trace_loop_set = 0;
+    int tsc_set = 0;
+    int connect_set = 0;
+    int gso_set = 0;
+    int dual_stack_set = 0;
+    static config_t config;
 
     static struct option long_options[] = {
         {"listen-ip", required_argument, 0, 1},
@@ -216,6 +510,27 @@ static void parse_args(int argc,char *argv[], char **listen_ip_str, char **liste
         {"client-delay-time-max", required_argument, 0, 10},
         {"server-delay-time-min", required_argument, 0, 11},
         {"server-delay-time-max", required_argument, 0, 12},
+        {"uring", no_argument, 0, 13},
+        {"client-dup", required_argument, 0, 14},
+        {"server-dup", required_argument, 0, 15},
+        {"client-corrupt", required_argument, 0, 16},
+        {"server-corrupt", required_argument, 0, 17},
+        {"client-reorder", required_argument, 0, 18},
+        {"server-reorder", required_argument, 0, 19},
+        {"trace", required_argument, 0, 20},
+        {"trace-loop", no_argument, 0, 21},
+        {"pcap", required_argument, 0, 22},
+        {"tsc", no_argument, 0, 23},
+        {"rcvbuf", required_argument, 0, 24},
+        {"sndbuf", required_argument, 0, 25},
+        {"connect-upstream", no_argument, 0, 26},
+        {"gso", no_argument, 0, 27},
+        {"config", required_argument, 0, 28},
+        {"schedule", required_argument, 0, 29},
+        {"hop-trace", required_argument, 0, 30},
+        {"dual-stack", no_argument, 0, 31},
+        {"client-queue-limit", required_argument, 0, 32},
+        {"server-queue-limit", required_argument, 0, 33},
         {"log", no_argument, 0, 'l'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -225,90 +540,81 @@ static void parse_args(int argc,char *argv[], char **listen_ip_str, char **liste
 
     while((opt = getopt_long(argc, argv, "hl", long_options, &option_index)) != -1) {
         switch(opt){
-            case 1:
-                if(listen_ip_set){
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --target-ip");
-                }
-                *listen_ip_str = optarg;
-                listen_ip_set = 1;
+            case 1:  set_option(argv[0], &options->listen_ip_str, "--listen-ip"); break;
+            case 2:  set_option(argv[0], &options->listen_port_str, "--listen-port"); break;
+            case 3:  set_option(argv[0], &options->target_ip_str, "--target-ip"); break;
+            case 4:  set_option(argv[0], &options->target_port_str, "--target-port"); break;
+            case 5:  set_option(argv[0], &options->client_drop_str, "--client-drop"); break;
+            case 6:  set_option(argv[0], &options->server_drop_str, "--server-drop"); break;
+            case 7:  set_option(argv[0], &options->client_delay_str, "--client-delay"); break;
+            case 8:  set_option(argv[0], &options->server_delay_str, "--server-delay"); break;
+            case 9:  set_option(argv[0], &options->client_delay_min_time_str, "--client-delay-time-min"); break;
+            case 10: set_option(argv[0], &options->client_delay_max_time_str, "--client-delay-time-max"); break;
+            case 11: set_option(argv[0], &options->server_delay_min_time_str, "--server-delay-time-min"); break;
+            case 12: set_option(argv[0], &options->server_delay_max_time_str, "--server-delay-time-max"); break;
+
+            case 13:
+                if (uring_set)
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --uring");
+                options->use_uring = 1;
+                uring_set = 1;
                 break;
 
-            case 2:
-                if (listen_port_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --listen-port");
-                *listen_port_str = optarg;
-                listen_port_set = 1;
+            case 14: set_option(argv[0], &options->client_dup_str, "--client-dup"); break;
+            case 15: set_option(argv[0], &options->server_dup_str, "--server-dup"); break;
+            case 16: set_option(argv[0], &options->client_corrupt_str, "--client-corrupt"); break;
+            case 17: set_option(argv[0], &options->server_corrupt_str, "--server-corrupt"); break;
+            case 18: set_option(argv[0], &options->client_reorder_str, "--client-reorder"); break;
+            case 19: set_option(argv[0], &options->server_reorder_str, "--server-reorder"); break;
+            case 20: set_option(argv[0], &options->trace_str, "--trace"); break;
+
+            case 21:
+                if (trace_loop_set)
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --trace-loop");
+                options->trace_loop = 1;
+                trace_loop_set = 1;
                 break;
 
-            case 3:
-                if (target_ip_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --target-ip");
-                *target_ip_str = optarg;
-                target_ip_set = 1;
-                break;
+            case 22: set_option(argv[0], &options->pcap_str, "--pcap"); break;
 
-            case 4:
-                if (target_port_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --target-port");
-                *target_port_str = optarg;
-                target_port_set = 1;
+            case 23:
+                if (tsc_set)
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --tsc");
+                options->use_tsc = 1;
+                tsc_set = 1;
                 break;
 
-            case 5:
-                if (client_drop_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --client-drop");
-                *client_drop_str = optarg;
-                client_drop_set = 1;
-                break;
+            case 24: set_option(argv[0], &options->rcvbuf_str, "--rcvbuf"); break;
+            case 25: set_option(argv[0], &options->sndbuf_str, "--sndbuf"); break;
 
-            case 6:
-                if (server_drop_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --server-drop");
-                *server_drop_str = optarg;
-                server_drop_set = 1;
+            case 26:
+                if (connect_set)
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --connect-upstream");
+                options->connect_upstream = 1;
+                connect_set = 1;
                 break;
 
-            case 7:
-                if (client_delay_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --client-delay");
-                *client_delay_str = optarg;
-                client_delay_set = 1;
+            case 27:
+                if (gso_set)
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --gso");
+                options->use_gso = 1;
+                gso_set = 1;
                 break;
 
-            case 8:
-                if (server_delay_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --server-delay");
-                *server_delay_str = optarg;
-                server_delay_set = 1;
-                break;
+            case 28: set_option(argv[0], &options->config_str, "--config"); break;
+            case 29: set_option(argv[0], &options->schedule_str, "--schedule"); break;
+            case 30: set_option(argv[0], &options->hop_trace_str, "--hop-trace"); break;
 
-            case 9:
-                if (client_delay_min_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --client-delay-time-min");
-                *client_delay_min_time_str = optarg;
-                client_delay_min_set = 1;
+            case 31:
+                if (dual_stack_set)
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --dual-stack");
+                options->dual_stack = 1;
+                dual_stack_set = 1;
                 break;
 
-            case 10:
-                if (client_delay_max_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --client-delay-time-max");
-                *client_delay_max_time_str = optarg;
-                client_delay_max_set = 1;
-                break;
+            case 32: set_option(argv[0], &options->client_queue_limit_str, "--client-queue-limit"); break;
+            case 33: set_option(argv[0], &options->server_queue_limit_str, "--server-queue-limit"); break;
 
-            case 11:
-                if (server_delay_min_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --server-delay-time-min");
-                *server_delay_min_time_str = optarg;
-                server_delay_min_set = 1;
-                break;
-
-            case 12:
-                if (server_delay_max_set)
-                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --server-delay-time-max");
-                *server_delay_max_time_str = optarg;
-                server_delay_max_set = 1;
-                break;
             case 'l':
                 if(log_set) {
                     usage(argv[0], EXIT_FAILURE, "Duplicate option: --log/-l");
@@ -330,12 +636,17 @@ static void parse_args(int argc,char *argv[], char **listen_ip_str, char **liste
         }
     }
 
-    if (!listen_ip_set || !listen_port_set ||
-        !target_ip_set || !target_port_set ||
-        !client_drop_set || !server_drop_set ||
-        !client_delay_set || !server_delay_set ||
-        !client_delay_min_set || !client_delay_max_set ||
-        !server_delay_min_set || !server_delay_max_set)
+    // Flags on the command line win over the same setting in the file
+    if (options->config_str && !read_config(options->config_str, &config, options, 0)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (!options->listen_ip_str || !options->listen_port_str ||
+        !options->target_ip_str || !options->target_port_str ||
+        !options->client_drop_str || !options->server_drop_str ||
+        !options->client_delay_str || !options->server_delay_str ||
+        !options->client_delay_min_time_str || !options->client_delay_max_time_str ||
+        !options->server_delay_min_time_str || !options->server_delay_max_time_str)
     {
         usage(argv[0], EXIT_FAILURE, "Missing required arguments.");
     }
@@ -343,6 +654,22 @@ static void parse_args(int argc,char *argv[], char **listen_ip_str, char **liste
     if (optind < argc) {
         usage(argv[0], EXIT_FAILURE, "Unexpected extra arguments.");
     }
+
+    // The io_uring receive buffers hold one packet each
+    if (options->use_gso && options->use_uring) {
+        usage(argv[0], EXIT_FAILURE, "--gso cannot be combined with --uring");
+    }
+}
+
+static void set_option(const char *program_name, char **option, const char *name) {
+
+    if(*option) {
+        char message[LINE_LEN];
+        snprintf(message, sizeof(message), "Duplicate option: %s", name);
+        usage(program_name, EXIT_FAILURE, message);
+    }
+
+    *option = optarg;
 }
 
 _Noreturn static void usage(const char *program_name, int exit_code, const char* message){
@@ -370,66 +697,263 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char*
     fputs("  --server-delay-time-min <ms>     Minimum delay time (ms) for server packets\n", stderr);
     fputs("  --server-delay-time-max <ms>     Maximum delay time (ms) for server packets\n", stderr);
 
+    fputs("  --client-dup <percent>           Duplication chance (%) for packets from client\n", stderr);
+    fputs("  --server-dup <percent>           Duplication chance (%) for packets from server\n", stderr);
+
+    fputs("  --client-corrupt <percent>       Bit-flip chance (%) for packets from client\n", stderr);
+    fputs("  --server-corrupt <percent>       Bit-flip chance (%) for packets from server\n", stderr);
+
+    fputs("  --client-reorder <percent>       Chance (%) a client packet is overtaken by the next one\n", stderr);
+    fputs("  --server-reorder <percent>       Chance (%) a server packet is overtaken by the next one\n", stderr);
+
+    fputs("  --client-queue-limit <bytes>     Most bytes of client packets held back at once (default 64 MiB)\n", stderr);
+    fputs("  --server-queue-limit <bytes>     Most bytes of server packets held back at once (default 64 MiB)\n", stderr);
+
+    fputs("  --trace <file>                   Replay per-packet drop/delay events from a CSV or binary trace\n", stderr);
+    fputs("  --trace-loop                     Restart the trace when it runs out instead of using the chances\n", stderr);
+
+    fputs("  --pcap <file>                    Capture every datagram and its fate to a pcapng file\n", stderr);
+    fputs("  --hop-trace <file>               Record when each packet arrived and left for merge_traces.py\n", stderr);
+
+    fputs("  --uring                          Use the io_uring datapath when available\n", stderr);
+    fputs("  --tsc                            Time with the calibrated TSC instead of CLOCK_MONOTONIC\n", stderr);
+
+    fputs("  --rcvbuf <bytes>                 Receive buffer size for both sockets (default: kernel)\n", stderr);
+    fputs("  --sndbuf <bytes>                 Send buffer size for both sockets (default: kernel)\n", stderr);
+    fputs("  --dual-stack                     Take IPv4 and IPv6 clients on one socket (0.0.0.0 listens as ::)\n", stderr);
+    fputs("  --connect-upstream               connect() the upstream socket to the target\n", stderr);
+    fputs("  --gso                            Batch sends with UDP_SEGMENT and receive with UDP_GRO\n", stderr);
+    fputs("  --config <file>                  Read \"option = value\" settings; SIGHUP re-reads the impairments\n", stderr);
+    fputs("  --schedule <file>                Step or ramp the impairments through timed phases\n", stderr);
+
     fputs("  -l, --log                        Enables logging\n", stderr);
     fputs("  -h, --help                       Display this help message\n", stderr);
     exit(exit_code);
 }
 
-static int parse_int_param(const char *str, const char *name) {
-    char *endptr;
-    long value;
+/*
+ * Fills in the settings a config file names. At startup only those not
+ * already given on the command line; on reload only the impairments, into an
+ * otherwise empty options so absent ones keep their current values.
+ */
+static int read_config(const char *filename, config_t *config, proxy_options_t *options, int reload) {
 
-    if(!str) {
-        fprintf(stderr, "Missing value for %s\n", name);
-        exit(EXIT_FAILURE);
+    if(!config_load(config, filename)) {
+        return 0;
     }
 
-    errno = 0;
-    value = strtol(str, &endptr, 10);
+    for(size_t i = 0; i < config->count; i++) {
+        const config_entry_t *entry = &config->entries[i];
+        size_t option = 0;
+        char **field;
 
-    if(errno != 0) {
-        perror("strtol");
-        exit(EXIT_FAILURE);
+        while(option < sizeof(config_options) / sizeof(config_options[0]) && strcmp(config_options[option].key, entry->key) != 0) {
+            option++;
+        }
+
+        if(option == sizeof(config_options) / sizeof(config_options[0])) {
+            fprintf(stderr, "%s:%d: unknown setting %s\n", filename, entry->line, entry->key);
+            return 0;
+        }
+
+        if(reload && !config_options[option].reloadable) {
+            continue;
+        }
+
+        field = (char **)((char *)options + config_options[option].offset);
+        if(!*field) {
+            *field = (char *)entry->value;
+        }
     }
 
-    if(*endptr != '\0') {
-        fprintf(stderr, "Invalid non-numeric characters in %s: %s\n", name, str);
+    return 1;
+}
+
+// Returns 0, having said why, if str is not a whole number in range for name
+static int parse_param(const char *str, const char *name, int *value) {
+    char *endptr;
+    long parsed;
+    const char *kind = strchr(name, '-');
+
+    errno = 0;
+    parsed = strtol(str, &endptr, 10);
+
+    if(errno != 0 || endptr == str || *endptr != '\0') {
+        fprintf(stderr, "Invalid value for %s: %s\n", name, str);
+        return 0;
     }
 
-    if(strcmp(name, "client-drop") == 0 || strcmp(name, "server-drop") == 0 || strcmp(name, "client-delay") == 0 || strcmp(name, "server-delay") == 0) {
-        if(value > 100 || value < 0) {
+    if(kind && (strcmp(kind, "-drop") == 0 || strcmp(kind, "-delay") == 0 || strcmp(kind, "-dup") == 0 ||
+                strcmp(kind, "-corrupt") == 0 || strcmp(kind, "-reorder") == 0)) {
+        if(parsed > 100 || parsed < 0) {
             fprintf(stderr, "%s value must be between 0 and 100\n", name);
-            exit(EXIT_FAILURE);
+            return 0;
         }
     }
 
-    if(value < MIN_INT_PARSE || value > MAX_INT_PARSE) {
-        fprintf(stderr, "%s value is out of range", name);
-        exit(EXIT_FAILURE);
+    if(parsed < MIN_INT_PARSE || parsed > MAX_INT_PARSE) {
+        fprintf(stderr, "%s value is out of range\n", name);
+        return 0;
     }
 
-    return (int)value;
+    *value = (int)parsed;
 
+    return 1;
 }
 
-static int determine_noise(const int drop_chance, const int delay_chance) {
+/*
+ * Parses every impairment the options give over a copy of the current ones,
+ * and only replaces them once all are valid. Impairments that are not given
+ * stay as they were, which at startup is off.
+ */
+static int parse_impairments(const proxy_options_t *options, impairment_t *client, impairment_t *server) {
+    impairment_t new_client = *client;
+    impairment_t new_server = *server;
+    const struct {
+        const char *str;
+        const char *name;
+        int        *value;
+    } params[] = {
+        {options->client_drop_str, "client-drop", &new_client.drop_chance},
+        {options->server_drop_str, "server-drop", &new_server.drop_chance},
+        {options->client_delay_str, "client-delay", &new_client.delay_chance},
+        {options->server_delay_str, "server-delay", &new_server.delay_chance},
+        {options->client_delay_min_time_str, "client-delay-min", &new_client.delay_min},
+        {options->client_delay_max_time_str, "client-delay-max", &new_client.delay_max},
+        {options->server_delay_min_time_str, "server-delay-min", &new_server.delay_min},
+        {options->server_delay_max_time_str, "server-delay-max", &new_server.delay_max},
+        {options->client_dup_str, "client-dup", &new_client.dup_chance},
+        {options->server_dup_str, "server-dup", &new_server.dup_chance},
+        {options->client_corrupt_str, "client-corrupt", &new_client.corrupt_chance},
+        {options->server_corrupt_str, "server-corrupt", &new_server.corrupt_chance},
+        {options->client_reorder_str, "client-reorder", &new_client.reorder_chance},
+        {options->server_reorder_str, "server-reorder", &new_server.reorder_chance},
+    };
+
+    for(size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+        if(params[i].str && !parse_param(params[i].str, params[i].name, params[i].value)) {
+            return 0;
+        }
+    }
+
+    if(new_client.delay_min > new_client.delay_max || new_server.delay_min > new_server.delay_max) {
+        fprintf(stderr, "Delay min time cannot be greater than delay max time\n");
+        return 0;
+    }
+
+    *client = new_client;
+    *server = new_server;
+
+    return 1;
+}
+
+static void sighup_handler(int signum) {
+    (void) signum;
+    reload_flag = 1;
+}
+
+/*
+ * Runs between packets, so every packet sees either the old impairments or
+ * the new ones. Delayed and held packets keep the fate they were given. A
+ * file that does not parse changes nothing.
+ */
+static void reload_config(path_t *client_path, path_t *server_path) {
+    static config_t config;
+    proxy_options_t options;
+
+    reload_flag = 0;
+    memset(&options, 0, sizeof(options));
+
+    if(schedule) {
+        log_event(LOG_PROXY, "Reload of %s ignored, the schedule sets the impairments", config_file);
+        return;
+    }
+
+    if(!read_config(config_file, &config, &options, 1) ||
+       !parse_impairments(&options, &client_path->impairment, &server_path->impairment)) {
+        log_event(LOG_PROXY, "Reload of %s failed, impairments unchanged", config_file);
+        return;
+    }
+
+    log_event(LOG_PROXY, "Reloaded %s", config_file);
+    log_impairments(client_path, server_path);
+}
+
+// Logs each phase as it begins; a ramp's values move on between the log lines
+static void follow_schedule(path_t *client_path, path_t *server_path) {
+    const schedule_phase_t *phase;
+
+    if(!schedule_update(schedule, clock_now(), &client_path->impairment, &server_path->impairment)) {
+        return;
+    }
+
+    phase = &schedule->phases[schedule->current];
+    log_event(LOG_PROXY, "Phase %zu of %zu: %s%s, at %.3f s", schedule->current + 1, schedule->count, phase->name,
+              phase->ramp && schedule->current + 1 < schedule->count ? ", ramping" : "", (double) phase->start_ns / NS_PER_SEC);
+    log_impairments(client_path, server_path);
+}
+
+static void log_impairments(const path_t *client_path, const path_t *server_path) {
+
+    for(int i = 0; i < 2; i++) {
+        const impairment_t *impairment = i ? &server_path->impairment : &client_path->impairment;
+
+        log_event(LOG_PROXY, "%s: drop %d%%, delay %d%% for %d-%d ms, dup %d%%, corrupt %d%%, reorder %d%%",
+                  i ? "Server to Client" : "Client to Server", impairment->drop_chance, impairment->delay_chance, impairment->delay_min,
+                  impairment->delay_max, impairment->dup_chance, impairment->corrupt_chance, impairment->reorder_chance);
+    }
+}
+
+/*
+ * With a trace loaded the next event decides the packet's fate exactly;
+ * otherwise, or once a non-looping trace is used up, the chances do.
+ */
+static int determine_noise(path_t *path, int *delay_time, unsigned *corrupt_seed) {
+
+    int percent;
+    int noise;
 
-    int percent = rand() % 100 + 1;
+    if(path->replay) {
+        size_t index;
+        const replay_event_t *event = replay_next(path->replay, path->direction, &index);
+
+        if(event) {
+            *delay_time = event->delay_ms;
+            *corrupt_seed = (unsigned)index * 2654435761u;
+            return event->action;
+        }
+    }
+
+    *corrupt_seed = (unsigned)rand();
+    percent = rand() % 100 + 1;
 
     // Drop
-    if(percent <= drop_chance) {
-        return 1;
+    if(percent <= path->impairment.drop_chance) {
+        return NOISE_DROP;
     }
 
     percent = rand() % 100 + 1;
 
     // Delay
-    if (percent <= delay_chance) {
-        return 2;
+    if (percent <= path->impairment.delay_chance) {
+        noise = NOISE_DELAY;
+        *delay_time = determine_delay(path->impairment.delay_min, path->impairment.delay_max);
+    } else if (path->impairment.reorder_chance && rand() % 100 + 1 <= path->impairment.reorder_chance) {
+        noise = NOISE_REORDER;
+    } else {
+        // Send normally
+        noise = NOISE_NONE;
     }
 
-    // Send normally
-    return 0;
+    if(path->impairment.dup_chance && rand() % 100 + 1 <= path->impairment.dup_chance) {
+        noise |= NOISE_DUPLICATE;
+    }
+
+    if(path->impairment.corrupt_chance && rand() % 100 + 1 <= path->impairment.corrupt_chance) {
+        noise |= NOISE_CORRUPT;
+    }
+
+    return noise;
 }
 
 static int determine_delay(const int min_time, const int max_time) {
@@ -449,62 +973,694 @@ static void add_to_delay_queue(delayed_packet_t **queue, delayed_packet_t *new_n
     }
 }
 
-static void delay_packet(packet_t *packet, int delay_min, int delay_max, delayed_packet_t **delay_queue, int queue_direction) {
+/*
+ * Copies the len bytes received into a node charged to the path's queue,
+ * allocated no further than that, though always with a whole header since
+ * the logging reads it. Returns NULL if the queue has no room left for it.
+ */
+static delayed_packet_t *alloc_delayed(path_t *path, const packet_t *packet, size_t len) {
 
-    char direction[LINE_LEN];
+    size_t size = offsetof(delayed_packet_t, packet) + (len < PACKET_HEADER_LEN ? PACKET_HEADER_LEN : len);
+    delayed_packet_t *node;
 
-    if(queue_direction){
-        strcpy(direction, "Server to Client");
-    } else {
-        strcpy(direction, "Client to Server");
+    if(path->queued_bytes + size > path->queue_limit) {
+        return NULL;
     }
 
-    log_event(LOG_PROXY, "Delayed %s packet %d\n", direction, packet->sequence);
+    node = malloc(size);
+    if(!node) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
 
-    struct timeval now;
-    struct timeval send_time;
-    gettimeofday(&now, NULL);
+    memcpy(&node->packet, packet, len < PACKET_HEADER_LEN ? PACKET_HEADER_LEN : len);
+    node->size = size;
+    node->len = len;
+    node->next = NULL;
 
-    int delay_time = determine_delay(delay_min, delay_max);
+    path->queued_bytes += size;
+    if(path->queued_bytes > path->peak_queued_bytes) {
+        path->peak_queued_bytes = path->queued_bytes;
+    }
 
-    send_time.tv_sec = now.tv_sec + (delay_time/1000);
-    send_time.tv_usec = now.tv_usec + (delay_time % 1000) * 1000;
+    return node;
+}
 
-    delayed_packet_t *delayed_packet = malloc(sizeof(delayed_packet_t));
-    if (!delayed_packet) {
-        perror("malloc failed");
+static void free_delayed(path_t *path, delayed_packet_t *node) {
+
+    path->queued_bytes -= node->size;
+    free(node);
+}
+
+static delayed_packet_t *delay_packet(path_t *path, packet_t *packet, size_t len, int delay_time) {
+
+    delayed_packet_t *delayed_packet = alloc_delayed(path, packet, len);
+
+    if(!delayed_packet) {
+        return NULL;
+    }
+
+    log_event(LOG_PROXY, "Delayed %s packet %d\n", path->direction ? "Server to Client" : "Client to Server", packet->sequence);
+
+    delayed_packet->send_ns = clock_now() + delay_time * NS_PER_MS;
+    delayed_packet->noise = NOISE_DELAY;
+
+    add_to_delay_queue(&path->queue, delayed_packet);
+
+    return delayed_packet;
+}
+
+static void process_delay_queue(segment_batch_t *out, path_t *path, struct sockaddr *dest_addr, socklen_t addr_len) {
+    int64_t now = clock_now();
+
+    while (path->queue) {
+        delayed_packet_t *delayed_packet = path->queue;
+
+        if (now >= delayed_packet->send_ns) {
+            path->queue = delayed_packet->next;
+            send_delayed_node(out, path, delayed_packet, dest_addr, addr_len);
+        } else {
+            break;
+        }
+    }
+}
+
+/*
+ * Logs the arrival and makes every impairment decision for one packet in a
+ * single pass. Corruption is applied in place; delayed and reordered packets
+ * are copied once into a delayed_packet_t, returned through delayed.
+ * Returns the noise bits; a fate of NOISE_NONE means forward it now.
+ */
+static int classify_packet(path_t *path, packet_t *packet, size_t len, delayed_packet_t **delayed) {
+
+    delayed_packet_t *node = NULL;
+    const char *direction = path->direction ? "Server to Client" : "Client to Server";
+    unsigned corrupt_seed;
+    int delay_time = 0;
+    int noise;
+
+    log_packet(LOG_PROXY, path->direction ? "Received from Server" : "Received from Client", packet->sequence, packet->payload, 0);
+    if(hop_trace) {
+        hop_trace_record(hop_trace, HOP_RECEIVED, path->direction, packet, clock_now());
+    }
+    noise = determine_noise(path, &delay_time, &corrupt_seed);
+
+    if ((noise & NOISE_FATE_MASK) == NOISE_DROP) {
+        path->emulated_drops++;
+        log_packet(LOG_PROXY, path->direction ? "Dropped Server to Client" : "Dropped Client to Server", packet->sequence, packet->payload, 1);
+        if(hop_trace) {
+            hop_trace_record(hop_trace, HOP_DROPPED, path->direction, packet, clock_now());
+        }
+        if(path->pcap) {
+            capture_packet(path, packet, len, noise, delay_time);
+        }
+        return noise;
+    }
+
+    if (noise & NOISE_CORRUPT) {
+        log_event(LOG_PROXY, "Corrupted %s packet %d", direction, packet->sequence);
+        corrupt_packet(packet, len, corrupt_seed);
+    }
+
+    if ((noise & NOISE_FATE_MASK) == NOISE_DELAY) {
+        node = delay_packet(path, packet, len, delay_time);
+    } else if ((noise & NOISE_FATE_MASK) == NOISE_REORDER) {
+        node = hold_packet(path, packet, len);
+        if (node) {
+            log_event(LOG_PROXY, "Reordered %s packet %d", direction, packet->sequence);
+        }
+    }
+
+    // Holding it back would take the queue past its limit, so it is lost instead
+    if (!node && (noise & NOISE_FATE_MASK) != NOISE_NONE) {
+        noise = (noise & ~NOISE_FATE_MASK) | NOISE_DROP;
+        path->overflow_drops++;
+        log_event(LOG_PROXY, "Queue full, dropped %s packet %d", direction, packet->sequence);
+        if(hop_trace) {
+            hop_trace_record(hop_trace, HOP_DROPPED, path->direction, packet, clock_now());
+        }
+    }
+
+    if (node) {
+        node->noise = noise;
+        if(delayed) {
+            *delayed = node;
+        }
+    }
+
+    if(path->pcap) {
+        capture_packet(path, packet, len, noise, delay_time);
+    }
+
+    return noise;
+}
+
+// Records the datagram as it will leave the proxy, tagged with its fate
+static void capture_packet(path_t *path, packet_t *packet, size_t len, int noise, int delay_time) {
+
+    char comment[PCAP_COMMENT_LEN + 1];
+    char fate[sizeof("delayed -2147483648 ms")];
+
+    switch(noise & NOISE_FATE_MASK) {
+        case NOISE_DROP:    snprintf(fate, sizeof(fate), "dropped"); break;
+        case NOISE_DELAY:   snprintf(fate, sizeof(fate), "delayed %d ms", delay_time); break;
+        case NOISE_REORDER: snprintf(fate, sizeof(fate), "reordered"); break;
+        default:            snprintf(fate, sizeof(fate), "forwarded"); break;
+    }
+
+    snprintf(comment, sizeof(comment), "%s %s%s%s", path->direction ? "server->client" : "client->server", fate,
+             (noise & NOISE_DUPLICATE) ? " duplicated" : "", (noise & NOISE_CORRUPT) ? " corrupted" : "");
+
+    pcap_record(path->pcap, path->src_addr, path->dst_addr, packet, len, comment);
+}
+
+// Flips one bit, chosen by seed, anywhere in the received datagram
+static void corrupt_packet(packet_t *packet, size_t len, unsigned seed) {
+
+    size_t bit = (size_t)seed % (len * 8);
+
+    ((unsigned char *)packet)[bit / 8] ^= (unsigned char)(1u << (bit % 8));
+}
+
+/*
+ * Parks a packet so the next packet in the same direction overtakes it. If
+ * nothing arrives within PROXY_REORDER_HOLD_MS it is released anyway.
+ */
+static delayed_packet_t *hold_packet(path_t *path, packet_t *packet, size_t len) {
+
+    delayed_packet_t *held = alloc_delayed(path, packet, len);
+
+    if (!held) {
+        return NULL;
+    }
+
+    held->send_ns = clock_now() + PROXY_REORDER_HOLD_MS * NS_PER_MS;
+    path->held = held;
+
+    return held;
+}
+
+static delayed_packet_t *take_held_packet(path_t *path) {
+
+    delayed_packet_t *held = path->held;
+
+    path->held = NULL;
+
+    return held;
+}
+
+static int held_packet_due(const path_t *path) {
+
+    return path->held && clock_now() >= path->held->send_ns;
+}
+
+static void forward_now(segment_batch_t *out, path_t *path, packet_t *packet, size_t len, int noise, struct sockaddr *dest_addr, socklen_t addr_len) {
+
+    segment_batch_add(out, packet, len, dest_addr, addr_len);
+    log_packet(LOG_PROXY, path->direction ? "Sent to Client" : "Sent to Server", packet->sequence, packet->payload, 1);
+    if(hop_trace) {
+        hop_trace_record(hop_trace, HOP_FORWARDED, path->direction, packet, clock_now());
+    }
+
+    if(noise & NOISE_DUPLICATE) {
+        segment_batch_add(out, packet, len, dest_addr, addr_len);
+        log_packet(LOG_PROXY, path->direction ? "Sent duplicate to Client" : "Sent duplicate to Server", packet->sequence, packet->payload, 1);
+    }
+}
+
+// Sends a delayed or reordered packet (twice if it was also duplicated) and frees it
+static void send_delayed_node(segment_batch_t *out, path_t *path, delayed_packet_t *node, struct sockaddr *dest_addr, socklen_t addr_len) {
+
+    const char *kind = (node->noise & NOISE_FATE_MASK) == NOISE_REORDER ? "reordered" : "delayed";
+    const char *direction = path->direction ? "to Client" : "to Server";
+
+    segment_batch_add(out, &node->packet, node->len, dest_addr, addr_len);
+    log_event(LOG_PROXY, "Sent %s packet %d %s\n", kind, node->packet.sequence, direction);
+    if(hop_trace) {
+        hop_trace_record(hop_trace, HOP_FORWARDED, path->direction, &node->packet, clock_now());
+    }
+
+    if(node->noise & NOISE_DUPLICATE) {
+        segment_batch_add(out, &node->packet, node->len, dest_addr, addr_len);
+        log_event(LOG_PROXY, "Sent duplicate %s packet %d %s\n", kind, node->packet.sequence, direction);
+    }
+
+    free_delayed(path, node);
+}
+
+/*
+ * Runs one received datagram through the impairment model and queues whatever
+ * leaves now. It is handled where it was received, corrupted in place too;
+ * only a GRO segment left misaligned by an odd segment size is copied first.
+ */
+static void relay_packet(path_t *path, void *data, size_t len, segment_batch_t *out, struct sockaddr *dest_addr, socklen_t addr_len) {
+
+    packet_t aligned;
+    packet_t *packet = data;
+    delayed_packet_t *overtaken;
+    int noise;
+
+    if(len > sizeof(packet_t)) {
+        len = sizeof(packet_t);
+    }
+    if((uintptr_t)data % _Alignof(packet_t)) {
+        memcpy(&aligned, data, len);
+        packet = &aligned;
+    }
+
+    overtaken = take_held_packet(path);
+    noise = classify_packet(path, packet, len, NULL);
+
+    if((noise & NOISE_FATE_MASK) == NOISE_NONE) {
+        forward_now(out, path, packet, len, noise, dest_addr, addr_len);
+    }
+
+    if(overtaken) {
+        send_delayed_node(out, path, overtaken, dest_addr, addr_len);
+    }
+}
+
+static void remove_from_delay_queue(delayed_packet_t **queue, delayed_packet_t *node) {
+
+    while(*queue) {
+        if(*queue == node) {
+            *queue = node->next;
+            node->next = NULL;
+            return;
+        }
+        queue = &(*queue)->next;
+    }
+}
+
+static void configure_buffers(int client_sock_fd, int server_sock_fd, const proxy_options_t *options) {
+    int rcvbuf = 0;
+    int sndbuf = 0;
+    int fds[2] = {client_sock_fd, server_sock_fd};
+
+    if(options->rcvbuf_str) {
+        rcvbuf = (int) parse_unsigned(options->rcvbuf_str, "rcvbuf", MAX_SOCKET_BUFFER);
+    }
+    if(options->sndbuf_str) {
+        sndbuf = (int) parse_unsigned(options->sndbuf_str, "sndbuf", MAX_SOCKET_BUFFER);
+    }
+
+    for(int i = 0; i < 2; i++) {
+        int actual_rcvbuf;
+        int actual_sndbuf;
+
+        set_socket_buffers(fds[i], rcvbuf, sndbuf);
+        enable_drop_counter(fds[i]);
+        socket_buffer_sizes(fds[i], &actual_rcvbuf, &actual_sndbuf);
+        log_event(LOG_PROXY, "%s socket buffers: receive %d bytes, send %d bytes", i ? "Server" : "Client", actual_rcvbuf, actual_sndbuf);
+    }
+}
+
+static void report_drops(const path_t *path) {
+    const char *direction = path->direction ? "Server to Client" : "Client to Server";
+
+    log_event(LOG_PROXY, "%s: %" PRIu64 " dropped by impairment, %" PRIu32 " dropped by the kernel",
+              direction, path->emulated_drops, path->kernel_drops);
+    log_event(LOG_PROXY, "%s: %" PRIu64 " dropped with the queue full, at most %zu of %zu bytes queued",
+              direction, path->overflow_drops, path->peak_queued_bytes, path->queue_limit);
+}
+
+static void report_memory(void) {
+    struct rusage usage;
+
+    if(getrusage(RUSAGE_SELF, &usage) == -1) {
+        perror("getrusage failed");
+        return;
+    }
+
+    // ru_maxrss is in KiB on Linux
+    log_event(LOG_PROXY, "Peak resident set size: %ld KiB", usage.ru_maxrss);
+}
+
+/*
+ * io_uring datapath. Both sockets are served by multishot recvmsg drawing from
+ * one provided buffer ring, forwards are SENDMSGs linked per direction so they
+ * leave in arrival order, and each delayed or reordered packet's deadline
+ * becomes an absolute timeout SQE. A packet that is forwarded immediately is sent straight out of its
+ * receive buffer, which is recycled when the send completes.
+ *
+ * target_ip_len is 0 when the upstream socket is connected, so its sends carry
+ * no address.
+ *
+ * Returns -1 with errno set if io_uring is unavailable, 0 on shutdown.
+ */
+static int run_uring_loop(int client_sock_fd, int server_sock_fd, path_t *client_path, path_t *server_path, struct sockaddr_storage *target_ip, socklen_t target_ip_len) {
+
+    uring_proxy_t proxy;
+    struct io_uring_cqe *cqe;
+    unsigned buf_size;
+    int ret;
+
+    memset(&proxy, 0, sizeof(proxy));
+    buf_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + PROXY_URING_CONTROL_LEN + sizeof(packet_t);
+
+    if(uring_init(&proxy.ring, PROXY_URING_ENTRIES) == -1) {
+        return -1;
+    }
+
+    if(uring_setup_buf_ring(&proxy.ring, PROXY_URING_BUFFERS, buf_size, 0) == -1) {
+        int saved_errno = errno;
+        uring_close(&proxy.ring);
+        errno = saved_errno;
+        return -1;
+    }
+
+    proxy.recv_fds[0] = client_sock_fd;
+    proxy.recv_fds[1] = server_sock_fd;
+    proxy.send_fds[0] = server_sock_fd;
+    proxy.send_fds[1] = client_sock_fd;
+    proxy.paths[0] = client_path;
+    proxy.paths[1] = server_path;
+    proxy.target_ip = target_ip;
+    proxy.target_ip_len = target_ip_len;
+    client_path->src_addr = &proxy.client_addr;
+    server_path->dst_addr = &proxy.client_addr;
+
+    uring_arm_recv(&proxy, 0);
+    uring_arm_recv(&proxy, 1);
+
+    printf("Forwarding with io_uring\n");
+
+    while(!exit_flag) {
+
+        ret = uring_submit_and_wait(&proxy.ring, 1);
+        clock_refresh();
+        proxy.last_send[0] = NULL;
+        proxy.last_send[1] = NULL;
+
+        if(reload_flag) {
+            reload_config(client_path, server_path);
+        }
+
+        if(schedule) {
+            follow_schedule(client_path, server_path);
+        }
+
+        if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            errno = -ret;
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        while((cqe = uring_peek_cqe(&proxy.ring)) != NULL) {
+            uring_handle_cqe(&proxy, cqe);
+            uring_cqe_seen(&proxy.ring);
+        }
+    }
+
+    uring_close(&proxy.ring);
+
+    while(proxy.free_ops) {
+        uring_op_t *op = proxy.free_ops;
+        proxy.free_ops = op->next_free;
+        free(op);
+    }
+
+    return 0;
+}
+
+// Submits pending SQEs first if the submission queue is full
+static struct io_uring_sqe *uring_next_sqe(uring_proxy_t *proxy) {
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&proxy->ring);
+
+    if(!sqe) {
+        uring_submit_and_wait(&proxy->ring, 0);
+        proxy->last_send[0] = NULL;
+        proxy->last_send[1] = NULL;
+        sqe = uring_get_sqe(&proxy->ring);
+    }
+
+    if(!sqe) {
+        fprintf(stderr, "io_uring submission queue stuck full\n");
         exit(EXIT_FAILURE);
     }
 
-        delayed_packet->packet = *packet;
-        delayed_packet->send_time = send_time;
-        delayed_packet->next = NULL;
+    return sqe;
+}
+
+static uring_op_t *uring_op_alloc(uring_proxy_t *proxy, int type, path_t *path) {
 
-    add_to_delay_queue(delay_queue, delayed_packet);
+    uring_op_t *op = proxy->free_ops;
 
+    if(op) {
+        proxy->free_ops = op->next_free;
+    } else {
+        op = malloc(sizeof(uring_op_t));
+        if(!op) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->path = path;
+    op->bid = -1;
+
+    return op;
+}
+
+static void uring_op_free(uring_proxy_t *proxy, uring_op_t *op) {
+    op->next_free = proxy->free_ops;
+    proxy->free_ops = op;
+}
+
+static void uring_arm_recv(uring_proxy_t *proxy, int direction) {
+
+    uring_op_t *op = &proxy->recv_ops[direction];
+    struct io_uring_sqe *sqe = uring_next_sqe(proxy);
+
+    memset(op, 0, sizeof(*op));
+    op->type = URING_OP_RECV;
+    op->path = proxy->paths[direction];
+    op->bid = -1;
+    op->msg.msg_namelen = sizeof(struct sockaddr_storage);
+    op->msg.msg_controllen = PROXY_URING_CONTROL_LEN;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = proxy->recv_fds[direction];
+    sqe->addr = (unsigned long) &op->msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = proxy->ring.buf_group;
+    sqe->user_data = (unsigned long) op;
 }
 
-static void process_delay_queue(int sock_fd, delayed_packet_t **queue, struct sockaddr *dest_addr, socklen_t addr_len, int queue_direction) {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    char direction[LINE_LEN];
+static void uring_queue_send(uring_proxy_t *proxy, uring_op_t *op, void *data, size_t len) {
 
-    if(queue_direction){
-        strcpy(direction, "to Client");
+    int direction = op->path->direction;
+    struct io_uring_sqe *sqe;
+
+    if(direction) {
+        memcpy(&op->addr, &proxy->client_addr, proxy->client_addr_len);
+        op->msg.msg_namelen = proxy->client_addr_len;
     } else {
-        strcpy(direction, "to Server");
+        memcpy(&op->addr, proxy->target_ip, proxy->target_ip_len);
+        op->msg.msg_namelen = proxy->target_ip_len;
+    }
+
+    op->iov.iov_base = data;
+    op->iov.iov_len = len;
+    op->msg.msg_name = op->msg.msg_namelen ? &op->addr : NULL;    // no name on a connected upstream
+    op->msg.msg_iov = &op->iov;
+    op->msg.msg_iovlen = 1;
+
+    sqe = uring_next_sqe(proxy);
+
+    // Chain onto the previous send in this direction so the kernel keeps their order
+    if(proxy->last_send[direction]) {
+        proxy->last_send[direction]->flags |= IOSQE_IO_LINK;
     }
 
-    while (*queue) {
-        delayed_packet_t *delayed_packet = *queue;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = proxy->send_fds[direction];
+    sqe->addr = (unsigned long) &op->msg;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long) op;
+    proxy->last_send[direction] = sqe;
+}
+
+// Sends a delayed or reordered packet, duplicated if asked; the last send owns the node
+static void uring_queue_delayed(uring_proxy_t *proxy, path_t *path, delayed_packet_t *node) {
+
+    uring_op_t *op;
+
+    if(node->noise & NOISE_DUPLICATE) {
+        op = uring_op_alloc(proxy, URING_OP_SEND, path);
+        op->duplicate = 1;
+        uring_queue_send(proxy, op, &node->packet, node->len);
+    }
+
+    op = uring_op_alloc(proxy, URING_OP_SEND, path);
+    op->delayed = node;
+    uring_queue_send(proxy, op, &node->packet, node->len);
+
+    if(hop_trace) {
+        hop_trace_record(hop_trace, HOP_FORWARDED, path->direction, &node->packet, clock_now());
+    }
+}
+
+/*
+ * URING_OP_TIMEOUT owns a delay queue node and sends it when it fires.
+ * URING_OP_HOLD only re-checks the path's held packet, since that packet may
+ * already have been released by the next arrival.
+ */
+static void uring_arm_timeout(uring_proxy_t *proxy, path_t *path, int type, delayed_packet_t *node) {
+
+    uring_op_t *op = uring_op_alloc(proxy, type, path);
+    struct io_uring_sqe *sqe = uring_next_sqe(proxy);
+
+    op->delayed = type == URING_OP_TIMEOUT ? node : NULL;
+    op->ts.tv_sec = node->send_ns / NS_PER_SEC;
+    op->ts.tv_nsec = node->send_ns % NS_PER_SEC;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) &op->ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = (unsigned long) op;
+}
+
+static void uring_handle_cqe(uring_proxy_t *proxy, struct io_uring_cqe *cqe) {
 
-        if (timercmp(&now, &delayed_packet->send_time, >=)) {
-            send_packet(sock_fd, &delayed_packet->packet, dest_addr, addr_len);
-            log_event(LOG_PROXY, "Sent delayed packet %d %s\n", delayed_packet->packet.sequence, direction);
-            *queue = delayed_packet->next;
-            free(delayed_packet);
+    uring_op_t *op = (uring_op_t *)(unsigned long) cqe->user_data;
+    path_t *path = op->path;
+
+    if(op->type == URING_OP_RECV) {
+        struct io_uring_recvmsg_out *out;
+        delayed_packet_t *delayed;
+        delayed_packet_t *overtaken;
+        unsigned short bid;
+        char *buf;
+        packet_t *packet;
+        int noise;
+
+        if(!(cqe->flags & IORING_CQE_F_MORE)) {
+            uring_arm_recv(proxy, path->direction);
+        }
+
+        if(cqe->res < 0) {
+            if(cqe->res == -ENOBUFS) {
+                log_event(LOG_PROXY, "Receive buffers exhausted, kernel dropped datagram");
+            } else if(cqe->res != -EINTR && cqe->res != -ECANCELED) {
+                errno = -cqe->res;
+                perror(path->direction ? "recvmsg server" : "recvmsg client");
+                exit(EXIT_FAILURE);
+            }
+            return;
+        }
+
+        if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+            return;
+        }
+
+        bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        buf = uring_buf(&proxy->ring, bid);
+        out = (struct io_uring_recvmsg_out *) buf;
+        packet = (packet_t *)(buf + sizeof(*out) + op->msg.msg_namelen + op->msg.msg_controllen);
+
+        if(out->controllen) {
+            struct msghdr control;
+
+            memset(&control, 0, sizeof(control));
+            control.msg_control = buf + sizeof(*out) + op->msg.msg_namelen;
+            control.msg_controllen = out->controllen;
+            read_drop_counter(&control, &path->kernel_drops);
+        }
+
+        if((out->flags & MSG_TRUNC) || out->payloadlen == 0) {
+            uring_buf_recycle(&proxy->ring, bid);
+            return;
+        }
+
+        if(path->direction == 0) {
+            socklen_t name_len = out->namelen < op->msg.msg_namelen ? out->namelen : op->msg.msg_namelen;
+
+            memcpy(&proxy->client_addr, buf + sizeof(*out), name_len);
+            proxy->client_addr_len = name_len;
+        }
+
+        delayed = NULL;
+        overtaken = take_held_packet(path);
+        noise = classify_packet(path, packet, out->payloadlen, &delayed);
+
+        if((noise & NOISE_FATE_MASK) == NOISE_NONE) {
+            uring_op_t *send_op;
+
+            // The duplicate goes first and the linked original after it owns the buffer
+            if(noise & NOISE_DUPLICATE) {
+                send_op = uring_op_alloc(proxy, URING_OP_SEND, path);
+                send_op->duplicate = 1;
+                uring_queue_send(proxy, send_op, packet, out->payloadlen);
+            }
+
+            send_op = uring_op_alloc(proxy, URING_OP_SEND, path);
+            send_op->bid = bid;
+            uring_queue_send(proxy, send_op, packet, out->payloadlen);
+
+            // Recorded as queued, since the completion may only be reaped after the peer has it
+            if(hop_trace) {
+                hop_trace_record(hop_trace, HOP_FORWARDED, path->direction, packet, clock_now());
+            }
         } else {
-            break;
+            if((noise & NOISE_FATE_MASK) == NOISE_DELAY) {
+                uring_arm_timeout(proxy, path, URING_OP_TIMEOUT, delayed);
+            } else if((noise & NOISE_FATE_MASK) == NOISE_REORDER) {
+                uring_arm_timeout(proxy, path, URING_OP_HOLD, delayed);
+            }
+            uring_buf_recycle(&proxy->ring, bid);
+        }
+
+        if(overtaken) {
+            uring_queue_delayed(proxy, path, overtaken);
+        }
+
+    } else if(op->type == URING_OP_SEND) {
+
+        if(cqe->res < 0) {
+            errno = -cqe->res;
+            perror(path->direction ? "Error sending packet to client" : "Error sending packet to server");
+            exit(EXIT_FAILURE);
         }
+
+        if(op->delayed) {
+            const char *kind = (op->delayed->noise & NOISE_FATE_MASK) == NOISE_REORDER ? "reordered" : "delayed";
+
+            log_event(LOG_PROXY, "Sent %s packet %d %s\n", kind, op->delayed->packet.sequence, path->direction ? "to Client" : "to Server");
+            free_delayed(path, op->delayed);
+        } else if(op->duplicate) {
+            packet_t *packet = op->iov.iov_base;
+
+            log_packet(LOG_PROXY, path->direction ? "Sent duplicate to Client" : "Sent duplicate to Server", packet->sequence, packet->payload, 1);
+        } else {
+            packet_t *packet = op->iov.iov_base;
+
+            log_packet(LOG_PROXY, path->direction ? "Sent to Client" : "Sent to Server", packet->sequence, packet->payload, 1);
+        }
+
+        if(op->bid >= 0) {
+            uring_buf_recycle(&proxy->ring, (unsigned short) op->bid);
+        }
+
+        uring_op_free(proxy, op);
+
+    } else if(op->type == URING_OP_TIMEOUT) {
+        delayed_packet_t *node = op->delayed;
+
+        remove_from_delay_queue(&path->queue, node);
+        uring_op_free(proxy, op);
+        uring_queue_delayed(proxy, path, node);
+
+    } else if(op->type == URING_OP_HOLD) {
+
+        if(held_packet_due(path)) {
+            uring_queue_delayed(proxy, path, take_held_packet(path));
+        }
+        uring_op_free(proxy, op);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,292 @@
+#include "common.h"
+#include "log.h"
+#include "replay.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Recorded impairment traces for the proxy. Each direction has its own event
+ * stream, consumed one event per received packet. A binary trace is used in
+ * place from the mapping; a CSV trace is parsed once at load:
+ *
+ *     # direction,action[,delay_ms]
+ *     client,pass
+ *     client,delay,35
+ *     server,drop
+ *     client,delay+dup,10
+ *
+ * direction is client/c or server/s; action is pass, drop, delay or reorder,
+ * optionally combined with +dup and +corrupt.
+ */
+
+static void parse_csv(replay_trace_t *trace, const char *filename);
+static void check_events(const replay_trace_t *trace, const char *filename);
+static int parse_csv_line(const char *line, size_t len, int *direction, replay_event_t *event);
+static int parse_action(const char *token, size_t len, uint8_t *action);
+static void append_event(replay_trace_t *trace, int direction, const replay_event_t *event, size_t *capacity);
+
+void replay_load(replay_trace_t *trace, const char *filename, int loop) {
+    struct stat st;
+    int fd;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->loop = loop;
+
+    fd = open(filename, O_RDONLY);
+    if(fd == -1) {
+        perror("Failed to open trace file");
+        exit(EXIT_FAILURE);
+    }
+
+    if(fstat(fd, &st) == -1) {
+        perror("Failed to stat trace file");
+        exit(EXIT_FAILURE);
+    }
+
+    if(st.st_size == 0) {
+        fprintf(stderr, "Trace file %s is empty\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    trace->map_len = (size_t) st.st_size;
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(trace->map == MAP_FAILED) {
+        perror("Failed to map trace file");
+        exit(EXIT_FAILURE);
+    }
+
+    if(trace->map_len >= 16 && memcmp(trace->map, REPLAY_MAGIC, 8) == 0) {
+        uint32_t counts[2];
+        const replay_event_t *events = (const replay_event_t *)((const char *)trace->map + 16);
+
+        memcpy(counts, (const char *)trace->map + 8, sizeof(counts));
+
+        if(16 + ((size_t)counts[0] + counts[1]) * sizeof(replay_event_t) > trace->map_len) {
+            fprintf(stderr, "Trace file %s is truncated\n", filename);
+            exit(EXIT_FAILURE);
+        }
+
+        trace->events[0] = events;
+        trace->events[1] = events + counts[0];
+        trace->counts[0] = counts[0];
+        trace->counts[1] = counts[1];
+        check_events(trace, filename);
+    } else {
+        madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+        parse_csv(trace, filename);
+        munmap(trace->map, trace->map_len);
+        trace->map = NULL;
+    }
+
+    log_event(LOG_PROXY, "Loaded trace %s: %zu client events, %zu server events%s", filename, trace->counts[0], trace->counts[1], loop ? ", looping" : "");
+}
+
+// Returns the next event for the direction, or NULL once a non-looping trace is used up
+const replay_event_t *replay_next(replay_trace_t *trace, int direction, size_t *index) {
+
+    if(trace->counts[direction] == 0) {
+        return NULL;
+    }
+
+    if(trace->positions[direction] == trace->counts[direction]) {
+        if(!trace->loop) {
+            return NULL;
+        }
+        trace->positions[direction] = 0;
+        log_event(LOG_PROXY, "Trace for %s wrapped", direction ? "Server to Client" : "Client to Server");
+    }
+
+    *index = trace->positions[direction]++;
+
+    return &trace->events[direction][*index];
+}
+
+void replay_close(replay_trace_t *trace) {
+
+    if(trace->map) {
+        munmap(trace->map, trace->map_len);
+    }
+
+    free(trace->parsed[0]);
+    free(trace->parsed[1]);
+    memset(trace, 0, sizeof(*trace));
+}
+
+static void parse_csv(replay_trace_t *trace, const char *filename) {
+    const char *data = trace->map;
+    const char *end = data + trace->map_len;
+    size_t capacity[2] = {0, 0};
+    int line_number = 0;
+
+    while(data < end) {
+        const char *newline = memchr(data, '\n', (size_t)(end - data));
+        size_t len = newline ? (size_t)(newline - data) : (size_t)(end - data);
+        replay_event_t event;
+        int direction;
+        int parsed;
+
+        line_number++;
+        parsed = parse_csv_line(data, len, &direction, &event);
+
+        if(parsed == -1) {
+            fprintf(stderr, "%s:%d: invalid trace line\n", filename, line_number);
+            exit(EXIT_FAILURE);
+        }
+
+        if(parsed) {
+            append_event(trace, direction, &event, &capacity[direction]);
+        }
+
+        data += len + 1;
+    }
+
+    trace->events[0] = trace->parsed[0];
+    trace->events[1] = trace->parsed[1];
+}
+
+/*
+ * A binary trace is used as mapped, so every action is checked up front for
+ * what the CSV parser would have accepted; anything else would match no fate
+ * in the proxy and vanish uncounted.
+ */
+static void check_events(const replay_trace_t *trace, const char *filename) {
+
+    for(int direction = 0; direction < 2; direction++) {
+        for(size_t i = 0; i < trace->counts[direction]; i++) {
+            uint8_t action = trace->events[direction][i].action;
+
+            if((action & ~(REPLAY_FATE_MASK | REPLAY_DUPLICATE | REPLAY_CORRUPT)) || (action & REPLAY_FATE_MASK) > REPLAY_REORDER) {
+                fprintf(stderr, "%s: %s event %zu has invalid action 0x%02x\n", filename, direction ? "server" : "client", i, action);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+// Returns 1 for an event, 0 for a blank or comment line, -1 on error
+static int parse_csv_line(const char *line, size_t len, int *direction, replay_event_t *event) {
+    const char *fields[3];
+    size_t lengths[3];
+    size_t field_count = 0;
+    size_t start = 0;
+
+    while(len > 0 && isspace((unsigned char)line[len - 1])) {
+        len--;
+    }
+
+    while(start < len && isspace((unsigned char)line[start])) {
+        start++;
+    }
+
+    if(start == len || line[start] == '#') {
+        return 0;
+    }
+
+    for(size_t i = start; i <= len && field_count < 3; i++) {
+        if(i == len || line[i] == ',') {
+            fields[field_count] = line + start;
+            lengths[field_count] = i - start;
+            field_count++;
+            start = i + 1;
+        }
+    }
+
+    if(field_count < 2) {
+        return -1;
+    }
+
+    if((lengths[0] == 1 && fields[0][0] == 'c') || (lengths[0] == 6 && strncmp(fields[0], "client", 6) == 0)) {
+        *direction = 0;
+    } else if((lengths[0] == 1 && fields[0][0] == 's') || (lengths[0] == 6 && strncmp(fields[0], "server", 6) == 0)) {
+        *direction = 1;
+    } else {
+        return -1;
+    }
+
+    memset(event, 0, sizeof(*event));
+
+    if(parse_action(fields[1], lengths[1], &event->action) == -1) {
+        return -1;
+    }
+
+    if((event->action & REPLAY_FATE_MASK) == REPLAY_DELAY) {
+        char number[8];
+        char *endptr;
+        unsigned long delay_ms;
+
+        if(field_count < 3 || lengths[2] == 0 || lengths[2] >= sizeof(number)) {
+            return -1;
+        }
+
+        memcpy(number, fields[2], lengths[2]);
+        number[lengths[2]] = '\0';
+        delay_ms = strtoul(number, &endptr, BASE_TEN);
+
+        if(*endptr != '\0' || delay_ms > UINT16_MAX) {
+            return -1;
+        }
+
+        event->delay_ms = (uint16_t) delay_ms;
+    }
+
+    return 1;
+}
+
+static int parse_action(const char *token, size_t len, uint8_t *action) {
+    size_t start = 0;
+    int fate_set = 0;
+
+    *action = REPLAY_PASS;
+
+    for(size_t i = 0; i <= len; i++) {
+        if(i == len || token[i] == '+') {
+            const char *word = token + start;
+            size_t word_len = i - start;
+
+            if(word_len == 4 && strncmp(word, "pass", 4) == 0) {
+                fate_set++;
+            } else if(word_len == 4 && strncmp(word, "drop", 4) == 0) {
+                *action |= REPLAY_DROP;
+                fate_set++;
+            } else if(word_len == 5 && strncmp(word, "delay", 5) == 0) {
+                *action |= REPLAY_DELAY;
+                fate_set++;
+            } else if(word_len == 7 && strncmp(word, "reorder", 7) == 0) {
+                *action |= REPLAY_REORDER;
+                fate_set++;
+            } else if(word_len == 3 && strncmp(word, "dup", 3) == 0) {
+                *action |= REPLAY_DUPLICATE;
+            } else if(word_len == 7 && strncmp(word, "corrupt", 7) == 0) {
+                *action |= REPLAY_CORRUPT;
+            } else {
+                return -1;
+            }
+
+            start = i + 1;
+        }
+    }
+
+    return fate_set > 1 ? -1 : 0;
+}
+
+static void append_event(replay_trace_t *trace, int direction, const replay_event_t *event, size_t *capacity) {
+
+    if(trace->counts[direction] == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 256;
+        replay_event_t *grown = realloc(trace->parsed[direction], new_capacity * sizeof(replay_event_t));
+
+        if(!grown) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+
+        trace->parsed[direction] = grown;
+        *capacity = new_capacity;
+    }
+
+    trace->parsed[direction][trace->counts[direction]++] = *event;
+}
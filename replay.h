@@ -0,0 +1,42 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Actions use the same bit layout as the proxy's NOISE_* values
+#define REPLAY_PASS      0
+#define REPLAY_DROP      1
+#define REPLAY_DELAY     2
+#define REPLAY_REORDER   3
+#define REPLAY_FATE_MASK 0x0f
+#define REPLAY_DUPLICATE 0x10
+#define REPLAY_CORRUPT   0x20
+
+#define REPLAY_MAGIC "PXTRACE1"
+
+/*
+ * Binary trace layout: REPLAY_MAGIC, uint32 client event count, uint32 server
+ * event count, then the client events followed by the server events.
+ */
+typedef struct replay_event {
+    uint16_t delay_ms;
+    uint8_t  action;
+    uint8_t  reserved;
+} replay_event_t;
+
+typedef struct replay_trace {
+    void                 *map;
+    size_t               map_len;
+    const replay_event_t *events[2];
+    size_t               counts[2];
+    size_t               positions[2];
+    replay_event_t       *parsed[2];
+    int                  loop;
+} replay_trace_t;
+
+void replay_load(replay_trace_t *trace, const char *filename, int loop);
+const replay_event_t *replay_next(replay_trace_t *trace, int direction, size_t *index);
+void replay_close(replay_trace_t *trace);
+
+#endif
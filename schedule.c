@@ -0,0 +1,250 @@
+#include "common.h"
+#include "log.h"
+#include "schedule.h"
+
+/*
+ * Impairment timelines for the proxy. Each line starts a phase at an offset
+ * in seconds from when forwarding begins and sets any of the impairment
+ * options; the rest carry over from the phase before, and the first phase
+ * starts from the command line:
+ *
+ *     # start_s name [ramp] option=value...
+ *     0    clean  client-drop=0 server-drop=0
+ *     60   burst  client-drop=10 server-drop=10
+ *     90   slow   ramp client-delay=100
+ *     150  stuck  client-delay-time-min=200 client-delay-time-max=400
+ *
+ * A ramp phase slides every value linearly from its own to the next phase's
+ * by the time that one starts. The last phase lasts until the proxy stops.
+ */
+
+static const struct schedule_key {
+    const char *name;
+    int        direction;
+    size_t     offset;
+    int        percent;
+} schedule_keys[] = {
+    {"client-drop", 0, offsetof(impairment_t, drop_chance), 1},
+    {"server-drop", 1, offsetof(impairment_t, drop_chance), 1},
+    {"client-delay", 0, offsetof(impairment_t, delay_chance), 1},
+    {"server-delay", 1, offsetof(impairment_t, delay_chance), 1},
+    {"client-delay-time-min", 0, offsetof(impairment_t, delay_min), 0},
+    {"client-delay-time-max", 0, offsetof(impairment_t, delay_max), 0},
+    {"server-delay-time-min", 1, offsetof(impairment_t, delay_min), 0},
+    {"server-delay-time-max", 1, offsetof(impairment_t, delay_max), 0},
+    {"client-dup", 0, offsetof(impairment_t, dup_chance), 1},
+    {"server-dup", 1, offsetof(impairment_t, dup_chance), 1},
+    {"client-corrupt", 0, offsetof(impairment_t, corrupt_chance), 1},
+    {"server-corrupt", 1, offsetof(impairment_t, corrupt_chance), 1},
+    {"client-reorder", 0, offsetof(impairment_t, reorder_chance), 1},
+    {"server-reorder", 1, offsetof(impairment_t, reorder_chance), 1},
+};
+
+static void append_phase(schedule_t *schedule, const schedule_phase_t *phase, size_t *capacity);
+static int parse_phase(char *line, schedule_phase_t *phase);
+static int set_value(schedule_phase_t *phase, const char *setting);
+static int interpolate(int from, int to, int64_t done, int64_t total);
+
+void schedule_load(schedule_t *schedule, const char *filename, const impairment_t *client, const impairment_t *server) {
+    FILE *file = fopen(filename, "r");
+    char line[LINE_LEN];
+    size_t capacity = 0;
+    int line_number = 0;
+
+    memset(schedule, 0, sizeof(*schedule));
+
+    if(!file) {
+        perror("Failed to open schedule file");
+        exit(EXIT_FAILURE);
+    }
+
+    while(fgets(line, sizeof(line), file)) {
+        schedule_phase_t phase;
+        const schedule_phase_t *previous = schedule->count ? &schedule->phases[schedule->count - 1] : NULL;
+        int parsed;
+
+        line_number++;
+
+        phase.impairment[0] = previous ? previous->impairment[0] : *client;
+        phase.impairment[1] = previous ? previous->impairment[1] : *server;
+        parsed = parse_phase(line, &phase);
+
+        if(parsed == -1 || (parsed && previous && phase.start_ns <= previous->start_ns)) {
+            fprintf(stderr, "%s:%d: invalid schedule line\n", filename, line_number);
+            exit(EXIT_FAILURE);
+        }
+
+        if(!parsed) {
+            continue;
+        }
+
+        if(phase.impairment[0].delay_min > phase.impairment[0].delay_max || phase.impairment[1].delay_min > phase.impairment[1].delay_max) {
+            fprintf(stderr, "%s:%d: delay min time cannot be greater than delay max time\n", filename, line_number);
+            exit(EXIT_FAILURE);
+        }
+
+        // Until the first phase starts, the command line's settings hold
+        if(!previous && phase.start_ns > 0) {
+            schedule_phase_t initial;
+
+            memset(&initial, 0, sizeof(initial));
+            strcpy(initial.name, "initial");
+            initial.impairment[0] = *client;
+            initial.impairment[1] = *server;
+            append_phase(schedule, &initial, &capacity);
+        }
+
+        append_phase(schedule, &phase, &capacity);
+    }
+
+    fclose(file);
+
+    if(schedule->count == 0) {
+        fprintf(stderr, "Schedule file %s has no phases\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    log_event(LOG_PROXY, "Loaded schedule %s: %zu phases over %.3f s", filename, schedule->count,
+              (double) schedule->phases[schedule->count - 1].start_ns / NS_PER_SEC);
+}
+
+void schedule_start(schedule_t *schedule, int64_t now) {
+    schedule->epoch_ns = now;
+    schedule->current = 0;
+    schedule->started = 0;
+}
+
+/*
+ * Writes the impairments in force at now and returns 1 if a new phase began
+ * since the last call, the first call included. Between phase changes a step
+ * phase writes nothing.
+ */
+int schedule_update(schedule_t *schedule, int64_t now, impairment_t *client, impairment_t *server) {
+    int64_t elapsed = now - schedule->epoch_ns;
+    const schedule_phase_t *phase;
+    const schedule_phase_t *next;
+    int changed = !schedule->started;
+
+    schedule->started = 1;
+
+    while(schedule->current + 1 < schedule->count && elapsed >= schedule->phases[schedule->current + 1].start_ns) {
+        schedule->current++;
+        changed = 1;
+    }
+
+    phase = &schedule->phases[schedule->current];
+    next = schedule->current + 1 < schedule->count ? phase + 1 : NULL;
+
+    if(!phase->ramp || !next) {
+        if(changed) {
+            *client = phase->impairment[0];
+            *server = phase->impairment[1];
+        }
+        return changed;
+    }
+
+    for(int direction = 0; direction < 2; direction++) {
+        const impairment_t *from = &phase->impairment[direction];
+        const impairment_t *to = &next->impairment[direction];
+        impairment_t *out = direction ? server : client;
+        int64_t done = elapsed - phase->start_ns;
+        int64_t total = next->start_ns - phase->start_ns;
+
+        out->drop_chance = interpolate(from->drop_chance, to->drop_chance, done, total);
+        out->delay_chance = interpolate(from->delay_chance, to->delay_chance, done, total);
+        out->delay_min = interpolate(from->delay_min, to->delay_min, done, total);
+        out->delay_max = interpolate(from->delay_max, to->delay_max, done, total);
+        out->dup_chance = interpolate(from->dup_chance, to->dup_chance, done, total);
+        out->corrupt_chance = interpolate(from->corrupt_chance, to->corrupt_chance, done, total);
+        out->reorder_chance = interpolate(from->reorder_chance, to->reorder_chance, done, total);
+    }
+
+    return changed;
+}
+
+void schedule_close(schedule_t *schedule) {
+    free(schedule->phases);
+    memset(schedule, 0, sizeof(*schedule));
+}
+
+static void append_phase(schedule_t *schedule, const schedule_phase_t *phase, size_t *capacity) {
+
+    if(schedule->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        schedule->phases = realloc(schedule->phases, sizeof(*schedule->phases) * *capacity);
+        if(!schedule->phases) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    schedule->phases[schedule->count++] = *phase;
+}
+
+// Returns 1 for a phase, 0 for a blank or comment line, -1 if malformed
+static int parse_phase(char *line, schedule_phase_t *phase) {
+    char *save;
+    char *token = strtok_r(line, " \t\r\n", &save);
+    char *end;
+    double start_s;
+
+    if(!token || token[0] == '#') {
+        return 0;
+    }
+
+    start_s = strtod(token, &end);
+    if(*end != '\0' || start_s < 0 || start_s > INT32_MAX) {
+        return -1;
+    }
+    phase->start_ns = (int64_t)(start_s * NS_PER_SEC);
+
+    token = strtok_r(NULL, " \t\r\n", &save);
+    if(!token || strchr(token, '=') || strlen(token) >= SCHEDULE_NAME_LEN) {
+        return -1;
+    }
+    strcpy(phase->name, token);
+
+    phase->ramp = 0;
+    while((token = strtok_r(NULL, " \t\r\n", &save))) {
+        if(strcmp(token, "ramp") == 0 && !phase->ramp) {
+            phase->ramp = 1;
+        } else if(!set_value(phase, token)) {
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+static int set_value(schedule_phase_t *phase, const char *setting) {
+    const char *equals = strchr(setting, '=');
+    char *end;
+    long value;
+
+    if(!equals) {
+        return 0;
+    }
+
+    for(size_t i = 0; i < sizeof(schedule_keys) / sizeof(schedule_keys[0]); i++) {
+        const struct schedule_key *key = &schedule_keys[i];
+
+        if(strlen(key->name) != (size_t)(equals - setting) || strncmp(key->name, setting, (size_t)(equals - setting)) != 0) {
+            continue;
+        }
+
+        errno = 0;
+        value = strtol(equals + 1, &end, BASE_TEN);
+        if(errno != 0 || end == equals + 1 || *end != '\0' || value < MIN_INT_PARSE || value > (key->percent ? 100 : MAX_INT_PARSE)) {
+            return 0;
+        }
+
+        *(int *)((char *)&phase->impairment[key->direction] + key->offset) = (int) value;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int interpolate(int from, int to, int64_t done, int64_t total) {
+    return from + (int)((int64_t)(to - from) * done / total);
+}
@@ -0,0 +1,44 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCHEDULE_NAME_LEN 32
+
+// Chances are percentages, delays milliseconds
+typedef struct impairment {
+    int drop_chance;
+    int delay_chance;
+    int delay_min;
+    int delay_max;
+    int dup_chance;
+    int corrupt_chance;
+    int reorder_chance;
+} impairment_t;
+
+/*
+ * Each phase holds both directions' impairments fully resolved at load, so a
+ * step costs nothing per packet and a ramp one interpolation.
+ */
+typedef struct schedule_phase {
+    int64_t      start_ns;      // after schedule_start()
+    char         name[SCHEDULE_NAME_LEN];
+    int          ramp;          // moves linearly to the next phase's values while it runs
+    impairment_t impairment[2]; // client to server, server to client
+} schedule_phase_t;
+
+typedef struct schedule {
+    schedule_phase_t *phases;
+    size_t           count;
+    size_t           current;
+    int              started;       // the current phase has been written out
+    int64_t          epoch_ns;
+} schedule_t;
+
+void schedule_load(schedule_t *schedule, const char *filename, const impairment_t *client, const impairment_t *server);
+void schedule_start(schedule_t *schedule, int64_t now);
+int schedule_update(schedule_t *schedule, int64_t now, impairment_t *client, impairment_t *server);
+void schedule_close(schedule_t *schedule);
+
+#endif
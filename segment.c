@@ -0,0 +1,143 @@
+#include "common.h"
+#include "segment.h"
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+// Segment sizes go with each send, so this only checks the kernel supports UDP_SEGMENT at all
+void segment_enable_gso(int sock_fd) {
+    int segment = 0;
+
+    if(setsockopt(sock_fd, IPPROTO_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == -1) {
+        perror("Setting UDP_SEGMENT failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void segment_enable_gro(int sock_fd) {
+    int on = 1;
+
+    if(setsockopt(sock_fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+        perror("Setting UDP_GRO failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void segment_batch_init(segment_batch_t *batch, int sock_fd, int offload) {
+
+    memset(batch, 0, sizeof(*batch));
+    batch->sock_fd = sock_fd;
+    batch->offload = offload;
+}
+
+// Queues a checksummed packet; a change of destination or size, or a full batch, flushes first
+void segment_batch_add(segment_batch_t *batch, const void *data, size_t len, struct sockaddr *addr, socklen_t addr_len) {
+
+    if(!batch->offload) {
+        forward_packet(batch->sock_fd, data, len, addr, addr_len);
+        batch->sends++;
+        batch->sent++;
+        return;
+    }
+
+    if(batch->count && (batch->addr != addr || len > batch->segment_len ||
+                         batch->count == SEGMENT_MAX_COUNT || batch->used + len > SEGMENT_MAX_BYTES)) {
+        segment_batch_flush(batch);
+    }
+
+    if(batch->count == 0) {
+        batch->segment_len = len;
+    }
+
+    memcpy(batch->buffer + batch->used, data, len);
+    batch->used += len;
+    batch->count++;
+    batch->addr = addr;
+    batch->addr_len = addr_len;
+
+    // Only the last segment of a send may be short
+    if(len < batch->segment_len) {
+        segment_batch_flush(batch);
+    }
+}
+
+void segment_batch_flush(segment_batch_t *batch) {
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct iovec iov = {batch->buffer, batch->used};
+    struct msghdr msg;
+
+    if(batch->count == 0) {
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = batch->addr;
+    msg.msg_namelen = batch->addr ? batch->addr_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(batch->count > 1) {
+        struct cmsghdr *cmsg;
+        uint16_t segment = (uint16_t) batch->segment_len;
+
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    }
+
+    if(sendmsg(batch->sock_fd, &msg, 0) == -1) {
+        perror("Error sending segmented packets");
+        exit(EXIT_FAILURE);
+    }
+
+    batch->sends++;
+    batch->sent += batch->count;
+    batch->count = 0;
+    batch->used = 0;
+}
+
+// receive_datagram() that also reports the GRO segment size, or the whole length if nothing was coalesced
+ssize_t segment_receive(int sock_fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len,
+                        uint32_t *kernel_drops, size_t *segment_len) {
+    char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    ssize_t received;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr ? *addr_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    received = recvmsg(sock_fd, &msg, flags);
+
+    if(received < 0) {
+        return received;
+    }
+
+    if(addr) {
+        *addr_len = msg.msg_namelen;
+    }
+    read_drop_counter(&msg, kernel_drops);
+
+    *segment_len = (size_t) received;
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int gso_size;
+
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            if(gso_size > 0) {
+                *segment_len = (size_t) gso_size;
+            }
+        }
+    }
+
+    return received;
+}
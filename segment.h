@@ -0,0 +1,48 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include "common.h"
+
+/*
+ * UDP segmentation offload. A send carrying a UDP_SEGMENT control message
+ * leaves as one datagram per segment, split by the stack (or the NIC); every
+ * segment has the same size except a shorter last one. With UDP_GRO the kernel
+ * may hand several datagrams of a flow to one receive, reporting the segment
+ * size in a control message.
+ *
+ * A batch is a run of datagrams to one destination, all as long as the first
+ * except perhaps a shorter last one, and goes out as a single sendmsg() with
+ * that length as UDP_SEGMENT. A different destination, a longer packet, or a
+ * full batch flushes first; a shorter one ends the run. With offload off each
+ * packet is sent on its own as soon as it is added.
+ */
+
+// The whole send plus IPv6 and UDP headers has to fit one 64 KiB IP datagram
+#define SEGMENT_MAX_BYTES (UINT16_MAX - 40 - 8)
+#define SEGMENT_MAX_COUNT 64     // UDP_MAX_SEGMENTS on older kernels
+
+// Enough packet_t slots for the largest coalesced GRO receive
+#define SEGMENT_RECEIVE_PACKETS (65536 / sizeof(packet_t) + 1)
+
+typedef struct segment_batch {
+    int             sock_fd;
+    int             offload;        // 0 sends every packet as soon as it is added
+    struct sockaddr *addr;          // NULL on a connected socket
+    socklen_t       addr_len;
+    size_t          count;
+    size_t          segment_len;    // length of the first datagram, which the rest must match
+    size_t          used;
+    uint64_t        sends;
+    uint64_t        sent;
+    unsigned char   buffer[SEGMENT_MAX_BYTES];
+} segment_batch_t;
+
+void segment_enable_gso(int sock_fd);
+void segment_enable_gro(int sock_fd);
+void segment_batch_init(segment_batch_t *batch, int sock_fd, int offload);
+void segment_batch_add(segment_batch_t *batch, const void *data, size_t len, struct sockaddr *addr, socklen_t addr_len);
+void segment_batch_flush(segment_batch_t *batch);
+ssize_t segment_receive(int sock_fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len,
+                        uint32_t *kernel_drops, size_t *segment_len);
+
+#endif
@@ -1,72 +1,290 @@
+#define _GNU_SOURCE     // sendmmsg
 #include "common.h"
 #include "log.h"
+#include "crc32c.h"
+#include "compress.h"
+#include "fec.h"
+#include "gf256.h"
+#include "spsc.h"
+#include "hoptrace.h"
+#include "workers.h"
+#include <pthread.h>
+#include <sys/select.h>
 
-static void parse_args(int argc,char *argv[], char **ip_address, char **port_str);
+// handle_packet results
+#define PACKET_IGNORED   0
+#define PACKET_IN_ORDER  1
+#define PACKET_DUPLICATE 2
+#define PACKET_GAP       3
+
+typedef struct ack_state {
+    int             every;
+    long            delay_us;
+    int             pending;
+    int64_t         deadline_ns;
+} ack_state_t;
+
+// Packets that arrived ahead of a gap, indexed by sequence % SERVER_REORDER_SLOTS
+typedef struct reorder_buffer {
+    packet_t      packets[SERVER_REORDER_SLOTS];
+    unsigned char held[SERVER_REORDER_SLOTS];
+    unsigned char delivered[SERVER_REORDER_SLOTS];  // already handed to its stream, held only for the ACK
+    int           stream_next[MAX_STREAMS];         // stream_sequence each stream delivers next
+} reorder_buffer_t;
+
+// One client's delivery state, kept under its session id so a reconnect picks up where it stopped
+typedef struct session {
+    uint32_t                id;
+    uint32_t                epoch;          // of the client run that last said hello; 0 if opened by data
+    int                     sequence_counter;
+    int64_t                 last_active_ns;
+    int64_t                 echo_ns;        // timestamp_ns of the latest data packet, returned in ACKs
+    ack_state_t             ack;
+    reorder_buffer_t        reorder;
+    fec_decoder_t           decoder;
+    struct sockaddr_storage client_addr;
+    socklen_t               client_addr_len;
+} session_t;
+
+// A datagram as the receive thread left it in a ring slot
+typedef struct received_packet {
+    packet_t                packet;
+    ssize_t                 len;
+    int64_t                 received_ns;    // only read with --hop-trace
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+} received_packet_t;
+
+// ACKs queued while a batch of ring slots is processed, sent together with sendmmsg
+typedef struct ack_batch {
+    int                     sock_fd;
+    int                     dual_stack;     // IPv4 clients are kept unmapped and must be mapped to send
+    packet_t                packets[SERVER_PIPELINE_BATCH];
+    struct sockaddr_storage addrs[SERVER_PIPELINE_BATCH];
+    struct iovec            iovecs[SERVER_PIPELINE_BATCH];
+    struct mmsghdr          messages[SERVER_PIPELINE_BATCH];
+    int                     count;
+    uint64_t                sent;
+    uint64_t                sends;
+} ack_batch_t;
+
+// Everything the packet-handling side of the server owns
+typedef struct server_state {
+    int                     sock_fd;
+    ack_state_t             ack;            // settings each new session starts from
+    compressor_t            compressor;
+    packet_t                recovered[FEC_MAX_PARITY];
+    ack_batch_t             acks;           // ACKs and hello replies waiting for flush_acks()
+    session_t               *sessions[SERVER_MAX_SESSIONS];     // allocated on first use, never freed
+    uint64_t                parity_received;    // totals of decoders since reset or evicted
+    uint64_t                parity_recovered;
+} server_state_t;
+
+typedef struct pipeline {
+    spsc_ring_t             ring;
+    server_state_t          *server;
+    uint64_t                overflows;      // datagrams read and dropped because the ring was full
+} pipeline_t;
+
+static void parse_args(int argc,char *argv[], char **ip_address, char **port_str, char **ack_every_str, char **ack_delay_str, int *use_tsc,
+                       char **rcvbuf_str, char **sndbuf_str, char **dict_str, int *use_pipeline, char **hop_trace_str, char **workers_str,
+                       int *dual_stack);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
-static int receive_packet(int sock_fd, packet_t *packet, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
-static int handle_packet(packet_t *packet, int *sequence_counter);
-static void send_ack(int sock_fd, int sequence_num, packet_t *ack_packet, struct sockaddr_storage *cliet_addr, socklen_t *client_addr_len);
+static void run_inline(server_state_t *server, uint32_t *kernel_drops);
+static void run_pipeline(server_state_t *server, uint32_t *kernel_drops);
+static void *process_main(void *arg);
+static int receive_packet(int sock_fd, packet_t *packet, struct sockaddr_storage *client_addr, socklen_t *client_addr_len, uint32_t *kernel_drops);
+static int check_packet(packet_t *packet, ssize_t bytes_received);
+static void process_packet(server_state_t *server, packet_t *packet, const struct sockaddr_storage *addr, socklen_t addr_len, int64_t received_ns);
+static session_t *find_session(server_state_t *server, uint32_t id);
+static session_t *open_session(server_state_t *server, uint32_t id, int sequence_counter);
+static void resume_session(server_state_t *server, session_t *session);
+static void count_recovery(server_state_t *server, const fec_decoder_t *decoder);
+static int accept_packet(server_state_t *server, session_t *session, packet_t *packet, const char *action);
+static int handle_packet(packet_t *packet, int *sequence_counter, reorder_buffer_t *reorder);
+static void skip_to(int *sequence_counter, reorder_buffer_t *reorder, int window_base);
+static void deliver_held(int *sequence_counter, reorder_buffer_t *reorder);
+static int release_held(reorder_buffer_t *reorder, int sequence);
+static void deliver_stream(int sequence_counter, reorder_buffer_t *reorder, int sequence);
+static void deliver(reorder_buffer_t *reorder, const packet_t *packet);
+static void process_payload(work_item_t *item);
+static void emit_payload(work_item_t *item);
+static void build_ack(packet_t *ack_packet, uint32_t session, int sequence_num, int64_t timestamp_ns, uint16_t flags);
+static void batch_ack(ack_batch_t *batch, session_t *session, uint16_t flags);
+static void flush_acks(ack_batch_t *batch);
+static void queue_ack(ack_state_t *ack, int result, int *send_now);
+static int64_t next_ack_deadline(const server_state_t *server);
+static void expire_acks(server_state_t *server);
+static int wait_for_packet(int sock_fd, int64_t deadline_ns);
+
+// Per-packet timing records for merge_traces.py, NULL unless --hop-trace is given; written by the processing thread only
+static hop_trace_t *hop_trace;
+
+// Set with --workers; delivered payloads are then processed there instead of inline
+static worker_pool_t *workers;
 
 int main(int argc, char *argv[]) {
 
-    packet_t                packet;
-    packet_t                ack_packet;
     char                   *ip_address;
     char                   *port_str;
+    char                   *ack_every_str;
+    char                   *ack_delay_str;
     struct sockaddr_storage addr;
     socklen_t               addr_len;
     in_port_t               port;
-    int                     sock_fd;
-    struct sockaddr_storage client_addr;
-    socklen_t               client_addr_len;
-    int                     sequence_counter;
+    int                     use_tsc;
+    int                     use_pipeline;
+    int                     dual_stack;
+    char                   *rcvbuf_str;
+    char                   *sndbuf_str;
+    char                   *dict_str;
+    char                   *hop_trace_str;
+    static hop_trace_t      tracing;
+    char                   *workers_str;
+    static worker_pool_t    pool;
+    int                     rcvbuf;
+    int                     sndbuf;
+    uint32_t                kernel_drops;
+    static server_state_t   server;
 
     ip_address = NULL;
     port_str = NULL;
-    sequence_counter = -1;
-    client_addr_len = sizeof(client_addr);
+    ack_every_str = NULL;
+    ack_delay_str = NULL;
+    use_tsc = 0;
+    use_pipeline = 0;
+    dual_stack = 0;
+    rcvbuf_str = NULL;
+    sndbuf_str = NULL;
+    dict_str = NULL;
+    hop_trace_str = NULL;
+    workers_str = NULL;
+    kernel_drops = 0;
 
     setup_signal_handler();
-    parse_args(argc, argv, &ip_address, &port_str);
+    parse_args(argc, argv, &ip_address, &port_str, &ack_every_str, &ack_delay_str, &use_tsc, &rcvbuf_str, &sndbuf_str, &dict_str, &use_pipeline, &hop_trace_str, &workers_str,
+               &dual_stack);
+    clock_init(use_tsc);
+    log_event(LOG_SERVER, "Checksum kernel: %s, clock source: %s", crc32c_kernel_name(), clock_source());
+
+    // Compressed packets are always accepted; the dictionary is only needed for ones that name it
+    compressor_init(&server.compressor, dict_str);
+    if(dict_str) {
+        log_event(LOG_SERVER, "Loaded %zu byte compression dictionary %08" PRIx32, server.compressor.dict_len, server.compressor.dict_id);
+    }
+
+    if(hop_trace_str) {
+        hop_trace_open(&tracing, hop_trace_str, HOP_SERVER);
+        hop_trace = &tracing;
+    }
+
+    if(workers_str) {
+        int count = (int) parse_unsigned(workers_str, "workers", SERVER_MAX_WORKERS);
+
+        if(count < 1) {
+            fprintf(stderr, "workers must be at least 1\n");
+            exit(EXIT_FAILURE);
+        }
+        worker_pool_init(&pool, count, process_payload, emit_payload);
+        workers = &pool;
+        log_event(LOG_SERVER, "Processing payloads on %d worker threads", count);
+    }
 
     convert_address(ip_address, &addr, &addr_len);
 
     parse_port(port_str, &port);
 
-    sock_fd = create_socket(addr.ss_family, SOCK_DGRAM, 0);
+    server.ack.every = ack_every_str ? (int) parse_unsigned(ack_every_str, "ack-every", MAX_ACK_EVERY) : 1;
+    server.ack.delay_us = ack_delay_str ? (long) parse_unsigned(ack_delay_str, "ack-delay", MAX_ACK_DELAY_US) : SERVER_ACK_DELAY_US;
 
-    bind_socket(sock_fd, &addr, port);
+    if(server.ack.every < 1) {
+        fprintf(stderr, "ack-every must be at least 1\n");
+        exit(EXIT_FAILURE);
+    }
 
-    while(!exit_flag) {
-        
-        if(receive_packet(sock_fd, &packet, &client_addr, &client_addr_len)){
+    if(dual_stack) {
+        dual_stack_address(&addr, &addr_len);
+    }
 
-            log_packet(LOG_SERVER, "Received", packet.sequence, packet.payload, 0);
+    server.sock_fd = create_socket(addr.ss_family, SOCK_DGRAM, 0);
+    server.acks.sock_fd = server.sock_fd;
+    server.acks.dual_stack = dual_stack;
+    if(dual_stack) {
+        enable_dual_stack(server.sock_fd);
+        log_event(LOG_SERVER, "Dual stack: IPv4 clients share the IPv6 socket");
+    }
 
+    bind_socket(server.sock_fd, &addr, port);
 
-            if(handle_packet(&packet, &sequence_counter)) {
-                send_ack(sock_fd, sequence_counter, &ack_packet, &client_addr, &client_addr_len);
-            }
-        }
+    set_socket_buffers(server.sock_fd, rcvbuf_str ? (int) parse_unsigned(rcvbuf_str, "rcvbuf", MAX_SOCKET_BUFFER) : 0,
+                       sndbuf_str ? (int) parse_unsigned(sndbuf_str, "sndbuf", MAX_SOCKET_BUFFER) : 0);
+    socket_buffer_sizes(server.sock_fd, &rcvbuf, &sndbuf);
+    enable_drop_counter(server.sock_fd);
+    log_event(LOG_SERVER, "Socket buffers: receive %d bytes, send %d bytes", rcvbuf, sndbuf);
 
+    if(use_pipeline) {
+        run_pipeline(&server, &kernel_drops);
+    } else {
+        run_inline(&server, &kernel_drops);
     }
 
-    close_socket(sock_fd);
+    if(workers) {
+        worker_pool_close(workers);
+        log_event(LOG_SERVER, "Workers processed %" PRIu64 " payloads, waiting for room %" PRIu64 " times", workers->submitted, workers->stalls);
+    }
+
+    log_event(LOG_SERVER, "Kernel receive queue overflows: %" PRIu32, kernel_drops);
+    for(int i = 0; i < SERVER_MAX_SESSIONS && server.sessions[i]; i++) {
+        count_recovery(&server, &server.sessions[i]->decoder);
+        free(server.sessions[i]);
+    }
+    if(server.parity_received) {
+        log_event(LOG_SERVER, "Recovered %" PRIu64 " packets from %" PRIu64 " parity packets with the %s kernel", server.parity_recovered,
+                  server.parity_received, gf256_kernel_name());
+    }
+    if(hop_trace) {
+        log_event(LOG_SERVER, "Wrote %" PRIu64 " hop trace records", hop_trace->records);
+        hop_trace_close(hop_trace);
+    }
+    compressor_close(&server.compressor);
+    close_socket(server.sock_fd);
     log_close();
     exit(EXIT_SUCCESS);
 
 }
 
-static void parse_args(int argc,char *argv[], char **ip_address, char **port_str) {
+static void parse_args(int argc,char *argv[], char **ip_address, char **port_str, char **ack_every_str, char **ack_delay_str, int *use_tsc,
+                       char **rcvbuf_str, char **sndbuf_str, char **dict_str, int *use_pipeline, char **hop_trace_str, char **workers_str,
+                       int *dual_stack) {
     int opt;
     int option_index = 0;
     int ip_set = 0;
     int port_set = 0;
     int log_set = 0;
+    int ack_every_set = 0;
+    int ack_delay_set = 0;
+    int tsc_set = 0;
+    int rcvbuf_set = 0;
+    int sndbuf_set = 0;
+    int dict_set = 0;
+    int pipeline_set = 0;
+    int hop_trace_set = 0;
+    int workers_set = 0;
+    int dual_stack_set = 0;
 
     static struct option long_options[] = {
         {"listen-ip", required_argument, 0, 1},
         {"listen-port", required_argument, 0, 2},
+        {"ack-every", required_argument, 0, 3},
+        {"ack-delay", required_argument, 0, 4},
+        {"tsc", no_argument, 0, 5},
+        {"rcvbuf", required_argument, 0, 6},
+        {"sndbuf", required_argument, 0, 7},
+        {"dict", required_argument, 0, 8},
+        {"pipeline", no_argument, 0, 9},
+        {"hop-trace", required_argument, 0, 10},
+        {"workers", required_argument, 0, 11},
+        {"dual-stack", no_argument, 0, 12},
         {"log", no_argument, 0, 'l'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -90,6 +308,76 @@ static void parse_args(int argc,char *argv[], char **ip_address, char **port_str
                 *port_str = optarg;
                 port_set = 1;
                 break;
+            case 3:
+                if(ack_every_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --ack-every");
+                }
+                *ack_every_str = optarg;
+                ack_every_set = 1;
+                break;
+            case 4:
+                if(ack_delay_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --ack-delay");
+                }
+                *ack_delay_str = optarg;
+                ack_delay_set = 1;
+                break;
+            case 5:
+                if(tsc_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --tsc");
+                }
+                *use_tsc = 1;
+                tsc_set = 1;
+                break;
+            case 6:
+                if(rcvbuf_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --rcvbuf");
+                }
+                *rcvbuf_str = optarg;
+                rcvbuf_set = 1;
+                break;
+            case 7:
+                if(sndbuf_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --sndbuf");
+                }
+                *sndbuf_str = optarg;
+                sndbuf_set = 1;
+                break;
+            case 8:
+                if(dict_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --dict");
+                }
+                *dict_str = optarg;
+                dict_set = 1;
+                break;
+            case 9:
+                if(pipeline_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --pipeline");
+                }
+                *use_pipeline = 1;
+                pipeline_set = 1;
+                break;
+            case 10:
+                if(hop_trace_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --hop-trace");
+                }
+                *hop_trace_str = optarg;
+                hop_trace_set = 1;
+                break;
+            case 11:
+                if(workers_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --workers");
+                }
+                *workers_str = optarg;
+                workers_set = 1;
+                break;
+            case 12:
+                if(dual_stack_set){
+                    usage(argv[0], EXIT_FAILURE, "Duplicate option: --dual-stack");
+                }
+                *dual_stack = 1;
+                dual_stack_set = 1;
+                break;
             case 'l':
                 if(log_set) {
                     usage(argv[0], EXIT_FAILURE, "Duplicate option: --log/-l");
@@ -129,14 +417,165 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char*
     fputs("Options:\n", stderr);
     fputs("  --listen-ip <ip>         IP address to bind to\n", stderr);
     fputs("  --listen-port <port>     UDP port to listen on\n", stderr);
+    fputs("  --ack-every <n>          Acknowledge every n in-order packets (default 1)\n", stderr);
+    fputs("  --ack-delay <usec>       Longest an acknowledgement is held back (default 40000)\n", stderr);
+    fputs("  --tsc                    Time with the calibrated TSC instead of CLOCK_MONOTONIC\n", stderr);
+    fputs("  --rcvbuf <bytes>         Socket receive buffer size (default: kernel)\n", stderr);
+    fputs("  --sndbuf <bytes>         Socket send buffer size (default: kernel)\n", stderr);
+    fputs("  --dict <file>            Compression dictionary shared with the client\n", stderr);
+    fputs("  --pipeline               Receive on one thread and handle packets on another\n", stderr);
+    fputs("  --hop-trace <file>       Record every arrival, delivery and ACK for merge_traces.py\n", stderr);
+    fputs("  --workers <n>            Process payloads on n threads, still output in delivery order\n", stderr);
+    fputs("  --dual-stack             Take IPv4 and IPv6 clients on one socket (0.0.0.0 listens as ::)\n", stderr);
     fputs("  -l, --log                Enables logging\n", stderr);
     fputs("  -h, --help               Display this help message\n", stderr);
     exit(exit_code);
 }
 
-static int receive_packet(int sock_fd, packet_t *packet, struct sockaddr_storage *client_addr, socklen_t *client_addr_len) {
+// Receives, handles and acknowledges every packet on the calling thread
+static void run_inline(server_state_t *server, uint32_t *kernel_drops) {
+    packet_t packet;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    while(!exit_flag) {
+
+        // A coalesced ACK timer expired before enough packets arrived
+        if(!wait_for_packet(server->sock_fd, next_ack_deadline(server))) {
+            expire_acks(server);
+            flush_acks(&server->acks);
+            continue;
+        }
+
+        addr_len = sizeof(addr);
+        if(receive_packet(server->sock_fd, &packet, &addr, &addr_len, kernel_drops)) {
+            process_packet(server, &packet, &addr, addr_len, clock_now());
+            flush_acks(&server->acks);
+        }
+    }
+}
+
+/*
+ * This thread only moves datagrams from the socket into ring slots, so slow
+ * payload handling no longer holds up draining the socket buffer. The
+ * processing thread verifies, delivers and acknowledges them. SIGINT is
+ * blocked there so it always interrupts the receive here.
+ */
+static void run_pipeline(server_state_t *server, uint32_t *kernel_drops) {
+    static pipeline_t pipeline;
+    received_packet_t overflow;
+    pthread_t thread;
+    sigset_t blocked;
+    sigset_t previous;
+
+    pipeline.server = server;
+    spsc_init(&pipeline.ring, sizeof(received_packet_t), SERVER_PIPELINE_SLOTS);
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    if(pthread_create(&thread, NULL, process_main, &pipeline) != 0) {
+        fprintf(stderr, "Failed to start packet processing thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    log_event(LOG_SERVER, "Pipelined receive through a %d slot ring", SERVER_PIPELINE_SLOTS);
+
+    while(!exit_flag) {
+        received_packet_t *slot = spsc_claim(&pipeline.ring);
+
+        // Still read when full, so the datagram is counted here rather than lost silently in the kernel
+        if(!slot) {
+            slot = &overflow;
+        }
+
+        slot->addr_len = sizeof(slot->addr);
+        slot->len = receive_datagram(server->sock_fd, &slot->packet, sizeof(slot->packet), 0, (struct sockaddr *)&slot->addr, &slot->addr_len,
+                                     kernel_drops);
+
+        if(slot->len < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Error with recvfrom");
+            exit(EXIT_FAILURE);
+        }
+
+        // Stamped here, since the ring may hold the datagram for a while
+        if(hop_trace) {
+            slot->received_ns = clock_refresh();
+        }
+
+        if(slot == &overflow) {
+            pipeline.overflows++;
+            continue;
+        }
+
+        spsc_publish(&pipeline.ring);
+    }
+
+    spsc_close(&pipeline.ring);
+    pthread_join(thread, NULL);
+    spsc_destroy(&pipeline.ring);
+
+    log_event(LOG_SERVER, "Pipeline ring overflows: %" PRIu64 ", %" PRIu64 " ACKs in %" PRIu64 " sends", pipeline.overflows,
+              server->acks.sent, server->acks.sends);
+}
+
+// Drains the ring up to SERVER_PIPELINE_BATCH slots at a time, then sends that batch's ACKs together
+static void *process_main(void *arg) {
+    pipeline_t *pipeline = arg;
+    server_state_t *server = pipeline->server;
+
+    for(;;) {
+        received_packet_t *slot;
+        int processed = 0;
+        int timeout_ms = -1;
+
+        clock_refresh();
+
+        while(processed < SERVER_PIPELINE_BATCH && (slot = spsc_peek(&pipeline->ring))) {
+            if(check_packet(&slot->packet, slot->len)) {
+                process_packet(server, &slot->packet, &slot->addr, slot->addr_len, slot->received_ns);
+            }
+            spsc_release(&pipeline->ring);
+            processed++;
+        }
+
+        expire_acks(server);
+        flush_acks(&server->acks);
+
+        if(processed) {
+            continue;
+        }
+
+        if(__atomic_load_n(&pipeline->ring.closed, __ATOMIC_ACQUIRE) && !spsc_peek(&pipeline->ring)) {
+            break;
+        }
+
+        if(next_ack_deadline(server) != INT64_MAX) {
+            int64_t remaining_ns = next_ack_deadline(server) - clock_now();
+
+            timeout_ms = remaining_ns <= 0 ? 0 : (int)((remaining_ns + NS_PER_MS - 1) / NS_PER_MS);
+        }
+
+        spsc_wait(&pipeline->ring, timeout_ms);
+    }
+
+    return NULL;
+}
+
+static int receive_packet(int sock_fd, packet_t *packet, struct sockaddr_storage *client_addr, socklen_t *client_addr_len, uint32_t *kernel_drops) {
     
-    ssize_t bytes_received = recvfrom(sock_fd, packet, sizeof(*packet), 0, (struct sockaddr *)client_addr, client_addr_len);
+    ssize_t bytes_received = receive_datagram(sock_fd, packet, sizeof(*packet), 0, (struct sockaddr *)client_addr, client_addr_len, kernel_drops);
+
+    clock_refresh();
+
+    // SIGINT: back to the loop, which shuts down cleanly and lets the workers finish
+    if(bytes_received < 0 && errno == EINTR) {
+        return 0;
+    }
 
     if(bytes_received < 0) {
         perror("Error with recvfrom");
@@ -144,39 +583,451 @@ static int receive_packet(int sock_fd, packet_t *packet, struct sockaddr_storage
         exit(EXIT_FAILURE);
     }
 
-    if((size_t)bytes_received != sizeof(*packet)) {
-        fprintf(stderr, "Received incomplete or malformed packet (%zd bytes, expected %zu)\n", bytes_received, sizeof(*packet));
+    return check_packet(packet, bytes_received);
+}
+
+static int check_packet(packet_t *packet, ssize_t bytes_received) {
+
+    if((size_t)bytes_received < PACKET_HEADER_LEN) {
+        fprintf(stderr, "Received incomplete or malformed packet (%zd bytes, expected at least %zu)\n", bytes_received, PACKET_HEADER_LEN);
+        return 0;
+    }
+
+    // Only parity uses the extra payload room
+    if(!verify_packet(packet, (size_t)bytes_received) ||
+       (!(packet->flags & PACKET_PARITY) && (packet->length > LINE_LEN || packet->stream >= MAX_STREAMS))) {
+        log_packet(LOG_SERVER, "Corrupted", packet->sequence, packet->payload, 0);
         return 0;
     }
 
     return 1;
 }
 
-static int handle_packet(packet_t *packet, int *sequence_counter) {
-    
+/*
+ * Runs a verified packet through its session's FEC and delivery and queues
+ * the ACK it calls for. A hello opens the session at the sequence it offers,
+ * or resumes a known one where its counter stands, and is answered with that
+ * counter straight away. A late copy of the hello that began the current run
+ * carries the same epoch and is only answered again.
+ */
+static void process_packet(server_state_t *server, packet_t *packet, const struct sockaddr_storage *addr, socklen_t addr_len, int64_t received_ns) {
+    session_t *session = find_session(server, packet->session);
+    int recovered;
+    int send_now = 0;
+
+    if(hop_trace) {
+        hop_trace_record(hop_trace, HOP_RECEIVED, 0, packet, received_ns);
+    }
+
+    if(packet->flags & PACKET_HELLO) {
+        uint32_t epoch = (uint32_t) packet->stream_sequence;
+
+        if(!session) {
+            session = open_session(server, packet->session, packet->sequence - 1);
+        } else if(session->epoch != epoch) {
+            resume_session(server, session);
+        } else {
+            log_event(LOG_SERVER, "Repeated hello for session %08" PRIx32 " after Packet %d", session->id, session->sequence_counter);
+        }
+        session->epoch = epoch;
+    } else if(!session) {
+        // A sender that never said hello, or one still going from before a server restart, picks up at its window
+        session = open_session(server, packet->session, packet->window_base - 1);
+    }
+
+    session->client_addr = *addr;
+    session->client_addr_len = addr_len;
+    normalize_address(&session->client_addr, &session->client_addr_len);
+    session->last_active_ns = clock_now();
+
+    if(packet->flags & PACKET_HELLO) {
+        batch_ack(&server->acks, session, PACKET_HELLO);
+        return;
+    }
+
+    // Data goes to the decoder as it came off the wire, before decompression
+    recovered = fec_decode(&session->decoder, packet, server->recovered);
+
+    if(packet->flags & PACKET_PARITY) {
+        log_packet(LOG_SERVER, "Parity", packet->sequence, "Parity", 0);
+    } else {
+        session->echo_ns = packet->timestamp_ns;
+        send_now |= accept_packet(server, session, packet, "Received");
+    }
+
+    for(int i = 0; i < recovered; i++) {
+        server->recovered[i].session = session->id;
+        server->recovered[i].timestamp_ns = 0;
+        send_now |= accept_packet(server, session, &server->recovered[i], "Recovered");
+    }
+
+    if(send_now) {
+        batch_ack(&server->acks, session, 0);
+    }
+}
+
+static session_t *find_session(server_state_t *server, uint32_t id) {
+
+    for(int i = 0; i < SERVER_MAX_SESSIONS && server->sessions[i]; i++) {
+        if(server->sessions[i]->id == id) {
+            return server->sessions[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Takes a free slot, or the one of the session heard from least recently once all are in use
+static session_t *open_session(server_state_t *server, uint32_t id, int sequence_counter) {
+    session_t *session = NULL;
+    int i;
+
+    for(i = 0; i < SERVER_MAX_SESSIONS && server->sessions[i]; i++) {
+        if(!session || server->sessions[i]->last_active_ns < session->last_active_ns) {
+            session = server->sessions[i];
+        }
+    }
+
+    if(i < SERVER_MAX_SESSIONS) {
+        session = server->sessions[i] = malloc(sizeof(*session));
+        if(!session) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        log_event(LOG_SERVER, "Evicted session %08" PRIx32 " after Packet %d", session->id, session->sequence_counter);
+        count_recovery(server, &session->decoder);
+    }
+
+    session->id = id;
+    session->epoch = 0;
+    session->sequence_counter = sequence_counter;
+    session->ack = server->ack;
+    session->ack.pending = 0;
+    session->echo_ns = 0;
+    memset(&session->reorder, 0, sizeof(session->reorder));
+    fec_decoder_init(&session->decoder);
+    log_event(LOG_SERVER, "Opened session %08" PRIx32 " after Packet %d", id, sequence_counter);
+
+    return session;
+}
+
+// The client starts over just past the counter, so whatever its last connection left held is dropped
+static void resume_session(server_state_t *server, session_t *session) {
+
+    memset(&session->reorder, 0, sizeof(session->reorder));
+    count_recovery(server, &session->decoder);
+    fec_decoder_init(&session->decoder);
+    session->ack.pending = 0;
+    session->echo_ns = 0;
+    log_event(LOG_SERVER, "Resumed session %08" PRIx32 " after Packet %d", session->id, session->sequence_counter);
+}
+
+static void count_recovery(server_state_t *server, const fec_decoder_t *decoder) {
+    server->parity_received += decoder->parity_received;
+    server->parity_recovered += decoder->recovered;
+}
+
+// Decompresses and delivers a received or rebuilt data packet; returns 1 if its ACK should go now
+static int accept_packet(server_state_t *server, session_t *session, packet_t *packet, const char *action) {
+    int send_now;
+
+    if(!decompress_packet(&server->compressor, packet)) {
+        log_packet(LOG_SERVER, "Undecodable", packet->sequence, packet->payload, 0);
+        return 0;
+    }
+
+    log_packet(LOG_SERVER, action, packet->sequence, packet->payload, 0);
+    queue_ack(&session->ack, handle_packet(packet, &session->sequence_counter, &session->reorder), &send_now);
+
+    return send_now;
+}
+
+/*
+ * sequence_counter is the highest sequence received with nothing missing
+ * below it, and is what every ACK carries. Packets ahead of a gap are held
+ * until the gap fills or the sender moves window_base past it, meaning it gave
+ * up on the missing packets. A stop-and-wait client always sends
+ * window_base == sequence, so a new packet after a give-up is delivered at
+ * once as before.
+ *
+ * Delivery is per stream: a held packet that is next on its own stream is
+ * delivered straight away, so a gap only stalls the stream it belongs to. The
+ * sender numbers each stream in sequence order, so once the counter passes a
+ * held packet anything still missing before it on its stream was given up.
+ */
+static int handle_packet(packet_t *packet, int *sequence_counter, reorder_buffer_t *reorder) {
+
+    int slot;
+    int result = PACKET_IN_ORDER;
+
+    if(packet->window_base > *sequence_counter + 1) {
+        log_event(LOG_SERVER, "Sender skipped to Packet %d", packet->window_base);
+        skip_to(sequence_counter, reorder, packet->window_base);
+        deliver_held(sequence_counter, reorder);
+        result = PACKET_GAP;
+    }
+
+    // Re-acknowledged in case the ACK that covered it was lost
     if(packet->sequence < *sequence_counter) {
         log_packet(LOG_SERVER, "Ignored", packet->sequence, packet->payload, 0);
-        return 0;
+        return PACKET_DUPLICATE;
     } else if (packet->sequence == *sequence_counter) {
-        return 1;
-    } else {
-        log_event(LOG_SERVER, "Message: %s from Packet %d", packet->payload, packet->sequence);
+        return PACKET_DUPLICATE;
+    } else if (packet->sequence == *sequence_counter + 1) {
+        deliver(reorder, packet);
         (*sequence_counter) = packet->sequence;
+        deliver_held(sequence_counter, reorder);
+        return result;
+    } else if (packet->sequence - *sequence_counter > SERVER_REORDER_SLOTS) {
+        log_packet(LOG_SERVER, "Ignored", packet->sequence, packet->payload, 0);
+        return PACKET_IGNORED;
+    }
+
+    slot = packet->sequence % SERVER_REORDER_SLOTS;
+
+    if(reorder->held[slot]) {
+        return PACKET_DUPLICATE;
+    }
+
+    reorder->packets[slot] = *packet;
+    reorder->held[slot] = 1;
+    reorder->delivered[slot] = 0;
+
+    if(packet->stream_sequence == reorder->stream_next[packet->stream]) {
+        deliver_stream(*sequence_counter, reorder, packet->sequence);
+    } else {
+        log_packet(LOG_SERVER, "Buffered", packet->sequence, packet->payload, 0);
+    }
+
+    return PACKET_GAP;
+}
+
+// Delivers the held packets below window_base, stepping over the holes the sender gave up on
+static void skip_to(int *sequence_counter, reorder_buffer_t *reorder, int window_base) {
+
+    for(int next = *sequence_counter + 1; next < window_base && next - *sequence_counter <= SERVER_REORDER_SLOTS; next++) {
+        release_held(reorder, next);
+    }
+
+    *sequence_counter = window_base - 1;
+}
+
+// Delivers held packets that now follow the counter without a hole
+static void deliver_held(int *sequence_counter, reorder_buffer_t *reorder) {
+
+    while(release_held(reorder, *sequence_counter + 1)) {
+        (*sequence_counter)++;
+    }
+}
+
+static int release_held(reorder_buffer_t *reorder, int sequence) {
+    int slot = sequence % SERVER_REORDER_SLOTS;
+
+    if(!reorder->held[slot] || reorder->packets[slot].sequence != sequence) {
+        return 0;
+    }
+
+    if(!reorder->delivered[slot]) {
+        deliver(reorder, &reorder->packets[slot]);
+    }
+    reorder->held[slot] = 0;
+
+    return 1;
+}
+
+// Delivers the held packet at sequence and the held packets after it that continue its stream
+static void deliver_stream(int sequence_counter, reorder_buffer_t *reorder, int sequence) {
+    int stream = reorder->packets[sequence % SERVER_REORDER_SLOTS].stream;
+
+    for(; sequence - sequence_counter <= SERVER_REORDER_SLOTS; sequence++) {
+        int slot = sequence % SERVER_REORDER_SLOTS;
+        packet_t *held = &reorder->packets[slot];
+
+        if(!reorder->held[slot] || held->sequence != sequence || reorder->delivered[slot] || held->stream != stream) {
+            continue;
+        }
+
+        if(held->stream_sequence != reorder->stream_next[stream]) {
+            return;
+        }
+
+        deliver(reorder, held);
+        reorder->delivered[slot] = 1;
+    }
+}
+
+// Delivery order is settled here; with workers the payload is then processed and written behind the ACKs
+static void deliver(reorder_buffer_t *reorder, const packet_t *packet) {
+
+    if(workers) {
+        worker_pool_submit(workers, packet);
+    } else {
+        log_event(LOG_SERVER, "Message: %s from Packet %d on Stream %d", packet->payload, packet->sequence, packet->stream);
+    }
+    if(hop_trace) {
+        hop_trace_record(hop_trace, HOP_DELIVERED, 0, packet, clock_now());
+    }
+    reorder->stream_next[packet->stream] = packet->stream_sequence + 1;
+}
+
+// The work a delivered payload calls for; runs on a worker thread
+static void process_payload(work_item_t *item) {
+    snprintf(item->output, sizeof(item->output), "Message: %s from Packet %d on Stream %d", item->payload, item->sequence, item->stream);
+}
+
+// Runs on the output thread, in delivery order; that thread's clock is its own to refresh
+static void emit_payload(work_item_t *item) {
+    clock_refresh();
+    log_event(LOG_SERVER, "%s", item->output);
+}
+
+/*
+ * In-order packets are acknowledged every ack->every packets or ack->delay_us
+ * after the first unacknowledged one, whichever comes first. Duplicates and
+ * gaps are acknowledged at once so the sender learns about them quickly.
+ */
+static void queue_ack(ack_state_t *ack, int result, int *send_now) {
+
+    *send_now = 0;
+
+    if(result == PACKET_IGNORED) {
+        return;
+    }
+
+    if(result != PACKET_IN_ORDER || ack->every <= 1) {
+        *send_now = 1;
+        return;
+    }
+
+    if(ack->pending++ == 0) {
+        ack->deadline_ns = clock_now() + ack->delay_us * NS_PER_US;
+    }
+
+    if(ack->pending >= ack->every) {
+        *send_now = 1;
+    }
+}
+
+// Earliest coalesced ACK deadline of any session, INT64_MAX when none is pending
+static int64_t next_ack_deadline(const server_state_t *server) {
+    int64_t deadline_ns = INT64_MAX;
+
+    for(int i = 0; i < SERVER_MAX_SESSIONS && server->sessions[i]; i++) {
+        const ack_state_t *ack = &server->sessions[i]->ack;
+
+        if(ack->pending && ack->deadline_ns < deadline_ns) {
+            deadline_ns = ack->deadline_ns;
+        }
+    }
+
+    return deadline_ns;
+}
+
+static void expire_acks(server_state_t *server) {
+    int64_t now = clock_now();
+
+    for(int i = 0; i < SERVER_MAX_SESSIONS && server->sessions[i]; i++) {
+        session_t *session = server->sessions[i];
+
+        if(session->ack.pending && now >= session->ack.deadline_ns) {
+            batch_ack(&server->acks, session, 0);
+        }
+    }
+}
+
+// Returns 1 when a packet is ready, 0 when the ACK deadline passed first
+static int wait_for_packet(int sock_fd, int64_t deadline_ns) {
+
+    struct timeval timeout;
+    fd_set read_fds;
+    long remaining_us;
+    int ready;
+
+    if(deadline_ns == INT64_MAX) {
         return 1;
     }
+
+    remaining_us = (long)((deadline_ns - clock_refresh()) / NS_PER_US);
+
+    if(remaining_us <= 0) {
+        return 0;
+    }
+
+    timeout.tv_sec = remaining_us / 1000000;
+    timeout.tv_usec = remaining_us % 1000000;
+    FD_ZERO(&read_fds);
+    FD_SET(sock_fd, &read_fds);
+
+    ready = select(sock_fd + 1, &read_fds, NULL, NULL, &timeout);
+    clock_refresh();
+
+    if(ready == -1 && errno != EINTR) {
+        perror("Error with select");
+        exit(EXIT_FAILURE);
+    }
+
+    return ready > 0;
 }
 
-static void send_ack(int sock_fd, int sequence_num, packet_t *ack_packet, struct sockaddr_storage *client_addr, socklen_t *client_addr_len) {
+static void build_ack(packet_t *ack_packet, uint32_t session, int sequence_num, int64_t timestamp_ns, uint16_t flags) {
+    ack_packet->session = session;
+    ack_packet->timestamp_ns = timestamp_ns;
     ack_packet->sequence = sequence_num;
-    strncpy(ack_packet->payload, "Acknowledged", LINE_LEN);
+    ack_packet->window_base = 0;
+    ack_packet->stream_sequence = 0;
+    ack_packet->stream = 0;
+    ack_packet->flags = flags;
+    ack_packet->length = LINE_LEN;
+    strncpy(ack_packet->payload, flags & PACKET_HELLO ? "Hello" : "Acknowledged", LINE_LEN);
     ack_packet->payload[LINE_LEN - 1] = '\0';
+    ack_packet->checksum = packet_checksum(ack_packet);
+}
 
-    ssize_t bytes_sent = sendto(sock_fd, ack_packet, sizeof(*ack_packet), 0, (struct sockaddr *)client_addr, *client_addr_len);
-    log_packet(LOG_SERVER, "Sent", ack_packet->sequence, ack_packet->payload, 1);
+// Each queued ACK keeps the counter of its moment, so duplicate ACKs still reach the client one by one
+static void batch_ack(ack_batch_t *batch, session_t *session, uint16_t flags) {
+    int i = batch->count;
+    socklen_t addr_len;
 
+    build_ack(&batch->packets[i], session->id, session->sequence_counter, session->echo_ns, flags);
+    batch->addrs[i] = session->client_addr;
+    addr_len = session->client_addr_len;
+    if(batch->dual_stack) {
+        map_address(&batch->addrs[i], &addr_len);
+    }
+    batch->iovecs[i].iov_base = &batch->packets[i];
+    batch->iovecs[i].iov_len = packet_wire_len(&batch->packets[i]);
+    memset(&batch->messages[i], 0, sizeof(batch->messages[i]));
+    batch->messages[i].msg_hdr.msg_name = &batch->addrs[i];
+    batch->messages[i].msg_hdr.msg_namelen = addr_len;
+    batch->messages[i].msg_hdr.msg_iov = &batch->iovecs[i];
+    batch->messages[i].msg_hdr.msg_iovlen = 1;
+    log_packet(LOG_SERVER, "Sent", session->sequence_counter, batch->packets[i].payload, 1);
+    session->ack.pending = 0;
 
-    if(bytes_sent == -1) {
-        perror("Error sending packet to client");
-        exit(EXIT_FAILURE);
+    if(hop_trace) {
+        hop_trace_record(hop_trace, HOP_ACKED, 1, &batch->packets[i], clock_now());
     }
+
+    if(++batch->count == SERVER_PIPELINE_BATCH) {
+        flush_acks(batch);
+    }
+}
+
+static void flush_acks(ack_batch_t *batch) {
+    int sent = 0;
+
+    while(sent < batch->count) {
+        int result = sendmmsg(batch->sock_fd, batch->messages + sent, (unsigned int)(batch->count - sent), 0);
+
+        if(result == -1) {
+            perror("Error sending packets to client");
+            exit(EXIT_FAILURE);
+        }
+        sent += result;
+        batch->sends++;
+    }
+
+    batch->sent += (uint64_t)batch->count;
+    batch->count = 0;
 }
\ No newline at end of file
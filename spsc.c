@@ -0,0 +1,116 @@
+#include "common.h"
+#include "spsc.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+
+static void wake(spsc_ring_t *ring);
+
+// capacity must be a power of two
+void spsc_init(spsc_ring_t *ring, size_t slot_size, size_t capacity) {
+
+    memset(ring, 0, sizeof(*ring));
+
+    // Whole cache lines per slot, so neighbouring slots never share one
+    ring->slot_size = (slot_size + SPSC_CACHE_LINE - 1) & ~(size_t)(SPSC_CACHE_LINE - 1);
+    ring->mask = capacity - 1;
+    ring->slots = aligned_alloc(SPSC_CACHE_LINE, ring->slot_size * capacity);
+    if(!ring->slots) {
+        perror("aligned_alloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    ring->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ring->wake_fd == -1) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void spsc_destroy(spsc_ring_t *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+    close(ring->wake_fd);
+}
+
+// Producer: the slot to fill next, or NULL while the ring is full
+void *spsc_claim(spsc_ring_t *ring) {
+
+    if(ring->tail - ring->head_cache > ring->mask) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if(ring->tail - ring->head_cache > ring->mask) {
+            return NULL;
+        }
+    }
+
+    return ring->slots + (ring->tail & ring->mask) * ring->slot_size;
+}
+
+void spsc_publish(spsc_ring_t *ring) {
+
+    // Sequentially consistent on both sides: either spsc_wait sees the new tail or this sees it sleeping
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST)) {
+        wake(ring);
+    }
+}
+
+// Producer: no more slots will be published
+void spsc_close(spsc_ring_t *ring) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+    wake(ring);
+}
+
+// Consumer: the oldest published slot, or NULL while the ring is empty
+void *spsc_peek(spsc_ring_t *ring) {
+
+    if(ring->head == ring->tail_cache) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if(ring->head == ring->tail_cache) {
+            return NULL;
+        }
+    }
+
+    return ring->slots + (ring->head & ring->mask) * ring->slot_size;
+}
+
+void spsc_release(spsc_ring_t *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Consumer: blocks until a slot is published, the ring is closed or timeout_ms passes; returns 0 on timeout
+int spsc_wait(spsc_ring_t *ring, int timeout_ms) {
+    struct pollfd pending = {ring->wake_fd, POLLIN, 0};
+    uint64_t count;
+    int ready;
+
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head || __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    ready = poll(&pending, 1, timeout_ms);
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+
+    if(ready == -1 && errno != EINTR) {
+        perror("Error with poll");
+        exit(EXIT_FAILURE);
+    }
+
+    if(ready > 0 && read(ring->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("Error reading eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    return ready != 0;
+}
+
+static void wake(spsc_ring_t *ring) {
+    uint64_t one = 1;
+
+    if(write(ring->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("Error writing eventfd");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include "common.h"
+
+#define SPSC_CACHE_LINE 64
+
+/*
+ * Lock-free single-producer single-consumer ring of preallocated fixed-size
+ * slots. The producer's and consumer's indices live on separate cache lines,
+ * and each side keeps a private copy of the other's index, only rereading the
+ * shared one when its copy says the ring is full or empty. A consumer that
+ * runs dry can sleep on an eventfd the producer only writes while it sleeps.
+ */
+typedef struct spsc_ring {
+    unsigned char *slots;
+    size_t        slot_size;
+    size_t        mask;
+    int           wake_fd;
+
+    _Alignas(SPSC_CACHE_LINE) size_t tail;      // next slot to publish, written by the producer
+    size_t        head_cache;                   // producer's last look at head
+
+    _Alignas(SPSC_CACHE_LINE) size_t head;      // next slot to consume, written by the consumer
+    size_t        tail_cache;                   // consumer's last look at tail
+
+    _Alignas(SPSC_CACHE_LINE) int sleeping;     // consumer is blocked in spsc_wait
+    int           closed;
+} spsc_ring_t;
+
+void spsc_init(spsc_ring_t *ring, size_t slot_size, size_t capacity);
+void spsc_destroy(spsc_ring_t *ring);
+void *spsc_claim(spsc_ring_t *ring);
+void spsc_publish(spsc_ring_t *ring);
+void spsc_close(spsc_ring_t *ring);
+void *spsc_peek(spsc_ring_t *ring);
+void spsc_release(spsc_ring_t *ring);
+int spsc_wait(spsc_ring_t *ring, int timeout_ms);
+
+#endif
@@ -0,0 +1,150 @@
+"""
+Replays a session's hello in the middle of its stream and checks the server
+takes it for the late copy it is. Packet 2 is delivered ahead of a gap on its
+own stream, the first hello is sent again byte for byte, and then packet 1 and
+a retransmission of packet 2 arrive. Each message has to come out once. A
+hello with a new epoch, as a restarted client sends, must still resume.
+
+Then DIR/client sends a few lines and is run again with the session id it
+printed, which has to resume that session rather than open a new one. An id of
+only digits is given too, since it must still be read as hex.
+
+    python3 test_hello.py [DIR]        runs DIR/server and DIR/client, default .
+
+TEST_IP and TEST_SERVER_PORT override the loopback endpoint.
+"""
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+HEADER = struct.Struct("<IIqiiiHHH")
+PACKET_HELLO = 0x8
+
+
+def crc32c_table():
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x82F63B78 if crc & 1 else crc >> 1
+        table.append(crc)
+    return table
+
+
+TABLE = crc32c_table()
+
+
+def crc32c(data):
+    crc = 0xFFFFFFFF
+    for byte in data:
+        crc = TABLE[(crc ^ byte) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+
+def packet(session, sequence, payload, stream=0, stream_sequence=0, flags=0, window_base=0):
+    body = payload.encode() + b"\0"
+    header = HEADER.pack(0, session, 0, sequence, window_base, stream_sequence, stream, flags, len(body))
+    wire = header + body
+    return struct.pack("<I", crc32c(wire[4:])) + wire[4:]
+
+
+def exchange(sock, addr, datagram, want_flags):
+    """Sends and returns the sequence of the first reply with the wanted hello flag."""
+    sock.sendto(datagram, addr)
+    deadline = time.monotonic() + 2
+    while time.monotonic() < deadline:
+        try:
+            reply = sock.recv(2048)
+        except socket.timeout:
+            break
+        fields = HEADER.unpack_from(reply)
+        if fields[7] & PACKET_HELLO == want_flags:
+            return fields[3]
+    sys.exit("FAIL: no reply from the server")
+
+
+def run_client(client, ip, port, lines, *args):
+    """Runs the client over lines and returns the session id it printed."""
+    result = subprocess.run([client, "--target-ip", ip, "--target-port", str(port), "--timeout", "1", "--max-retries", "3", *args],
+                            input="".join(line + "\n" for line in lines), capture_output=True, text=True, timeout=30)
+    if result.returncode != 0:
+        sys.exit(f"FAIL: client {' '.join(args)} exited with {result.returncode}: {result.stderr.strip()}")
+    for line in result.stderr.splitlines():
+        if line.startswith("Session "):
+            return line.split()[1]
+    sys.exit("FAIL: the client did not print its session")
+
+
+def main():
+    directory = sys.argv[1] if len(sys.argv) > 1 else "."
+    server = os.path.abspath(os.path.join(directory, "server"))
+    client = os.path.abspath(os.path.join(directory, "client"))
+    ip = os.environ.get("TEST_IP", "127.0.0.1")
+    port = int(os.environ.get("TEST_SERVER_PORT", "9200"))
+    session = 0x5ea1ed01
+
+    with tempfile.TemporaryDirectory() as work:
+        proc = subprocess.Popen([server, "--listen-ip", ip, "--listen-port", str(port), "-l"], cwd=work,
+                                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(0.3)
+
+        try:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            sock.settimeout(0.5)
+            addr = (ip, port)
+
+            hello = packet(session, 0, "Hello", stream_sequence=0x1234, flags=PACKET_HELLO)
+            exchange(sock, addr, hello, PACKET_HELLO)
+
+            exchange(sock, addr, packet(session, 0, "m0", stream=0, stream_sequence=0), 0)
+            # Packet 1 is missing; packet 2 is first on stream 1 and goes out ahead of it
+            exchange(sock, addr, packet(session, 2, "m2", stream=1, stream_sequence=0), 0)
+
+            exchange(sock, addr, hello, PACKET_HELLO)
+
+            exchange(sock, addr, packet(session, 1, "m1", stream=0, stream_sequence=1), 0)
+            exchange(sock, addr, packet(session, 2, "m2", stream=1, stream_sequence=0), 0)
+
+            restarted = packet(session, 3, "Hello", stream_sequence=0x5678, flags=PACKET_HELLO)
+            exchange(sock, addr, restarted, PACKET_HELLO)
+
+            printed = run_client(client, ip, port, ["r0", "r1"])
+            resumed = run_client(client, ip, port, ["r2"], "--session", printed)
+            digits = run_client(client, ip, port, ["d0"], "--session", "12345678")
+        finally:
+            proc.send_signal(signal.SIGINT)
+            proc.wait(timeout=5)
+
+        with open(os.path.join(work, "log", "server_log.txt")) as f:
+            log = f.read()
+
+    messages = [line.split("Message: ")[1].split(" from Packet")[0] for line in log.splitlines() if " Message: " in line]
+    delivered = sorted(message for message in messages if message.startswith("m"))
+    failures = []
+    if delivered != ["m0", "m1", "m2"]:
+        failures.append(f"delivered {delivered}, expected m0, m1 and m2 once each")
+    if "Repeated hello" not in log:
+        failures.append("the replayed hello was not recognised")
+    if "Resumed session" not in log:
+        failures.append("a hello with a new epoch did not resume the session")
+    if resumed != printed or f"Resumed session {printed}" not in log or log.count(f"Opened session {printed}") != 1:
+        failures.append(f"--session {printed}, as the client printed it, did not resume that session")
+    if [message for message in messages if message.startswith("r")] != ["r0", "r1", "r2"]:
+        failures.append("the resumed session did not carry on where the first run stopped")
+    if digits != "12345678" or "Opened session 12345678" not in log:
+        failures.append(f"--session 12345678 was taken as session {digits}")
+
+    for failure in failures:
+        print(f"FAIL: {failure}", file=sys.stderr)
+    if failures:
+        sys.exit(1)
+    print("PASS: a replayed hello left the stream alone, a new epoch resumed it, and so did the printed id")
+
+
+if __name__ == "__main__":
+    main()
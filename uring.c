@@ -0,0 +1,227 @@
+#include "common.h"
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * Minimal io_uring wrapper over the raw syscalls, so the proxy does not
+ * depend on liburing. Only what the proxy datapath needs is provided.
+ */
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    ring->ring_fd = io_uring_setup(entries, &params);
+
+    if(ring->ring_fd < 0 && errno == EINVAL) {
+        // Older kernel, retry without the optional setup flags
+        memset(&params, 0, sizeof(params));
+        ring->ring_fd = io_uring_setup(entries, &params);
+    }
+
+    if(ring->ring_fd < 0) {
+        return -1;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED) {
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_len);
+            close(ring->ring_fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        if(ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_len);
+        }
+        munmap(ring->sq_ptr, ring->sq_len);
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    ring->sq_head  = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head  = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+
+    ring->sqe_tail = *ring->sq_tail;
+    ring->sqe_head = ring->sqe_tail;
+
+    return 0;
+}
+
+void uring_close(uring_t *ring) {
+
+    if(ring->buf_ring) {
+        struct io_uring_buf_reg reg;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = ring->buf_group;
+        io_uring_register(ring->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(ring->buf_ring, ring->buf_ring_len);
+        free(ring->buf_base);
+    }
+
+    munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->ring_fd);
+}
+
+// Returns NULL when the submission queue is full; the caller must submit first
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if(ring->sqe_tail - head > *ring->sq_mask) {
+        return NULL;
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr) {
+    unsigned tail = *ring->sq_tail;
+    unsigned to_submit = ring->sqe_tail - ring->sqe_head;
+    unsigned flags = 0;
+    int ret;
+
+    while(ring->sqe_head != ring->sqe_tail) {
+        ring->sq_array[tail & *ring->sq_mask] = ring->sqe_head & *ring->sq_mask;
+        tail++;
+        ring->sqe_head++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    if(wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    if(to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    ret = io_uring_enter(ring->ring_fd, to_submit, wait_nr, flags);
+
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_setup_buf_ring(uring_t *ring, unsigned entries, unsigned buf_size, unsigned short buf_group) {
+    struct io_uring_buf_reg reg;
+
+    ring->buf_ring_len = entries * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if(ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buf_base = malloc((size_t)entries * buf_size);
+    if(!ring->buf_base) {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->buf_ring;
+    reg.ring_entries = entries;
+    reg.bgid = buf_group;
+
+    if(io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+        free(ring->buf_base);
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buf_entries = entries;
+    ring->buf_size = buf_size;
+    ring->buf_group = buf_group;
+    ring->buf_ring->tail = 0;
+
+    for(unsigned bid = 0; bid < entries; bid++) {
+        uring_buf_recycle(ring, (unsigned short) bid);
+    }
+
+    return 0;
+}
+
+void *uring_buf(uring_t *ring, unsigned short bid) {
+    return ring->buf_base + (size_t)bid * ring->buf_size;
+}
+
+// Hands a provided buffer back to the kernel; no syscall, the tail is shared memory
+void uring_buf_recycle(uring_t *ring, unsigned short bid) {
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (ring->buf_entries - 1)];
+
+    buf->addr = (unsigned long) uring_buf(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+
+    __atomic_store_n(&ring->buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,44 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <stddef.h>
+
+typedef struct uring {
+    int                       ring_fd;
+    unsigned                  *sq_head;
+    unsigned                  *sq_tail;
+    unsigned                  *sq_mask;
+    unsigned                  *sq_array;
+    unsigned                  *cq_head;
+    unsigned                  *cq_tail;
+    unsigned                  *cq_mask;
+    struct io_uring_sqe       *sqes;
+    struct io_uring_cqe       *cqes;
+    void                      *sq_ptr;
+    size_t                    sq_len;
+    void                      *cq_ptr;
+    size_t                    cq_len;
+    size_t                    sqes_len;
+    unsigned                  sqe_tail;
+    unsigned                  sqe_head;
+    struct io_uring_buf_ring  *buf_ring;
+    size_t                    buf_ring_len;
+    unsigned                  buf_entries;
+    unsigned                  buf_size;
+    unsigned short            buf_group;
+    char                      *buf_base;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+void uring_close(uring_t *ring);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+int uring_setup_buf_ring(uring_t *ring, unsigned entries, unsigned buf_size, unsigned short buf_group);
+void *uring_buf(uring_t *ring, unsigned short bid);
+void uring_buf_recycle(uring_t *ring, unsigned short bid);
+
+#endif
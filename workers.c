@@ -0,0 +1,144 @@
+#include "common.h"
+#include "workers.h"
+#include <sched.h>
+
+static void *worker_main(void *arg);
+static void *output_main(void *arg);
+
+// Threads start with SIGINT blocked so it keeps interrupting the receive loop
+void worker_pool_init(worker_pool_t *pool, int count, work_fn process, work_fn emit) {
+    sigset_t blocked;
+    sigset_t previous;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->count = count;
+    pool->emit = emit;
+
+    pool->workers = calloc((size_t) count, sizeof(worker_t));
+    if(!pool->workers) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+    for(int i = 0; i < count; i++) {
+        worker_t *worker = &pool->workers[i];
+
+        worker->process = process;
+        spsc_init(&worker->input, sizeof(work_item_t), SERVER_WORKER_SLOTS);
+        spsc_init(&worker->done, sizeof(work_item_t), SERVER_WORKER_SLOTS);
+
+        if(pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(pthread_create(&pool->output_thread, NULL, output_main, pool) != 0) {
+        fprintf(stderr, "Failed to start output thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+// Waits for room rather than drop: the payload is already acknowledged
+void worker_pool_submit(worker_pool_t *pool, const packet_t *packet) {
+    worker_t *worker = &pool->workers[pool->submitted % (uint64_t) pool->count];
+    work_item_t *item = spsc_claim(&worker->input);
+
+    if(!item) {
+        pool->stalls++;
+        while(!(item = spsc_claim(&worker->input))) {
+            sched_yield();
+        }
+    }
+
+    item->session = packet->session;
+    item->sequence = packet->sequence;
+    item->stream = packet->stream;
+    memcpy(item->payload, packet->payload, LINE_LEN);
+    item->payload[LINE_LEN - 1] = '\0';
+
+    spsc_publish(&worker->input);
+    pool->submitted++;
+}
+
+// Everything submitted is processed and written before this returns
+void worker_pool_close(worker_pool_t *pool) {
+
+    for(int i = 0; i < pool->count; i++) {
+        spsc_close(&pool->workers[i].input);
+    }
+
+    for(int i = 0; i < pool->count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_join(pool->output_thread, NULL);
+
+    for(int i = 0; i < pool->count; i++) {
+        spsc_destroy(&pool->workers[i].input);
+        spsc_destroy(&pool->workers[i].done);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+
+    for(;;) {
+        work_item_t *item = spsc_peek(&worker->input);
+        work_item_t *result;
+
+        if(!item) {
+            if(__atomic_load_n(&worker->input.closed, __ATOMIC_ACQUIRE) && !spsc_peek(&worker->input)) {
+                break;
+            }
+            spsc_wait(&worker->input, -1);
+            continue;
+        }
+
+        worker->process(item);
+
+        // The output thread drains in order, so a full ring only means it is behind
+        while(!(result = spsc_claim(&worker->done))) {
+            sched_yield();
+        }
+        memcpy(result, item, sizeof(*item));
+        spsc_publish(&worker->done);
+        spsc_release(&worker->input);
+    }
+
+    spsc_close(&worker->done);
+
+    return NULL;
+}
+
+// Payload n is at the head of worker n % count once it is done
+static void *output_main(void *arg) {
+    worker_pool_t *pool = arg;
+
+    for(uint64_t next = 0;; ) {
+        worker_t *worker = &pool->workers[next % (uint64_t) pool->count];
+        work_item_t *item = spsc_peek(&worker->done);
+
+        if(!item) {
+            // A closed, empty ring means its worker had nothing more, and so nothing later is coming either
+            if(__atomic_load_n(&worker->done.closed, __ATOMIC_ACQUIRE) && !spsc_peek(&worker->done)) {
+                break;
+            }
+            spsc_wait(&worker->done, -1);
+            continue;
+        }
+
+        pool->emit(item);
+        spsc_release(&worker->done);
+        next++;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "common.h"
+#include "spsc.h"
+#include <pthread.h>
+
+/*
+ * Payload processing off the packet-handling thread. Delivered payloads are
+ * numbered in delivery order and dealt round-robin to the workers, each
+ * through its own SPSC ring; a worker finishes its payloads in the order it
+ * got them, into a second ring. The output thread then reads those rings in
+ * turn, so results come out in delivery order however the work interleaves,
+ * without a reorder buffer. ACKs never wait for any of it.
+ */
+
+typedef struct work_item {
+    uint32_t session;
+    int32_t  sequence;
+    uint16_t stream;
+    char     payload[LINE_LEN];
+    char     output[LINE_LEN + 64];     // what the output thread writes
+} work_item_t;
+
+typedef void (*work_fn)(work_item_t *item);
+
+typedef struct worker {
+    pthread_t   thread;
+    spsc_ring_t input;
+    spsc_ring_t done;
+    work_fn     process;
+} worker_t;
+
+typedef struct worker_pool {
+    worker_t  *workers;
+    int       count;
+    uint64_t  submitted;        // also the next payload's number
+    uint64_t  stalls;           // submits that found their worker's ring full
+    work_fn   emit;
+    pthread_t output_thread;
+} worker_pool_t;
+
+void worker_pool_init(worker_pool_t *pool, int count, work_fn process, work_fn emit);
+void worker_pool_submit(worker_pool_t *pool, const packet_t *packet);
+void worker_pool_close(worker_pool_t *pool);
+
+#endif